@@ -0,0 +1,74 @@
+// mcclient - sends a compile request to a running `mccomp --server` and
+// prints its result, so each compile costs a socket round trip rather than
+// a process start and LLVM initialisation.
+//
+//   ./mcclient SocketPath [mccomp arguments...]
+//
+// The protocol is described in mcprotocol.h, which the server shares. An input
+// file named "-" is read from this process's standard input.
+
+#include "mcprotocol.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+using mcprotocol::readField;
+using mcprotocol::writeField;
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: ./mcclient SocketPath [mccomp arguments...]\n";
+    return 1;
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path is too long: " << argv[1] << "\n";
+    return 1;
+  }
+  strcpy(address.sun_path, argv[1]);
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || ::connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+    std::cerr << "Could not connect to " << argv[1] << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  std::vector<char> cwd(4096);
+  if (!getcwd(cwd.data(), cwd.size())) {
+    std::cerr << "Could not get the working directory: " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  bool hasStdin = false;
+  for (int i = 2; i < argc; i++)
+    hasStdin |= std::string(argv[i]) == "-";
+  std::string stdinText;
+  if (hasStdin)
+    stdinText.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+
+  bool sent = writeField(fd, cwd.data()) && writeField(fd, hasStdin ? "1" : "0") &&
+              writeField(fd, stdinText) && writeField(fd, std::to_string(argc - 2));
+  for (int i = 2; sent && i < argc; i++)
+    sent = writeField(fd, argv[i]);
+
+  std::string status, out, err;
+  if (!sent || !readField(fd, status) || !readField(fd, out) || !readField(fd, err)) {
+    std::cerr << "Lost the connection to the compile server\n";
+    return 1;
+  }
+  ::close(fd);
+
+  fwrite(out.data(), 1, out.size(), stdout);
+  fwrite(err.data(), 1, err.size(), stderr);
+  return std::stoi(status);
+}
@@ -1,7 +1,20 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
@@ -11,34 +24,70 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
 #include "llvm/TargetParser/Host.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "mccomp.h"
+#include "mcprotocol.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
+#include <mutex>
 #include <queue>
+#include <set>
 #include <string.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <string>
 #include <system_error>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 using namespace llvm;
 using namespace llvm::sys;
 
-FILE *pFile;
-static bool errorReported = false;
-
+// Everything but the API of mccomp.h is in mccomp::detail, so that a
+// program linking libmccomp.a is free to use names such as Lexer and Parser
+namespace mccomp {
+namespace detail {
 
 // to do:
 // add a ast to handle empty comma
@@ -101,6 +150,10 @@ enum TOKEN_TYPE {
   GE = -23,      // greater than or equal to
   GT = int('>'), // greater than
 
+  // preprocessing
+  STRING_LIT = -24, // "..." naming the file to include
+  INCLUDE = -25,    // "#include"
+
   // special tokens
   EOF_TOK = 0, // signal end of file
 
@@ -114,31 +167,51 @@ struct TOKEN {
   std::string lexeme;
   int lineNo;
   int columnNo;
+  size_t offset = 0; // of the first character in the source
 };
 
-static std::string IdentifierStr; // Filled in if IDENT
-static int IntVal;                // Filled in if INT_LIT
-static bool BoolVal;              // Filled in if BOOL_LIT
-static float FloatVal;            // Filled in if FLOAT_LIT
-static std::string StringVal;     // Filled in if String Literal
-static int lineNo, columnNo;
+/// Lexer - turns a source buffer into TOKENs. All of the lexer state lives in
+/// the object rather than in globals so several files can be lexed at once.
+class Lexer {
+  StringRef Source;
+  size_t Pos = 0;
+  int LastChar = ' ';
+  int NextChar = ' ';
+
+  // getChar - the in-memory equivalent of getc()
+  int getChar() {
+    return Pos < Source.size() ? (unsigned char)Source[Pos++] : EOF;
+  }
 
-static TOKEN returnTok(std::string lexVal, int tok_type) {
-  TOKEN return_tok;
-  return_tok.lexeme = lexVal;
-  return_tok.type = tok_type;
-  return_tok.lineNo = lineNo;
-  return_tok.columnNo = columnNo - lexVal.length() - 1;
-  return return_tok;
-}
+  size_t TokStart = 0; // offset of the token being lexed
+
+public:
+  std::string IdentifierStr; // Filled in if IDENT
+  int IntVal;                // Filled in if INT_LIT
+  bool BoolVal;              // Filled in if BOOL_LIT
+  float FloatVal;            // Filled in if FLOAT_LIT
+  std::string StringVal;     // Filled in if String Literal
+  int lineNo = 1, columnNo = 1;
+
+  Lexer(StringRef source) : Source(source) {}
+
+  TOKEN returnTok(std::string lexVal, int tok_type) {
+    TOKEN return_tok;
+    return_tok.lexeme = lexVal;
+    return_tok.type = tok_type;
+    return_tok.lineNo = lineNo;
+    return_tok.columnNo = columnNo - lexVal.length() - 1;
+    return_tok.offset = TokStart;
+    return return_tok;
+  }
+
+  TOKEN gettok();
+};
 
 // Read file line by line -- or look for \n and if found add 1 to line number
 // and reset column number to 0
-/// gettok - Return the next token from standard input.
-static TOKEN gettok() {
-
-  static int LastChar = ' ';
-  static int NextChar = ' ';
+/// gettok - Return the next token from the source buffer.
+TOKEN Lexer::gettok() {
 
   // Skip any whitespace.
   while (isspace(LastChar)) {
@@ -146,16 +219,17 @@ static TOKEN gettok() {
       lineNo++;
       columnNo = 1;
     }
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
   }
+  TokStart = LastChar == EOF ? Pos : Pos - 1;
 
   if (isalpha(LastChar) ||
       (LastChar == '_')) { // identifier: [a-zA-Z_][a-zA-Z_0-9]*
     IdentifierStr = LastChar;
     columnNo++;
 
-    while (isalnum((LastChar = getc(pFile))) || (LastChar == '_')) {
+    while (isalnum((LastChar = getChar())) || (LastChar == '_')) {
       IdentifierStr += LastChar;
       columnNo++;
     }
@@ -193,9 +267,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '=') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '=') { // EQ: ==
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok("==", EQ);
     } else {
@@ -206,32 +280,32 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '{') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok("{", LBRA);
   }
   if (LastChar == '}') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok("}", RBRA);
   }
   if (LastChar == '(') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok("(", LPAR);
   }
   if (LastChar == ')') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok(")", RPAR);
   }
   if (LastChar == ';') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok(";", SC);
   }
   if (LastChar == ',') {
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     return returnTok(",", COMMA);
   }
@@ -242,7 +316,7 @@ static TOKEN gettok() {
     if (LastChar == '.') { // Floatingpoint Number: .[0-9]+
       do {
         NumStr += LastChar;
-        LastChar = getc(pFile);
+        LastChar = getChar();
         columnNo++;
       } while (isdigit(LastChar));
 
@@ -251,14 +325,14 @@ static TOKEN gettok() {
     } else {
       do { // Start of Number: [0-9]+
         NumStr += LastChar;
-        LastChar = getc(pFile);
+        LastChar = getChar();
         columnNo++;
       } while (isdigit(LastChar));
 
       if (LastChar == '.') { // Floatingpoint Number: [0-9]+.[0-9]+)
         do {
           NumStr += LastChar;
-          LastChar = getc(pFile);
+          LastChar = getChar();
           columnNo++;
         } while (isdigit(LastChar));
 
@@ -272,9 +346,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '&') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '&') { // AND: &&
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok("&&", AND);
     } else {
@@ -285,9 +359,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '|') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '|') { // OR: ||
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok("||", OR);
     } else {
@@ -298,9 +372,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '!') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '=') { // NE: !=
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok("!=", NE);
     } else {
@@ -312,9 +386,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '<') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '=') { // LE: <=
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok("<=", LE);
     } else {
@@ -325,9 +399,9 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '>') {
-    NextChar = getc(pFile);
+    NextChar = getChar();
     if (NextChar == '=') { // GE: >=
-      LastChar = getc(pFile);
+      LastChar = getChar();
       columnNo += 2;
       return returnTok(">=", GE);
     } else {
@@ -338,11 +412,11 @@ static TOKEN gettok() {
   }
 
   if (LastChar == '/') { // could be division or could be the start of a comment
-    LastChar = getc(pFile);
+    LastChar = getChar();
     columnNo++;
     if (LastChar == '/') { // definitely a comment
       do {
-        LastChar = getc(pFile);
+        LastChar = getChar();
         columnNo++;
       } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
@@ -352,6 +426,31 @@ static TOKEN gettok() {
       return returnTok("/", DIV);
   }
 
+  if (LastChar == '#') { // directive: #include is the only one there is
+    std::string Directive = "#";
+    columnNo++;
+    while (isalpha((LastChar = getChar()))) {
+      Directive += LastChar;
+      columnNo++;
+    }
+    return returnTok(Directive, Directive == "#include" ? INCLUDE : INVALID);
+  }
+
+  if (LastChar == '"') { // String literal: "[^"\n]*"
+    StringVal = "";
+    columnNo++;
+    while ((LastChar = getChar()) != '"' && LastChar != EOF && LastChar != '\n' &&
+           LastChar != '\r') {
+      StringVal += LastChar;
+      columnNo++;
+    }
+    if (LastChar != '"') // unterminated
+      return returnTok(StringVal, INVALID);
+    LastChar = getChar();
+    columnNo++;
+    return returnTok(StringVal, STRING_LIT);
+  }
+
   // Check for end of file.  Don't eat the EOF.
   if (LastChar == EOF) {
     columnNo++;
@@ -361,52 +460,93 @@ static TOKEN gettok() {
   // Otherwise, just return the character as its ascii value.
   int ThisChar = LastChar;
   std::string s(1, ThisChar);
-  LastChar = getc(pFile);
+  LastChar = getChar();
   columnNo++;
   return returnTok(s, int(ThisChar));
 }
 
-//===----------------------------------------------------------------------===//
-// Parser
-//===----------------------------------------------------------------------===//
-
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static TOKEN CurTok;
-static std::deque<TOKEN> tok_buffer;
-
-static TOKEN getNextToken() {
+/// TokenRing - a fixed size queue of tokens from a lexer running on its own
+/// thread to the parser. There is exactly one producer and one consumer, so
+/// neither side takes a lock: each owns one index and publishes it with a
+/// release store. A side that finds the ring full (or empty) yields until
+/// the other catches up, and the time it spends doing so is recorded.
+class TokenRing {
+  static const size_t Capacity = 4096;
+  std::vector<TOKEN> Slots;
+  std::atomic<size_t> Head{0}; // next token to read, written by the consumer
+  std::atomic<size_t> Tail{0}; // next slot to write, written by the producer
+  std::atomic<bool> Closed{false};
+  TOKEN EndToken; // once the consumer has seen EOF_TOK it keeps getting it
 
-  if (tok_buffer.size() == 0)
-    tok_buffer.push_back(gettok());
+public:
+  using Clock = std::chrono::steady_clock;
+  Clock::duration ProducerStalled{}, ConsumerStalled{};
+
+  TokenRing() : Slots(Capacity) {}
+
+  // Producer side. Returns false if the consumer has gone away.
+  bool push(TOKEN tok) {
+    size_t tail = Tail.load(std::memory_order_relaxed);
+    if (tail - Head.load(std::memory_order_acquire) == Capacity) {
+      Clock::time_point start = Clock::now();
+      while (tail - Head.load(std::memory_order_acquire) == Capacity) {
+        if (Closed.load(std::memory_order_acquire))
+          return false;
+        std::this_thread::yield();
+      }
+      ProducerStalled += Clock::now() - start;
+    }
+    Slots[tail % Capacity] = std::move(tok);
+    Tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
 
-  TOKEN temp = tok_buffer.front();
-  tok_buffer.pop_front();
+  // Consumer side
+  TOKEN pop() {
+    if (EndToken.type == EOF_TOK)
+      return EndToken;
+    size_t head = Head.load(std::memory_order_relaxed);
+    if (head == Tail.load(std::memory_order_acquire)) {
+      Clock::time_point start = Clock::now();
+      while (head == Tail.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      ConsumerStalled += Clock::now() - start;
+    }
+    TOKEN tok = std::move(Slots[head % Capacity]);
+    Head.store(head + 1, std::memory_order_release);
+    if (tok.type == EOF_TOK)
+      EndToken = tok;
+    return tok;
+  }
 
-  return CurTok = temp;
-}
+  // Called by the consumer when it wants no more tokens, so that a producer
+  // waiting for room can stop
+  void close() { Closed.store(true, std::memory_order_release); }
+};
 
-static void putBackToken(TOKEN tok) { tok_buffer.push_front(tok); }
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
 
-static void clearTokBuffer() {  //clear the buffer at the end
-  while(tok_buffer.size() != 0) 
-  {
-    tok_buffer.pop_front();
-  } 
+// located - record the token a node was built from so that semantic errors can
+// report a line and column
+template <typename T>
+static std::unique_ptr<T> located(std::unique_ptr<T> node, const TOKEN &tok) {
+  node->setLocation(tok);
+  return node;
 }
 
 //===----------------------------------------------------------------------===//
 // AST nodes
 //===----------------------------------------------------------------------===//
 
-static int indentDepth = 0;
-
+// The AST printer's indentation is passed down through to_string() as
+// indentDepth rather than kept in a global.
 
 // void dedent(){
 //   indentDepth = (indentDepth > 0) ? indentDepth = indentDepth - indentDepth : indentDepth;
 // }
-void dedent() {
+void dedent(int &indentDepth) {
   if (indentDepth >= 4) indentDepth -= 4;
 }
 
@@ -423,7 +563,7 @@ void dedent() {
 //   indentDepth += 4;
 //   return std::string(indentDepth, ' ');
 // }
-std::string indent()
+std::string indent(int &indentDepth)
 {
   indentDepth += 4;
   std::string out = "";
@@ -442,7 +582,7 @@ std::string indent()
   return out;
 }
 
-std::string startIndent(){
+std::string startIndent(int indentDepth){
   return std::string(indentDepth, ' ');
 }
 
@@ -451,12 +591,89 @@ std::string startIndent(){
 
 
 
+class ASTnode;
+class FunctionAST;
+class PrototypeAST;
+class VariableASTnode;
+struct ModuleDeclarations;
+class LocalScope;
+struct GlobalScope;
+class CodeGenerator;
+class Interpreter;
+union RunValue;
+class BytecodeCompiler;
+struct BytecodeLabel;
+
+// A Diagnostic is an error found after parsing, kept so that errors found on
+// different threads can be reported together in source order
+struct Diagnostic {
+  int lineNo;
+  int columnNo;
+  std::string message;
+};
+
+typedef std::vector<Diagnostic> DiagnosticList;
+
+// A Fingerprint is the normalised form of a function used to key the
+// compilation cache
+struct Fingerprint {
+  std::string Text;
+  std::set<std::string> References; // variables and functions used
+  bool Lines = false; // include the lines -perf attributes code to
+};
+
 /// ASTnode - Base class for all AST nodes.
 class ASTnode {
+protected:
+  int LineNo = 0, ColumnNo = 0;
+  std::string ExprType; // "int", "float", "bool" or "void", set by check()
+
 public:
   virtual ~ASTnode() {}
-  // virtual Value *codegen() = 0;
-  virtual std::string to_string() const {return "";};
+  virtual Value *codegen(CodeGenerator &gen) { return nullptr; }
+  virtual std::string to_string(int &indentDepth) const {return "";};
+
+  void setLocation(const TOKEN &tok) {
+    LineNo = tok.lineNo;
+    ColumnNo = tok.columnNo;
+  }
+  void setLocation(const ASTnode &node) {
+    LineNo = node.LineNo;
+    ColumnNo = node.ColumnNo;
+  }
+  int getLineNo() const { return LineNo; }
+  int getColumnNo() const { return ColumnNo; }
+  const std::string &getExprType() const { return ExprType; }
+
+  // Semantic analysis. declare() adds top level declarations to the global
+  // scope, check() type checks a node inside a function body and returns its
+  // type ("" for statements and for expressions that already had an error).
+  virtual void declare(GlobalScope &globals, DiagnosticList &diags) {}
+  virtual FunctionAST *getFunction() { return nullptr; }
+  virtual std::string check(LocalScope &scope) { return ""; }
+
+  // Top level declarations seen through the base class: the prototype of an
+  // extern or function, and a global variable.
+  virtual PrototypeAST *getPrototype() { return nullptr; }
+  virtual VariableASTnode *getVariable() { return nullptr; }
+
+  // Compilation cache key: writes an exact, layout independent description
+  // of the node and records the names it refers to.
+  virtual void fingerprint(Fingerprint &fp) const {}
+
+  // Tiered execution. evaluate() gives the value of an expression, and
+  // execute() runs a statement, returning true if it ran a return.
+  virtual RunValue evaluate(Interpreter &interp);
+  virtual bool execute(Interpreter &interp);
+
+  // Bytecode. emit() adds the code for a node to the function being
+  // compiled and returns the register holding its value, which is dest
+  // unless dest is -1. emitBranch() adds code that jumps to target if the
+  // node's value is when. writesLocal() is true if evaluating the node can
+  // assign to a local.
+  virtual int emit(BytecodeCompiler &bc, int dest);
+  virtual void emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target);
+  virtual bool writesLocal() const { return false; }
 };
 // Recursive Descent Parser - Function call for each production
 /// IntASTnode - Class for integer literals like 1, 2, 10,
@@ -467,13 +684,16 @@ class rootASTnode : public ASTnode {
 
 public:
   rootASTnode(std::vector<std::unique_ptr<ASTnode>> topnodes) : TopNodes(std::move(topnodes)) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  bool analyse(DiagnosticList &diags, unsigned numThreads);
+  void collectDeclarations(ModuleDeclarations &decls);
+  std::vector<std::unique_ptr<ASTnode>> &getNodes() { return TopNodes; }
+  virtual std::string to_string(int &indentDepth) const override {
     std::string out = "Program: ";
     for (int i = 0; i < TopNodes.size(); i++) {
-      out.append("\n" + indent() + TopNodes[i]->to_string());
+      out.append("\n" + indent(indentDepth) + TopNodes[i]->to_string(indentDepth));
     }
-    dedent();
+    dedent(indentDepth);
     return out;
   }
 };
@@ -488,10 +708,14 @@ class IntASTnode : public ASTnode {
 
 public:
   IntASTnode(int val) : Val(val){}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual std::string check(LocalScope &scope) override { return ExprType = "int"; }
+  virtual std::string to_string(int &indentDepth) const override {
     std::string out = "IntegerLiteral: " + std::to_string(Val);
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 };
@@ -504,10 +728,14 @@ class FloatASTnode : public ASTnode {
 
 public:
   FloatASTnode(float val) : Val(val) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual std::string check(LocalScope &scope) override { return ExprType = "float"; }
+  virtual std::string to_string(int &indentDepth) const override {
     std::string out = "FloatLiteral: " + std::to_string(Val);
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 
@@ -519,10 +747,15 @@ class BoolASTnode : public ASTnode {
 
 public:
   BoolASTnode(bool val) : Val(val) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual void emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) override;
+  virtual std::string check(LocalScope &scope) override { return ExprType = "bool"; }
+  virtual std::string to_string(int &indentDepth) const override {
     std::string out = "BoolLiteral: " + std::to_string(Val);
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 
@@ -532,13 +765,23 @@ public:
 class VariableASTnode : public ASTnode {
   std::string Val;
   std::string Type;
+  int Slot = -1; // of a local, set by check()
 
 public:
   VariableASTnode(std::string type, std::string val) : Val(val), Type(type) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual bool execute(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  const std::string &getName() const { return Val; }
+  const std::string &getType() const { return Type; }
+  int getSlot() const { return Slot; }
+  virtual void declare(GlobalScope &globals, DiagnosticList &diags) override;
+  virtual VariableASTnode *getVariable() override { return this; }
+  virtual std::string check(LocalScope &scope) override;
+  virtual std::string to_string(int &indentDepth) const override {
     std::string out = "VarDeclaration: " + Type + " " + Val;
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 
@@ -547,18 +790,25 @@ public:
 
 class VariableRefASTnode : public ASTnode{
   std::string Name;
+  int Slot = -1; // of the local referred to, or -1 for a global; set by check()
 
   public:
   VariableRefASTnode(std::string name) : Name(name) {}
-  // virtual Value *codegen() override = 0;
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  const std::string &getName() const { return Name; }
+  int getSlot() const { return Slot; }
+  virtual std::string check(LocalScope &scope) override;
   // virtual TOKEN getTok() const override{
   //   return Tok;
   // }
   // std::string getName() const override{ return Name; }
-  virtual std::string to_string() const override {
+  virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
     std::string out = "VarReference: " + Name;
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 };
@@ -570,11 +820,17 @@ class UnaryExprASTnode : public ASTnode {
 
 public:
   UnaryExprASTnode(std::string opcode, std::unique_ptr<ASTnode> operand) : Opcode(opcode), Operand(std::move(operand)) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual void emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) override;
+  virtual bool writesLocal() const override { return Operand->writesLocal(); }
+  virtual std::string check(LocalScope &scope) override;
+  virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
-    std::string out = "UnaryExpr: " + Opcode + "\n" + indent() + Operand->to_string();
-    dedent();
+    std::string out = "UnaryExpr: " + Opcode + "\n" + indent(indentDepth) + Operand->to_string(indentDepth);
+    dedent(indentDepth);
     return out;
   };
 
@@ -586,11 +842,17 @@ class BinaryExprASTnode : public ASTnode {
 
 public:
   BinaryExprASTnode(std::string opcode, std::unique_ptr<ASTnode> LHS, std::unique_ptr<ASTnode> RHS) : Opcode(opcode), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual RunValue evaluate(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual void emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) override;
+  virtual bool writesLocal() const override;
+  virtual std::string check(LocalScope &scope) override;
+  virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
-    std::string out = "BinaryExpr: " + Opcode + "\n" + indent() + LHS->to_string() + "\n" + indent() + RHS->to_string();
-    dedent();
+    std::string out = "BinaryExpr: " + Opcode + "\n" + indent(indentDepth) + LHS->to_string(indentDepth) + "\n" + indent(indentDepth) + RHS->to_string(indentDepth);
+    dedent(indentDepth);
     return out;
   };
 
@@ -604,15 +866,20 @@ public:
   CallExprAST(const std::string &callee,
               std::vector<std::unique_ptr<ASTnode>> args)
     : Callee(callee), Args(std::move(args)) {}
-    // virtual Value *codegen() override = 0;
-    virtual std::string to_string() const override {
+    virtual Value *codegen(CodeGenerator &gen) override;
+    virtual void fingerprint(Fingerprint &fp) const override;
+    virtual RunValue evaluate(Interpreter &interp) override;
+    virtual int emit(BytecodeCompiler &bc, int dest) override;
+    virtual bool writesLocal() const override;
+    virtual std::string check(LocalScope &scope) override;
+    virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
     std::string arguments_string = "";
     for (int i = 0; i < Args.size(); i++){
-      arguments_string.append("\n" + indent() + "Param: " + Args[i]->to_string());
+      arguments_string.append("\n" + indent(indentDepth) + "Param: " + Args[i]->to_string(indentDepth));
     }
     std::string out = "FuncCall: " + Callee + arguments_string;
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 };
@@ -625,10 +892,16 @@ public:
   IfExprAST(std::unique_ptr<ASTnode> Cond, std::unique_ptr<ASTnode> Then,
             std::unique_ptr<ASTnode> Else)
       : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-      // virtual Value *codegen() override = 0;
-      virtual std::string to_string() const override {
-  std::string out = "IfExpr:\n" + indent() + "Condition: " + Cond->to_string();
-  out.append("\n" + indent() + "Then:" + Then->to_string() + "\n"+indent()+"Else:" + Else->to_string());
+      virtual Value *codegen(CodeGenerator &gen) override;
+      virtual void fingerprint(Fingerprint &fp) const override;
+      virtual bool execute(Interpreter &interp) override;
+      virtual int emit(BytecodeCompiler &bc, int dest) override;
+      virtual std::string check(LocalScope &scope) override;
+      virtual std::string to_string(int &indentDepth) const override {
+  std::string out = "IfExpr:\n" + indent(indentDepth) + "Condition: " + Cond->to_string(indentDepth);
+  out.append("\n" + indent(indentDepth) + "Then:" + Then->to_string(indentDepth));
+  if (Else)
+    out.append("\n"+indent(indentDepth)+"Else:" + Else->to_string(indentDepth));
   // indent();
   // for (const auto &stmt : Then) {
   //   out += indent() + stmt->to_string() + "\n";
@@ -644,7 +917,7 @@ public:
     // dedent();
   // }
   
-  dedent();
+  dedent(indentDepth);
   return out;
 };
 
@@ -657,18 +930,22 @@ class WhileExprAST : public ASTnode {
 public:
   WhileExprAST(std::unique_ptr<ASTnode> Cond, std::unique_ptr<ASTnode> Then)
       : Cond(std::move(Cond)), Then(std::move(Then)) {}
-      // virtual Value *codegen() override = 0;
-       virtual std::string to_string() const override {
+      virtual Value *codegen(CodeGenerator &gen) override;
+      virtual void fingerprint(Fingerprint &fp) const override;
+      virtual bool execute(Interpreter &interp) override;
+      virtual int emit(BytecodeCompiler &bc, int dest) override;
+      virtual std::string check(LocalScope &scope) override;
+       virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
     std::string ThenStr = "";
-    std::string out = "WhileExpr:\n" + indent() + Cond->to_string() + "\n" + indent() + "Then: " + Then->to_string();
+    std::string out = "WhileExpr:\n" + indent(indentDepth) + Cond->to_string(indentDepth) + "\n" + indent(indentDepth) + "Then: " + Then->to_string(indentDepth);
     // for(int i = 0; i < Then.size(); i++)
     // {
     //   if(Then[i] != nullptr)  
     //     ThenStr.append("\n" + indent() + "--> " + Then[i]->to_string());
     // }
     // out.append(ThenStr);
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 };
@@ -680,16 +957,20 @@ class ReturnExprAST : public ASTnode {
 
 public:
   ReturnExprAST(std::unique_ptr<ASTnode> returnexpr) : ReturnExpr(std::move(returnexpr)) {}
-  // virtual Value *codegen() override = 0;
-  virtual std::string to_string() const override {
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual bool execute(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual std::string check(LocalScope &scope) override;
+  virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
     std::string returnExpr = "";
     std::string out = "";
     if(ReturnExpr != nullptr){
-      out = "ReturnStmt\n" + indent() + ReturnExpr->to_string();
+      out = "ReturnStmt\n" + indent(indentDepth) + ReturnExpr->to_string(indentDepth);
     }else{
        out = "ReturnStmt: Null";}
-    dedent();
+    dedent(indentDepth);
     return out;
   };
 };
@@ -704,35 +985,62 @@ public:
     : Name(name), Type(type), Args(std::move(args)) {}
 
   const std::string getName() const { return Name; }
+  const std::string &getType() const { return Type; }
   // const std::vector<std::string> &getParamNames() const {return Args;}
-  virtual std::string to_string() const override {
+  const std::vector<std::unique_ptr<VariableASTnode>> &getArgs() const { return Args; }
+  // a copy of an extern from a cached header, for a file that includes it
+  std::unique_ptr<PrototypeAST> clone() const {
+    std::vector<std::unique_ptr<VariableASTnode>> args;
+    for (auto &arg : Args) {
+      args.push_back(std::make_unique<VariableASTnode>(arg->getType(), arg->getName()));
+      args.back()->setLocation(*arg);
+    }
+    auto proto = std::make_unique<PrototypeAST>(Name, std::move(args), Type);
+    proto->setLocation(*this);
+    return proto;
+  }
+  virtual void declare(GlobalScope &globals, DiagnosticList &diags) override;
+  virtual PrototypeAST *getPrototype() override { return this; }
+  virtual std::string to_string(int &indentDepth) const override {
   //return a string representation of this AST node
   std::string args = "";
 
   for(int i = 0; i < std::move(Args).size(); i++)
   {
-      args.append("\n" + indent() + "Param: " + std::move(Args)[i]->to_string());
+      args.append("\n" + indent(indentDepth) + "Param: " + std::move(Args)[i]->to_string(indentDepth));
   } 
-  dedent();
+  dedent(indentDepth);
   return "FunctionDecl: " +Type + " "+ Name + args;
   // dedent();
   // dedent();
   };
-  // virtual Value *codegen() override = 0;
+  virtual Function *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
 };
 
 class FunctionAST : public ASTnode {
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<ASTnode> Body;
+  unsigned NumLocals = 0; // parameters included, set by checkBody()
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> proto,
               std::unique_ptr<ASTnode> body)
     : Proto(std::move(proto)), Body(std::move(body)) {}
-    // virtual Value *codegen() override = 0;
-    virtual std::string to_string() const override {
-  std::string out = "Function:\n" + indent() + Proto->to_string() + "\n" + indent() + "Body:" + Body->to_string();
-  dedent();
+    virtual Value *codegen(CodeGenerator &gen) override;
+    virtual void fingerprint(Fingerprint &fp) const override;
+    PrototypeAST &getProto() const { return *Proto; }
+    ASTnode &getBody() const { return *Body; }
+    unsigned getNumLocals() const { return NumLocals; }
+    // a streaming compile keeps only the prototype once the body is compiled
+    std::unique_ptr<PrototypeAST> takeProto() { return std::move(Proto); }
+    virtual void declare(GlobalScope &globals, DiagnosticList &diags) override;
+    virtual FunctionAST *getFunction() override { return this; }
+    virtual PrototypeAST *getPrototype() override { return Proto.get(); }
+    void checkBody(const GlobalScope &globals, DiagnosticList &diags);
+    virtual std::string to_string(int &indentDepth) const override {
+  std::string out = "Function:\n" + indent(indentDepth) + Proto->to_string(indentDepth) + "\n" + indent(indentDepth) + "Body:" + Body->to_string(indentDepth);
+  dedent(indentDepth);
   return out;
 };
 
@@ -749,19 +1057,23 @@ public:
 
   BlockASTnode(std::vector<std::unique_ptr<ASTnode>> localDecls, std::vector<std::unique_ptr<ASTnode>> stmtList)
       : localDecls(std::move(localDecls)), stmtList(std::move(stmtList)) {}
-  // virtual Value *codegen() override = 0;
+  virtual Value *codegen(CodeGenerator &gen) override;
+  virtual void fingerprint(Fingerprint &fp) const override;
+  virtual bool execute(Interpreter &interp) override;
+  virtual int emit(BytecodeCompiler &bc, int dest) override;
+  virtual std::string check(LocalScope &scope) override;
 
   // Override virtual methods from ASTnode as needed
-  virtual std::string to_string() const override {
+  virtual std::string to_string(int &indentDepth) const override {
     // Example implementation for debugging
     std::string out = "";
     for (const auto& decl : localDecls) {
-      out.append("\n" + indent() + decl->to_string());
+      out.append("\n" + indent(indentDepth) + decl->to_string(indentDepth));
     }
     for (const auto& stmt : stmtList) {
-      out.append("\n" + indent() + stmt->to_string());
+      out.append("\n" + indent(indentDepth) + stmt->to_string(indentDepth));
     }
-    dedent();
+    dedent(indentDepth);
     return out;
   };
   
@@ -771,64 +1083,64 @@ public:
 // First Sets
 //===----------------------------------------------------------------------===//
 
-std::vector<TOKEN_TYPE> first_program = {EXTERN,INT_TOK,FLOAT_TOK,BOOL_TOK,VOID_TOK};
-std::vector<TOKEN_TYPE> first_arg_listI = {COMMA}; // "," NULLABLE
-std::vector<TOKEN_TYPE> first_arg_list = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
-std::vector<TOKEN_TYPE> first_args = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rval8 = {LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
-std::vector<TOKEN_TYPE> first_rval7_to_rval = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
-std::vector<TOKEN_TYPE> first_rval6I = {ASTERIX, DIV, MOD}; // *, /, %, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rval5I = {PLUS, MINUS}; // +, -, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rval4I = {LE, LT, GE, GT}; // <=, <, >=, >, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rval3I = {EQ, NE}; // ==, !=, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rval2I = {AND}; // &&, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_rvalI = {OR}; // ||, ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_expr = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
-std::vector<TOKEN_TYPE> first_return_stmt = {RETURN}; // "return"
-std::vector<TOKEN_TYPE> first_else_stmt = {ELSE}; // "else", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_if_stmt = {IF}; // "if"
-std::vector<TOKEN_TYPE> first_while_stmt = {WHILE}; // "while"
-std::vector<TOKEN_TYPE> first_expr_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;
-std::vector<TOKEN_TYPE> first_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;, {, "if", "while", "return"
-std::vector<TOKEN_TYPE> first_stmt_list = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;, {, "if", "while", "return", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_var_type = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
-std::vector<TOKEN_TYPE> first_local_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
-std::vector<TOKEN_TYPE> first_local_decls = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_block = {LBRA}; // "{"
-std::vector<TOKEN_TYPE> first_param = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
-std::vector<TOKEN_TYPE> first_param_list = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
-std::vector<TOKEN_TYPE> first_param_listI = {COMMA}; // ",", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_params = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_type_spec = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
-std::vector<TOKEN_TYPE> first_fun_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
-std::vector<TOKEN_TYPE> first_var_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
-std::vector<TOKEN_TYPE> first_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
-std::vector<TOKEN_TYPE> first_decl_listI = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_decl_list = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
-std::vector<TOKEN_TYPE> first_extern = {EXTERN}; // "extern"
-std::vector<TOKEN_TYPE> first_extern_listI = {EXTERN}; // "extern", ϵ NULLABLE
-std::vector<TOKEN_TYPE> first_extern_list = {EXTERN}; // "extern"
+static const std::vector<TOKEN_TYPE> first_program = {INCLUDE,IDENT,EXTERN,INT_TOK,FLOAT_TOK,BOOL_TOK,VOID_TOK}; // IDENT: only "import"
+static const std::vector<TOKEN_TYPE> first_arg_listI = {COMMA}; // "," NULLABLE
+static const std::vector<TOKEN_TYPE> first_arg_list = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
+static const std::vector<TOKEN_TYPE> first_args = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rval8 = {LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
+static const std::vector<TOKEN_TYPE> first_rval7_to_rval = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
+static const std::vector<TOKEN_TYPE> first_rval6I = {ASTERIX, DIV, MOD}; // *, /, %, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rval5I = {PLUS, MINUS}; // +, -, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rval4I = {LE, LT, GE, GT}; // <=, <, >=, >, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rval3I = {EQ, NE}; // ==, !=, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rval2I = {AND}; // &&, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_rvalI = {OR}; // ||, ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_expr = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT
+static const std::vector<TOKEN_TYPE> first_return_stmt = {RETURN}; // "return"
+static const std::vector<TOKEN_TYPE> first_else_stmt = {ELSE}; // "else", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_if_stmt = {IF}; // "if"
+static const std::vector<TOKEN_TYPE> first_while_stmt = {WHILE}; // "while"
+static const std::vector<TOKEN_TYPE> first_expr_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;
+static const std::vector<TOKEN_TYPE> first_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;, {, "if", "while", "return"
+static const std::vector<TOKEN_TYPE> first_stmt_list = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN}; // -, !, (, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, ;, {, "if", "while", "return", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_var_type = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
+static const std::vector<TOKEN_TYPE> first_local_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
+static const std::vector<TOKEN_TYPE> first_local_decls = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_block = {LBRA}; // "{"
+static const std::vector<TOKEN_TYPE> first_param = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
+static const std::vector<TOKEN_TYPE> first_param_list = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
+static const std::vector<TOKEN_TYPE> first_param_listI = {COMMA}; // ",", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_params = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_type_spec = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
+static const std::vector<TOKEN_TYPE> first_fun_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
+static const std::vector<TOKEN_TYPE> first_var_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK}; // "int", "float", "bool"
+static const std::vector<TOKEN_TYPE> first_decl = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
+static const std::vector<TOKEN_TYPE> first_decl_listI = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_decl_list = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK}; // "int", "float", "bool", "void"
+static const std::vector<TOKEN_TYPE> first_extern = {EXTERN}; // "extern"
+static const std::vector<TOKEN_TYPE> first_extern_listI = {EXTERN}; // "extern", ϵ NULLABLE
+static const std::vector<TOKEN_TYPE> first_extern_list = {EXTERN}; // "extern"
 
 
 //===----------------------------------------------------------------------===//
 // Follow Sets
 //===----------------------------------------------------------------------===//
 
-std::vector<TOKEN_TYPE> Follow_rvalI = {SC,RPAR,COMMA};
-std::vector<TOKEN_TYPE> Follow_rval2I = {SC, RPAR, COMMA, OR};
-std::vector<TOKEN_TYPE> Follow_rval3I = {SC, RPAR, COMMA, OR, AND};
-std::vector<TOKEN_TYPE> Follow_rval4I = {SC, RPAR, COMMA, OR, AND, EQ, NE};
-std::vector<TOKEN_TYPE> Follow_rval5I = {SC, RPAR, COMMA, OR, AND, EQ, NE, LE, LT, GE, GT};
-std::vector<TOKEN_TYPE> Follow_rval6I = {SC, RPAR, COMMA, OR, AND, EQ, NE, LE, LT, GE, GT, PLUS, MINUS};
-std::vector<TOKEN_TYPE> Follow_args = {RPAR};
-std::vector<TOKEN_TYPE> Follow_arg_listI = {RPAR};
-std::vector<TOKEN_TYPE> Follow_stmt_list = {RBRA};
-std::vector<TOKEN_TYPE> Follow_else_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN, RBRA};
-std::vector<TOKEN_TYPE> Follow_local_decls = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN, RBRA};
-std::vector<TOKEN_TYPE> Follow_params = {RPAR};
-std::vector<TOKEN_TYPE> Follow_param_listI = {RPAR};
-std::vector<TOKEN_TYPE> Follow_decl_listI = {EOF_TOK};
-std::vector<TOKEN_TYPE> Follow_extern_listI = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK};
+static const std::vector<TOKEN_TYPE> Follow_rvalI = {SC,RPAR,COMMA};
+static const std::vector<TOKEN_TYPE> Follow_rval2I = {SC, RPAR, COMMA, OR};
+static const std::vector<TOKEN_TYPE> Follow_rval3I = {SC, RPAR, COMMA, OR, AND};
+static const std::vector<TOKEN_TYPE> Follow_rval4I = {SC, RPAR, COMMA, OR, AND, EQ, NE};
+static const std::vector<TOKEN_TYPE> Follow_rval5I = {SC, RPAR, COMMA, OR, AND, EQ, NE, LE, LT, GE, GT};
+static const std::vector<TOKEN_TYPE> Follow_rval6I = {SC, RPAR, COMMA, OR, AND, EQ, NE, LE, LT, GE, GT, PLUS, MINUS};
+static const std::vector<TOKEN_TYPE> Follow_args = {RPAR};
+static const std::vector<TOKEN_TYPE> Follow_arg_listI = {RPAR};
+static const std::vector<TOKEN_TYPE> Follow_stmt_list = {RBRA};
+static const std::vector<TOKEN_TYPE> Follow_else_stmt = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN, RBRA};
+static const std::vector<TOKEN_TYPE> Follow_local_decls = {MINUS, NOT, LPAR, IDENT, INT_LIT, FLOAT_LIT, BOOL_LIT, SC, LBRA, IF, WHILE, RETURN, RBRA};
+static const std::vector<TOKEN_TYPE> Follow_params = {RPAR};
+static const std::vector<TOKEN_TYPE> Follow_param_listI = {RPAR};
+static const std::vector<TOKEN_TYPE> Follow_decl_listI = {EOF_TOK};
+static const std::vector<TOKEN_TYPE> Follow_extern_listI = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOID_TOK};
 
 
 
@@ -836,7 +1148,7 @@ std::vector<TOKEN_TYPE> Follow_extern_listI = {INT_TOK, FLOAT_TOK, BOOL_TOK, VOI
 // Recursive Descent Parser - Function call for each production
 //===----------------------------------------------------------------------===//
 
-static bool isIn(int type, std::vector<TOKEN_TYPE> l)
+static bool isIn(int type, const std::vector<TOKEN_TYPE> &l)
 {
   for(int i = 0; i < l.size(); i++)
   {
@@ -846,7 +1158,170 @@ static bool isIn(int type, std::vector<TOKEN_TYPE> l)
   return false;
 }
 
-bool match(TOKEN_TYPE token)
+/// HeaderCache - the externs of every file named by an #include, parsed once
+/// per process, and the declarations of every module interface imported.
+/// Entries are keyed by the file's real path and are used for as long as
+/// its modification time and size are unchanged, so a compile server or a
+/// multi-file compile reads a widely included header only once. Entries are
+/// never changed after they are made: each including file gets its own
+/// copies of the declarations.
+class HeaderCache {
+public:
+  struct Header {
+    std::vector<std::string> Includes; // real paths, in order
+    std::vector<std::unique_ptr<PrototypeAST>> Externs;
+    std::vector<std::unique_ptr<VariableASTnode>> Globals; // interfaces only
+    sys::TimePoint<> Modified;
+    uint64_t Size = 0;
+  };
+
+  std::atomic<unsigned> Loaded{0}, Reused{0};
+
+  static HeaderCache &get() {
+    static HeaderCache cache;
+    return cache;
+  }
+
+  // nullptr if the header could not be read or parsed; the reason is
+  // written to diags
+  std::shared_ptr<const Header> lookup(const std::string &path, raw_ostream &diags);
+
+private:
+  std::mutex Lock;
+  std::map<std::string, std::shared_ptr<const Header>> Headers;
+};
+
+// resolveInclude - the real path of the file an #include names, which is
+// relative to the directory of the file it is in
+static bool resolveInclude(StringRef name, StringRef dir, std::string &path) {
+  SmallString<256> file(name);
+  if (path::is_relative(file) && !dir.empty()) {
+    file = dir;
+    path::append(file, name);
+  }
+  SmallString<256> real;
+  if (fs::real_path(file, real))
+    return false;
+  path = std::string(real);
+  return true;
+}
+
+/// Parser - recursive descent parser for one translation unit. CurTok and the
+/// token buffer belong to the parser, so two parsers never share state.
+class Parser {
+  Lexer &Lex;
+  raw_ostream &Diags;
+  bool errorReported = false;
+
+  /// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
+  /// token the parser is looking at.  getNextToken reads another token from the
+  /// lexer and updates CurTok with its results.
+  TOKEN CurTok;
+  std::deque<TOKEN> tok_buffer;
+
+  TOKEN getNextToken() {
+
+    if (tok_buffer.size() == 0)
+      tok_buffer.push_back(Tokens ? Tokens->pop() : Lex.gettok());
+
+    TOKEN temp = tok_buffer.front();
+    tok_buffer.pop_front();
+
+    return CurTok = temp;
+  }
+
+  void putBackToken(TOKEN tok) { tok_buffer.push_front(tok); }
+
+  void clearTokBuffer() {  //clear the buffer at the end
+    while(tok_buffer.size() != 0) 
+    {
+      tok_buffer.pop_front();
+    } 
+  }
+
+  // syntax errors are written to the session's diagnostic stream
+  raw_ostream &errs() { return Diags; }
+
+  bool match(TOKEN_TYPE token);
+
+  /* Add function calls for each production */
+  std::unique_ptr<rootASTnode> program();
+  std::vector<std::unique_ptr<ASTnode>> include_list();
+  bool include(std::string &path);
+  bool import(std::string &path);
+  void expandInclude(const std::string &path, std::vector<std::unique_ptr<ASTnode>> &nodes);
+  std::vector<std::unique_ptr<ASTnode>> extern_list();
+  std::vector<std::unique_ptr<ASTnode>> extern_listI();
+  std::unique_ptr<ASTnode> pas_extern();
+  std::vector<std::unique_ptr<ASTnode>> decl_list();
+  std::vector<std::unique_ptr<ASTnode>> decl_listI();
+  std::unique_ptr<ASTnode> decl();
+  std::unique_ptr<ASTnode> var_decl();
+  std::string var_type();
+  std::string type_spec();
+  std::unique_ptr<ASTnode> fun_decl();
+  std::vector<std::unique_ptr<VariableASTnode>> params();
+  std::vector<std::unique_ptr<VariableASTnode>> param_list();
+  std::vector<std::unique_ptr<VariableASTnode>> param_listI();
+  std::unique_ptr<VariableASTnode> param();
+  std::unique_ptr<ASTnode> block();
+  std::vector<std::unique_ptr<ASTnode>>  local_decls();
+  std::unique_ptr<ASTnode> local_decl();
+  std::vector<std::unique_ptr<ASTnode>> stmt_list();
+  std::unique_ptr<ASTnode> stmt();
+  std::unique_ptr<ASTnode> expr_stmt();
+  std::unique_ptr<ASTnode> while_stmt();
+  std::unique_ptr<ASTnode> if_stmt();
+  std::unique_ptr<ASTnode> else_stmt();
+  std::unique_ptr<ASTnode> return_stmt();
+  std::unique_ptr<ASTnode> expr();
+  std::unique_ptr<ASTnode> rval();
+  std::unique_ptr<ASTnode> rvalI(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval2();
+  std::unique_ptr<ASTnode> rval2I(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval3();
+  std::unique_ptr<ASTnode> rval3I(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval4();
+  std::unique_ptr<ASTnode> rval4I(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval5();
+  std::unique_ptr<ASTnode> rval5I(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval6();
+  std::unique_ptr<ASTnode> rval6I(std::unique_ptr<ASTnode>);
+  std::unique_ptr<ASTnode> rval7();
+  std::unique_ptr<ASTnode> rval8();
+  std::vector<std::unique_ptr<ASTnode>> args();
+  std::vector<std::unique_ptr<ASTnode>> arg_list();
+  std::vector<std::unique_ptr<ASTnode>> arg_listI();
+
+  void finished(std::unique_ptr<ASTnode> &node) {
+    if (OnTopLevel)
+      OnTopLevel(node);
+  }
+
+public:
+  Parser(Lexer &lex, raw_ostream &diags) : Lex(lex), Diags(diags) {}
+
+  // For pipelined and streaming compiles: tokens come from a lexer thread
+  // through Tokens instead of from Lex, and OnTopLevel is called with each
+  // top level declaration as soon as it has been parsed, then once with
+  // nullptr when parsing is over, before the tree is kept or freed.
+  // OnTopLevel may take the node, leaving it out of the tree.
+  TokenRing *Tokens = nullptr;
+  std::function<void(std::unique_ptr<ASTnode> &)> OnTopLevel;
+  bool PrintTree = true; // write the tree to the output once it is parsed
+  // if set, the source offset of each top level declaration is added here
+  std::vector<size_t> *DeclOffsets = nullptr;
+  // the directory #include paths are relative to
+  std::string IncludeDir;
+
+  std::unique_ptr<rootASTnode> parse(raw_ostream &out);
+  bool parseHeader(HeaderCache::Header &header);
+
+private:
+  std::set<std::string> Included; // real paths, for include-once
+};
+
+bool Parser::match(TOKEN_TYPE token)
 {
   if(CurTok.type == token)
   {
@@ -857,51 +1332,6 @@ bool match(TOKEN_TYPE token)
     return false;
 }
 
-/* Add function calls for each production */
-std::unique_ptr<rootASTnode> program();
-std::vector<std::unique_ptr<ASTnode>> extern_list();
-std::vector<std::unique_ptr<ASTnode>> extern_listI();
-std::unique_ptr<ASTnode> pas_extern();
-std::vector<std::unique_ptr<ASTnode>> decl_list();
-std::vector<std::unique_ptr<ASTnode>> decl_listI();
-std::unique_ptr<ASTnode> decl();
-std::unique_ptr<ASTnode> var_decl();
-std::string var_type();
-std::string type_spec();
-std::unique_ptr<ASTnode> fun_decl();
-std::vector<std::unique_ptr<VariableASTnode>> params();
-std::vector<std::unique_ptr<VariableASTnode>> param_list();
-std::vector<std::unique_ptr<VariableASTnode>> param_listI();
-std::unique_ptr<VariableASTnode> param();
-std::unique_ptr<ASTnode> block();
-std::vector<std::unique_ptr<ASTnode>>  local_decls();
-std::unique_ptr<ASTnode> local_decl();
-std::vector<std::unique_ptr<ASTnode>> stmt_list();
-std::unique_ptr<ASTnode> stmt();
-std::unique_ptr<ASTnode> expr_stmt();
-std::unique_ptr<ASTnode> while_stmt();
-std::unique_ptr<ASTnode> if_stmt();
-std::unique_ptr<ASTnode> else_stmt();
-std::unique_ptr<ASTnode> return_stmt();
-std::unique_ptr<ASTnode> expr();
-std::unique_ptr<ASTnode> rval();
-std::unique_ptr<ASTnode> rvalI(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval2();
-std::unique_ptr<ASTnode> rval2I(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval3();
-std::unique_ptr<ASTnode> rval3I(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval4();
-std::unique_ptr<ASTnode> rval4I(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval5();
-std::unique_ptr<ASTnode> rval5I(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval6();
-std::unique_ptr<ASTnode> rval6I(std::unique_ptr<ASTnode>);
-std::unique_ptr<ASTnode> rval7();
-std::unique_ptr<ASTnode> rval8();
-std::vector<std::unique_ptr<ASTnode>> args();
-std::vector<std::unique_ptr<ASTnode>> arg_list();
-std::vector<std::unique_ptr<ASTnode>> arg_listI();
-
 
 
 
@@ -909,12 +1339,14 @@ std::vector<std::unique_ptr<ASTnode>> arg_listI();
 // bool extern_list() {
 //   return pas_extern() && extern_listI();
 // }
-std::vector<std::unique_ptr<ASTnode>> extern_list() {
+std::vector<std::unique_ptr<ASTnode>> Parser::extern_list() {
   std::vector<std::unique_ptr<ASTnode>> externNodes;
 
   auto externNode = pas_extern();
   if (externNode) {
-    externNodes.push_back(std::move(externNode));
+    finished(externNode);
+    if (externNode)
+      externNodes.push_back(std::move(externNode));
     auto restExterns = extern_listI();
     externNodes.insert(externNodes.end(), std::make_move_iterator(restExterns.begin()), std::make_move_iterator(restExterns.end()));
   } else {
@@ -946,13 +1378,15 @@ std::vector<std::unique_ptr<ASTnode>> extern_list() {
 //   }
 // }
 
-std::vector<std::unique_ptr<ASTnode>> extern_listI() {
+std::vector<std::unique_ptr<ASTnode>> Parser::extern_listI() {
   std::vector<std::unique_ptr<ASTnode>> externNodes;
 
   if (isIn(CurTok.type, first_extern)) {
     auto externNode = pas_extern();
     if (externNode) {
-      externNodes.push_back(std::move(externNode));
+      finished(externNode);
+      if (externNode)
+        externNodes.push_back(std::move(externNode));
       auto restExterns = extern_listI();
       externNodes.insert(externNodes.end(), std::make_move_iterator(restExterns.begin()), std::make_move_iterator(restExterns.end()));
     } else {
@@ -1026,7 +1460,9 @@ std::vector<std::unique_ptr<ASTnode>> extern_listI() {
 //   }
 //   return true;
 // }
-std::unique_ptr<ASTnode> pas_extern() {
+std::unique_ptr<ASTnode> Parser::pas_extern() {
+  if (DeclOffsets)
+    DeclOffsets->push_back(CurTok.offset);
   if (!match(EXTERN)) {
     if (!errorReported) {
       errs() << "Syntax error: Expected 'extern' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1037,6 +1473,7 @@ std::unique_ptr<ASTnode> pas_extern() {
 
   auto typeNode = type_spec();
   if (typeNode =="") return nullptr;
+  TOKEN identTok = CurTok;
   std::string identifier = CurTok.lexeme;
   if (!match(IDENT)) {
     if (!errorReported) {
@@ -1074,7 +1511,7 @@ std::unique_ptr<ASTnode> pas_extern() {
     return nullptr;
   }
 
-  return std::make_unique<PrototypeAST>(identifier, std::move(paramsNode),typeNode);
+  return located(std::make_unique<PrototypeAST>(identifier, std::move(paramsNode),typeNode), identTok);
 }
 
 
@@ -1087,13 +1524,15 @@ std::unique_ptr<ASTnode> pas_extern() {
 //     return false;
 //   }
 // }
-std::vector<std::unique_ptr<ASTnode>> decl_list() {
+std::vector<std::unique_ptr<ASTnode>> Parser::decl_list() {
   std::vector<std::unique_ptr<ASTnode>> declarations;
 
   if (isIn(CurTok.type, first_decl)) {
     auto declNode = decl();
     if (declNode) {
-      declarations.push_back(std::move(declNode));
+      finished(declNode);
+      if (declNode)
+        declarations.push_back(std::move(declNode));
       auto restDecls = decl_listI();
       declarations.insert(declarations.end(), std::make_move_iterator(restDecls.begin()), std::make_move_iterator(restDecls.end()));
     } else {
@@ -1125,13 +1564,15 @@ std::vector<std::unique_ptr<ASTnode>> decl_list() {
 //     }
 //   }
 // }
-std::vector<std::unique_ptr<ASTnode>> decl_listI() {
+std::vector<std::unique_ptr<ASTnode>> Parser::decl_listI() {
   std::vector<std::unique_ptr<ASTnode>> declarations;
 
   if (isIn(CurTok.type, first_decl)) {
     auto declNode = decl();
     if (declNode) {
-      declarations.push_back(std::move(declNode));
+      finished(declNode);
+      if (declNode)
+        declarations.push_back(std::move(declNode));
       auto restDecls = decl_listI();
       declarations.insert(declarations.end(), std::make_move_iterator(restDecls.begin()), std::make_move_iterator(restDecls.end()));
     } else {
@@ -1180,7 +1621,9 @@ std::vector<std::unique_ptr<ASTnode>> decl_listI() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> decl() {
+std::unique_ptr<ASTnode> Parser::decl() {
+  if (DeclOffsets)
+    DeclOffsets->push_back(CurTok.offset);
   TOKEN look1 = CurTok;
   getNextToken();
   TOKEN look2 = CurTok;
@@ -1234,9 +1677,10 @@ std::unique_ptr<ASTnode> decl() {
 //   }
 //   return true;
 // }
-std::unique_ptr<ASTnode> var_decl() {
+std::unique_ptr<ASTnode> Parser::var_decl() {
   auto typeNode = var_type();
   if (typeNode=="") return nullptr;
+  TOKEN identTok = CurTok;
   std::string identifier = CurTok.lexeme;
   if (!match(IDENT)) {
     if (!errorReported) {
@@ -1255,13 +1699,13 @@ std::unique_ptr<ASTnode> var_decl() {
     return nullptr;
   }
 
-  return std::make_unique<VariableASTnode>(typeNode, identifier);
+  return located(std::make_unique<VariableASTnode>(typeNode, identifier), identTok);
 }
 
 //COULD CHANGE 
 // to do match void, else push back and match vartype
 //type_spec ::= "void" |  var_type     
-std::string type_spec() {
+std::string Parser::type_spec() {
   if (isIn(CurTok.type, first_type_spec)){
     if (match(VOID_TOK)){
       return "void";
@@ -1279,7 +1723,7 @@ std::string type_spec() {
 }
 
 // var_type  ::= "int" |  "float" |  "bool"
-std::string var_type() {
+std::string Parser::var_type() {
   if (match(INT_TOK)){
       return "int";
     }
@@ -1346,7 +1790,7 @@ std::string var_type() {
 //   return true;
 
 // }
-std::unique_ptr<ASTnode> fun_decl() {
+std::unique_ptr<ASTnode> Parser::fun_decl() {
   // Parse the type specification
   if (!isIn(CurTok.type, first_type_spec)) {
     if (!errorReported)
@@ -1357,6 +1801,7 @@ std::unique_ptr<ASTnode> fun_decl() {
   auto returnTypeNode = type_spec();
 
   // Parse the function name (identifier)
+  TOKEN nameTok = CurTok;
   std::string functionName = CurTok.lexeme;
   if (!match(IDENT)) {
     if (!errorReported)
@@ -1389,10 +1834,10 @@ std::unique_ptr<ASTnode> fun_decl() {
   if (!bodyNode) return nullptr;
 
   // Construct and return the FunctionAST node
-  return std::make_unique<FunctionAST>(
-    std::make_unique<PrototypeAST>(functionName, std::move(paramsNode),returnTypeNode), 
+  return located(std::make_unique<FunctionAST>(
+    located(std::make_unique<PrototypeAST>(functionName, std::move(paramsNode),returnTypeNode), nameTok),
     std::move(bodyNode)
-  );
+  ), nameTok);
 }
 
 
@@ -1419,7 +1864,7 @@ std::unique_ptr<ASTnode> fun_decl() {
 //     }
 //   }
 // }
-std::vector<std::unique_ptr<VariableASTnode>> params() {
+std::vector<std::unique_ptr<VariableASTnode>> Parser::params() {
   std::vector<std::unique_ptr<VariableASTnode>> paramList;
 
   if (isIn(CurTok.type, first_param_list)) {
@@ -1458,7 +1903,7 @@ std::vector<std::unique_ptr<VariableASTnode>> params() {
 //     return false;
 //   }
 // }
-std::vector<std::unique_ptr<VariableASTnode>> param_list() {
+std::vector<std::unique_ptr<VariableASTnode>> Parser::param_list() {
   std::vector<std::unique_ptr<VariableASTnode>> paramList;
 
   // Parse the first parameter
@@ -1494,7 +1939,7 @@ std::vector<std::unique_ptr<VariableASTnode>> param_list() {
 //     }
 //   }
 // }
-std::vector<std::unique_ptr<VariableASTnode>> param_listI() {
+std::vector<std::unique_ptr<VariableASTnode>> Parser::param_listI() {
   std::vector<std::unique_ptr<VariableASTnode>> paramList;
 
   if (CurTok.type == COMMA) { // Assuming COMMA is the token for ','
@@ -1544,11 +1989,12 @@ std::vector<std::unique_ptr<VariableASTnode>> param_listI() {
 //       return false;
 //   }
 // }
-std::unique_ptr<VariableASTnode> param() {
+std::unique_ptr<VariableASTnode> Parser::param() {
   if (isIn(CurTok.type, first_param)) {
     auto typeNode = var_type();
     if (typeNode=="") return nullptr;
 
+    TOKEN identTok = CurTok;
     std::string paramName = CurTok.lexeme;
     if (!match(IDENT)) {
       if (!errorReported) {
@@ -1558,7 +2004,7 @@ std::unique_ptr<VariableASTnode> param() {
       return nullptr;
     }
 
-    return std::make_unique<VariableASTnode>(typeNode, paramName);
+    return located(std::make_unique<VariableASTnode>(typeNode, paramName), identTok);
   } else {
     if (!errorReported) {
       errs() << "Syntax error: Invalid declaration of parameter found at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1598,7 +2044,7 @@ std::unique_ptr<VariableASTnode> param() {
 //   }
 //   return true;
 // }
-std::unique_ptr<ASTnode> block() {
+std::unique_ptr<ASTnode> Parser::block() {
   if (!match(LBRA)) {
     if (!errorReported)
       errs() << "Syntax error: Expected '{' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1641,7 +2087,7 @@ std::unique_ptr<ASTnode> block() {
 //     }
 //   }
 // }
-std::vector<std::unique_ptr<ASTnode>> local_decls() {
+std::vector<std::unique_ptr<ASTnode>> Parser::local_decls() {
   std::vector<std::unique_ptr<ASTnode>> decls;
   while (isIn(CurTok.type, first_local_decl)) {
     auto decl = local_decl();
@@ -1690,7 +2136,7 @@ std::vector<std::unique_ptr<ASTnode>> local_decls() {
 //       return false;
 //   }
 // }
-std::unique_ptr<ASTnode> local_decl() {
+std::unique_ptr<ASTnode> Parser::local_decl() {
   if (isIn(CurTok.type, first_local_decl)) {
     auto typeNode = var_type(); // var_type needs to return an AST node
     if (typeNode=="") {
@@ -1701,6 +2147,7 @@ std::unique_ptr<ASTnode> local_decl() {
 
     }
 
+    TOKEN identTok = CurTok;
     std::string identifier = CurTok.lexeme;
     if (!match(IDENT)) {
       if (!errorReported)
@@ -1716,7 +2163,7 @@ std::unique_ptr<ASTnode> local_decl() {
       return nullptr;
     }
 
-    return std::make_unique<VariableASTnode>(typeNode, identifier);
+    return located(std::make_unique<VariableASTnode>(typeNode, identifier), identTok);
   } else {
     if (!errorReported) {
       errs() << "Syntax error: Invalid local declaration found at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1728,7 +2175,7 @@ std::unique_ptr<ASTnode> local_decl() {
 
 
 // stmt_list ::= stmt stmt_list |  epsilon
-std::vector<std::unique_ptr<ASTnode>> stmt_list() {
+std::vector<std::unique_ptr<ASTnode>> Parser::stmt_list() {
   std::vector<std::unique_ptr<ASTnode>> stmts;
   while (isIn(CurTok.type, first_stmt_list)) {
     auto stmtNode = stmt();
@@ -1750,7 +2197,7 @@ std::vector<std::unique_ptr<ASTnode>> stmt_list() {
 
 //stmt ::= expr_stmt |  block |  if_stmt |  while_stmt |  return_stmt
 
-std::unique_ptr<ASTnode> stmt() {
+std::unique_ptr<ASTnode> Parser::stmt() {
   if (isIn(CurTok.type, first_expr_stmt)) {
     return expr_stmt();
   } else if (isIn(CurTok.type, first_block)) {
@@ -1793,7 +2240,7 @@ std::unique_ptr<ASTnode> stmt() {
 //     return true;
 //   }
 // }
-std::unique_ptr<ASTnode> expr_stmt() {
+std::unique_ptr<ASTnode> Parser::expr_stmt() {
   if (isIn(CurTok.type, first_expr)) {
     auto exprNode = expr(); // expr() needs to return an AST node
     if (!exprNode) return nullptr;
@@ -1851,7 +2298,8 @@ std::unique_ptr<ASTnode> expr_stmt() {
 //   }
 //   return true;
 // }
-std::unique_ptr<ASTnode> while_stmt() {
+std::unique_ptr<ASTnode> Parser::while_stmt() {
+  TOKEN whileTok = CurTok;
   if (!match(WHILE)) {
     if (!errorReported)
       errs() << "Syntax error: Expected 'while' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1879,7 +2327,7 @@ std::unique_ptr<ASTnode> while_stmt() {
   auto body = stmt(); // stmt() returns an AST node
   if (!body) return nullptr;
 
-  return std::make_unique<WhileExprAST>(std::move(condition), std::move(body));
+  return located(std::make_unique<WhileExprAST>(std::move(condition), std::move(body)), whileTok);
 }
 
 
@@ -1923,7 +2371,8 @@ std::unique_ptr<ASTnode> while_stmt() {
 //   }
 //   return true;
 // }
-std::unique_ptr<ASTnode> if_stmt() {
+std::unique_ptr<ASTnode> Parser::if_stmt() {
+  TOKEN ifTok = CurTok;
   if (!match(IF)) {
     if (!errorReported)
       errs() << "Syntax error: Expected 'if' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -1953,7 +2402,7 @@ std::unique_ptr<ASTnode> if_stmt() {
 
   auto elseBlock = else_stmt();
 
-  return std::make_unique<IfExprAST>(std::move(condition), std::move(thenBlock), std::move(elseBlock));
+  return located(std::make_unique<IfExprAST>(std::move(condition), std::move(thenBlock), std::move(elseBlock)), ifTok);
 }
 
 // else_stmt  ::= "else" block |  epsilon
@@ -1980,7 +2429,7 @@ std::unique_ptr<ASTnode> if_stmt() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> else_stmt() {
+std::unique_ptr<ASTnode> Parser::else_stmt() {
   if (isIn(CurTok.type, first_else_stmt)) {
     getNextToken();
     auto elseBlock = block();
@@ -2025,7 +2474,8 @@ std::unique_ptr<ASTnode> else_stmt() {
 //     return true;
 //   }
 // }
-std::unique_ptr<ASTnode> return_stmt() {
+std::unique_ptr<ASTnode> Parser::return_stmt() {
+  TOKEN returnTok = CurTok;
   if (!match(RETURN)) {
     if (!errorReported)
       errs() << "Syntax error: Expected 'return' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -2035,7 +2485,7 @@ std::unique_ptr<ASTnode> return_stmt() {
 
   if (CurTok.type == SC) {
     getNextToken();
-    return std::make_unique<ReturnExprAST>(nullptr); // Return without expression
+    return located(std::make_unique<ReturnExprAST>(nullptr), returnTok); // Return without expression
   } else {
     auto exprNode = expr();
     if (!exprNode) return nullptr;
@@ -2047,7 +2497,7 @@ std::unique_ptr<ASTnode> return_stmt() {
       return nullptr;
     }
 
-    return std::make_unique<ReturnExprAST>(std::move(exprNode));
+    return located(std::make_unique<ReturnExprAST>(std::move(exprNode)), returnTok);
   }
 }
 
@@ -2082,13 +2532,14 @@ std::unique_ptr<ASTnode> return_stmt() {
 //   }
 
 // }
-std::unique_ptr<ASTnode> expr() {
+std::unique_ptr<ASTnode> Parser::expr() {
   TOKEN look1 = CurTok;
   getNextToken();
 
   // If we have IDENT "=" expr
   if (look1.type == IDENT && CurTok.type == ASSIGN) {
     std::string varName = look1.lexeme;
+    TOKEN assignTok = CurTok;
     getNextToken();
     
     auto rhs = expr();
@@ -2100,7 +2551,7 @@ std::unique_ptr<ASTnode> expr() {
       return nullptr;
     }
     // Return a new BinaryExprASTnode for assignment
-    return std::make_unique<BinaryExprASTnode>("=", std::make_unique<VariableRefASTnode>(varName), std::move(rhs));
+    return located(std::make_unique<BinaryExprASTnode>("=", located(std::make_unique<VariableRefASTnode>(varName), look1), std::move(rhs)), assignTok);
   }
 
   // If we fall back to rval
@@ -2123,7 +2574,7 @@ std::unique_ptr<ASTnode> expr() {
 // bool rval() {
 //   return rval2() && rvalI();
 // }
-std::unique_ptr<ASTnode> rval() {
+std::unique_ptr<ASTnode> Parser::rval() {
   auto left = rval2();
   if (!left) return nullptr;
   return rvalI(std::move(left));
@@ -2149,7 +2600,7 @@ std::unique_ptr<ASTnode> rval() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rvalI(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rvalI(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rvalI)) {
     TOKEN opTok = CurTok;
     getNextToken();
@@ -2157,7 +2608,7 @@ std::unique_ptr<ASTnode> rvalI(std::unique_ptr<ASTnode> left) {
     auto right = rval2();
     if (!right) return nullptr;
     
-    return rvalI(std::make_unique<BinaryExprASTnode>("||", std::move(left), std::move(right)));
+    return rvalI(located(std::make_unique<BinaryExprASTnode>("||", std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rvalI)) {
     return left; // Return the constructed left node
   } else {
@@ -2194,14 +2645,14 @@ std::unique_ptr<ASTnode> rvalI(std::unique_ptr<ASTnode> left) {
 //   }
 // }
 
-std::unique_ptr<ASTnode> rval2() {
+std::unique_ptr<ASTnode> Parser::rval2() {
   auto left = rval3();
   if (!left) return nullptr;
   return rval2I(std::move(left));
 }
 
 // // rval2I ::= "&&" rval3 rval2I | epsilon
-std::unique_ptr<ASTnode> rval2I(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rval2I(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rval2I)) {
     TOKEN opTok = CurTok;
     getNextToken();
@@ -2209,7 +2660,7 @@ std::unique_ptr<ASTnode> rval2I(std::unique_ptr<ASTnode> left) {
     auto right = rval3();
     if (!right) return nullptr;
     
-    return rval2I(std::make_unique<BinaryExprASTnode>("&&", std::move(left), std::move(right)));
+    return rval2I(located(std::make_unique<BinaryExprASTnode>("&&", std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rval2I)) {
     return left; // Return the constructed left node
   } else {
@@ -2226,7 +2677,7 @@ std::unique_ptr<ASTnode> rval2I(std::unique_ptr<ASTnode> left) {
 // bool rval3() {
 //   return rval4() && rval3I();
 // }
-std::unique_ptr<ASTnode> rval3() {
+std::unique_ptr<ASTnode> Parser::rval3() {
   auto left = rval4();
   if (!left) return nullptr;
   return rval3I(std::move(left));
@@ -2250,7 +2701,7 @@ std::unique_ptr<ASTnode> rval3() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rval3I(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rval3I(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rval3I)) {
     TOKEN opTok = CurTok; // Save the current token, which will be "==" or "!="
     std::string op = (CurTok.type == EQ) ? "==" : "!="; // Determine if it's "==" or "!="
@@ -2260,7 +2711,7 @@ std::unique_ptr<ASTnode> rval3I(std::unique_ptr<ASTnode> left) {
     if (!right) return nullptr; // If rval4 fails, return nullptr
     
     // Create a BinaryExprAST node with the operator and the left and right operands
-    return rval3I(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)));
+    return rval3I(located(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rval3I)) {
     return left; // Return the left node if we've reached the end of the `rval3I` sequence
   } else {
@@ -2278,7 +2729,7 @@ std::unique_ptr<ASTnode> rval3I(std::unique_ptr<ASTnode> left) {
 //   return rval5() && rval4I();
 // }
 
-std::unique_ptr<ASTnode> rval4() {
+std::unique_ptr<ASTnode> Parser::rval4() {
   auto left = rval5();
   if (!left) return nullptr;
   return rval4I(std::move(left));
@@ -2301,7 +2752,7 @@ std::unique_ptr<ASTnode> rval4() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rval4I(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rval4I(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rval4I)) {
     TOKEN opTok = CurTok; // Save the current token, which will be one of the operators
     std::string op;
@@ -2324,7 +2775,7 @@ std::unique_ptr<ASTnode> rval4I(std::unique_ptr<ASTnode> left) {
     if (!right) return nullptr; // If rval5 fails, return nullptr
     
     // Construct the BinaryExprAST node for the operator and the operands
-    return rval4I(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)));
+    return rval4I(located(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rval4I)) {
     return left; // Return the left node if we are at the end of the sequence
   } else {
@@ -2341,7 +2792,7 @@ std::unique_ptr<ASTnode> rval4I(std::unique_ptr<ASTnode> left) {
 // bool rval5(){
 //   return rval6() && rval5I();
 // }
-std::unique_ptr<ASTnode> rval5() {
+std::unique_ptr<ASTnode> Parser::rval5() {
   auto left = rval6();
   if (!left) return nullptr;
   return rval5I(std::move(left));
@@ -2366,7 +2817,7 @@ std::unique_ptr<ASTnode> rval5() {
 //   }
 // }
 
-std::unique_ptr<ASTnode> rval5I(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rval5I(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rval5I)) {
     TOKEN opTok = CurTok; // Save the current token, which will be either '+' or '-'
     std::string op;
@@ -2385,7 +2836,7 @@ std::unique_ptr<ASTnode> rval5I(std::unique_ptr<ASTnode> left) {
     if (!right) return nullptr; // If rval6 fails, return nullptr
     
     // Construct the BinaryExprAST node for the operator and the operands
-    return rval5I(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)));
+    return rval5I(located(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rval5I)) {
     return left; // Return the left node if no more operators are present
   } else {
@@ -2401,7 +2852,7 @@ std::unique_ptr<ASTnode> rval5I(std::unique_ptr<ASTnode> left) {
 // bool rval6() {
 //   return rval7() && rval6I();
 // }
-std::unique_ptr<ASTnode> rval6() {
+std::unique_ptr<ASTnode> Parser::rval6() {
   auto left = rval7();
   if (!left) return nullptr;
   return rval6I(std::move(left));
@@ -2425,7 +2876,7 @@ std::unique_ptr<ASTnode> rval6() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rval6I(std::unique_ptr<ASTnode> left) {
+std::unique_ptr<ASTnode> Parser::rval6I(std::unique_ptr<ASTnode> left) {
   if (isIn(CurTok.type, first_rval6I)) {
     TOKEN opTok = CurTok; // Save the current token, which will be '*', '/', or '%'
     std::string op;
@@ -2446,7 +2897,7 @@ std::unique_ptr<ASTnode> rval6I(std::unique_ptr<ASTnode> left) {
     if (!right) return nullptr; // If rval7 fails, return nullptr
     
     // Construct the BinaryExprAST node for the operator and the operands
-    return rval6I(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)));
+    return rval6I(located(std::make_unique<BinaryExprASTnode>(op, std::move(left), std::move(right)), opTok));
   } else if (isIn(CurTok.type, Follow_rval6I)) {
     return left; // Return the left node if no more operators are present
   } else {
@@ -2472,19 +2923,18 @@ std::unique_ptr<ASTnode> rval6I(std::unique_ptr<ASTnode> left) {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rval7() {
+std::unique_ptr<ASTnode> Parser::rval7() {
+  TOKEN opTok = CurTok;
   if (match(MINUS)) {
-    TOKEN opTok = CurTok;
     auto operand = rval7();
     if (!operand) return nullptr;
     
-    return std::make_unique<UnaryExprASTnode>("-", std::move(operand));
+    return located(std::make_unique<UnaryExprASTnode>("-", std::move(operand)), opTok);
   } else if (match(NOT)) {
-    TOKEN opTok = CurTok;
     auto operand = rval7();
     if (!operand) return nullptr;
     
-    return std::make_unique<UnaryExprASTnode>("!", std::move(operand));
+    return located(std::make_unique<UnaryExprASTnode>("!", std::move(operand)), opTok);
   } else {
     return rval8();
   }
@@ -2559,7 +3009,7 @@ std::unique_ptr<ASTnode> rval7() {
 //     }
 //   }
 // }
-std::unique_ptr<ASTnode> rval8() {
+std::unique_ptr<ASTnode> Parser::rval8() {
   if (match(LPAR)) {
     auto innerExpr = expr();
     if (!innerExpr) return nullptr;
@@ -2590,17 +3040,17 @@ std::unique_ptr<ASTnode> rval8() {
         errorReported = true;
         return nullptr;
       }
-      return std::make_unique<CallExprAST>(funcName, std::move(arguments));
+      return located(std::make_unique<CallExprAST>(funcName, std::move(arguments)), look1);
     } else {
       putBackToken(CurTok);
       CurTok = look1;
       auto val = CurTok.lexeme;
       if (match(IDENT)) {
-        return std::make_unique<VariableRefASTnode>(val);
+        return located(std::make_unique<VariableRefASTnode>(val), look1);
       } else if (match(INT_LIT)) {
-        return std::make_unique<IntASTnode>(std::stoi(val));
+        return located(std::make_unique<IntASTnode>(std::stoi(val)), look1);
       } else if (match(FLOAT_LIT)) {
-        return std::make_unique<FloatASTnode>(std::stof(val));
+        return located(std::make_unique<FloatASTnode>(std::stof(val)), look1);
       } else if (match(BOOL_LIT)) {
         bool b_val;
         if (val == "true"){
@@ -2608,7 +3058,7 @@ std::unique_ptr<ASTnode> rval8() {
         }else{
           b_val = false;
         }
-        return std::make_unique<BoolASTnode>(b_val);
+        return located(std::make_unique<BoolASTnode>(b_val), look1);
       } else {
         if (!errorReported) {
           errs() << "Syntax error: Expected '(' or Identifier or INT_LIT or BOOL_LIT or FLOAT_LIT at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
@@ -2645,7 +3095,7 @@ std::unique_ptr<ASTnode> rval8() {
 //       }
 //     }
 // }
-std::vector<std::unique_ptr<ASTnode>> args() {
+std::vector<std::unique_ptr<ASTnode>> Parser::args() {
   std::vector<std::unique_ptr<ASTnode>> arguments;
   
   if (isIn(CurTok.type, first_arg_list)) {
@@ -2669,7 +3119,7 @@ std::vector<std::unique_ptr<ASTnode>> args() {
 
 //   return expr() && arg_listI();
 // }
-std::vector<std::unique_ptr<ASTnode>> arg_list() {
+std::vector<std::unique_ptr<ASTnode>> Parser::arg_list() {
   std::vector<std::unique_ptr<ASTnode>> arguments;
 
   // Parse the first expression and add it to the arguments list.
@@ -2717,7 +3167,7 @@ std::vector<std::unique_ptr<ASTnode>> arg_list() {
 //   }
 // }
 
-std::vector<std::unique_ptr<ASTnode>> arg_listI() {
+std::vector<std::unique_ptr<ASTnode>> Parser::arg_listI() {
   std::vector<std::unique_ptr<ASTnode>> arguments;
 
   // If the current token is part of the list of additional argument rules.
@@ -2771,123 +3221,5350 @@ std::vector<std::unique_ptr<ASTnode>> arg_listI() {
   
 // }
 
-std::unique_ptr<rootASTnode> program() {
+// program ::= include_list extern_list decl_list | include_list decl_list
+std::unique_ptr<rootASTnode> Parser::program() {
+  std::vector<std::unique_ptr<ASTnode>> topNodes = include_list();
+  if (errorReported)
+    return nullptr;
   if (isIn(CurTok.type, first_extern_list)) {
     auto externs = extern_list();
-    auto decls = decl_list();
-    std::vector<std::unique_ptr<ASTnode>> topNodes;
-    // Move each element from externs and decls into topNodes
+    // Move each element from externs into topNodes
     topNodes.insert(topNodes.end(),
                     std::make_move_iterator(externs.begin()),
                     std::make_move_iterator(externs.end()));
+  }
+  auto decls = decl_list();
+  topNodes.insert(topNodes.end(),
+                  std::make_move_iterator(decls.begin()),
+                  std::make_move_iterator(decls.end()));
+  return std::make_unique<rootASTnode>(std::move(topNodes));
+}
 
-    topNodes.insert(topNodes.end(),
-                    std::make_move_iterator(decls.begin()),
-                    std::make_move_iterator(decls.end()));
-    return std::make_unique<rootASTnode>(std::move(topNodes));
-  } else {
-    return std::make_unique<rootASTnode>(decl_list());
+// include ::= "#include" STRING_LIT
+bool Parser::include(std::string &path) {
+  TOKEN directive = CurTok;
+  getNextToken(); // eat #include
+  TOKEN file = CurTok;
+  if (!match(STRING_LIT)) {
+    if (!errorReported)
+      errs() << "Syntax error: Expected a file name in quotes after #include at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
+    errorReported = true;
+    return false;
+  }
+  if (!resolveInclude(file.lexeme, IncludeDir, path)) {
+    if (!errorReported)
+      errs() << "Syntax error: Cannot open included file \"" << file.lexeme << "\" at line " << directive.lineNo << " column " << directive.columnNo << ".\n";
+    errorReported = true;
+    return false;
+  }
+  return true;
+}
+
+// import ::= "import" IDENT ";"
+// names the interface file IDENT.mci, written by --emit-interface. import
+// is not a keyword: it is an IDENT, and only means import where
+// include_list() looks for one, so it remains a valid name elsewhere.
+static bool isImport(const TOKEN &tok) { return tok.type == IDENT && tok.lexeme == "import"; }
+
+bool Parser::import(std::string &path) {
+  TOKEN directive = CurTok;
+  getNextToken(); // eat import
+  TOKEN name = CurTok;
+  if (!match(IDENT)) {
+    if (!errorReported)
+      errs() << "Syntax error: Expected a module name after import at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
+    errorReported = true;
+    return false;
+  }
+  if (!match(SC)) {
+    if (!errorReported)
+      errs() << "Syntax error: Expected ';' at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
+    errorReported = true;
+    return false;
+  }
+  if (!resolveInclude(name.lexeme + ".mci", IncludeDir, path)) {
+    if (!errorReported)
+      errs() << "Syntax error: Cannot find the interface of module " << name.lexeme << " (" << name.lexeme << ".mci) at line " << directive.lineNo << " column " << directive.columnNo << ".\n";
+    errorReported = true;
+    return false;
+  }
+  return true;
+}
+
+// include_list ::= include include_list | import include_list | epsilon
+// Each included file contributes its externs, and those of the files it
+// includes, ahead of the file's own declarations; an imported interface
+// contributes its functions and globals. A file is included at most once per
+// translation unit however many times it is named.
+std::vector<std::unique_ptr<ASTnode>> Parser::include_list() {
+  std::vector<std::unique_ptr<ASTnode>> nodes;
+  while (CurTok.type == INCLUDE || isImport(CurTok)) {
+    TOKEN directive = CurTok;
+    std::string path;
+    if (!(directive.type == INCLUDE ? include(path) : import(path)))
+      return {};
+    size_t first = nodes.size();
+    expandInclude(path, nodes);
+    if (errorReported)
+      return {};
+    for (size_t i = first; i < nodes.size(); i++) {
+      // an interface has no source to point at, so its declarations are
+      // reported at the import
+      if (directive.type != INCLUDE)
+        nodes[i]->setLocation(directive);
+      // an included extern belongs to the directive that brought it in
+      if (DeclOffsets)
+        DeclOffsets->push_back(directive.offset);
+      finished(nodes[i]);
+    }
+  }
+  nodes.erase(std::remove(nodes.begin(), nodes.end(), nullptr), nodes.end());
+  return nodes;
+}
+
+void Parser::expandInclude(const std::string &path,
+                           std::vector<std::unique_ptr<ASTnode>> &nodes) {
+  if (!Included.insert(path).second)
+    return;
+  std::shared_ptr<const HeaderCache::Header> header = HeaderCache::get().lookup(path, Diags);
+  if (!header) {
+    errorReported = true;
+    return;
+  }
+  for (const std::string &nested : header->Includes)
+    expandInclude(nested, nodes);
+  for (auto &proto : header->Externs)
+    nodes.push_back(proto->clone());
+  for (auto &global : header->Globals)
+    nodes.push_back(std::make_unique<VariableASTnode>(global->getType(), global->getName()));
+}
+
+// header ::= include_list extern_list EOF | include_list EOF
+// Nested includes are recorded rather than expanded, so that each file
+// including this one applies include-once to them itself.
+bool Parser::parseHeader(HeaderCache::Header &header) {
+  getNextToken();
+  while (CurTok.type == INCLUDE) {
+    std::string path;
+    if (!include(path))
+      return false;
+    header.Includes.push_back(path);
+  }
+  while (CurTok.type == EXTERN) {
+    std::unique_ptr<ASTnode> node = pas_extern();
+    if (!node)
+      return false;
+    header.Externs.emplace_back(static_cast<PrototypeAST *>(node.release()));
+  }
+  if (CurTok.type != EOF_TOK) {
+    if (!errorReported)
+      errs() << "Syntax error: A header may only contain #include directives and externs, found \"" << CurTok.lexeme << "\" at line " << CurTok.lineNo << " column " << CurTok.columnNo << ".\n";
+    errorReported = true;
+  }
+  return !errorReported;
+}
+
+//===----------------------------------------------------------------------===//
+// Module Interfaces
+//===----------------------------------------------------------------------===//
+
+// A module interface (.mci) lists the functions and globals a file defines,
+// so that other files can import them without lexing or parsing it. All
+// integers are little endian:
+//
+//   "MCI1" u32:count  count * (u8:kind type name [u32:params params * (type name)])
+//
+// kind is 0 for a function, which has params, and 1 for a global. type is a
+// u8 index into InterfaceTypes, and name is a u32 length and then the bytes.
+
+static const char *const InterfaceTypes[] = {"void", "int", "float", "bool"};
+
+static void writeInterface(ArrayRef<std::unique_ptr<ASTnode>> nodes, raw_ostream &os) {
+  auto writeU32 = [&](uint32_t value) {
+    char bytes[4];
+    support::endian::write32le(bytes, value);
+    os.write(bytes, 4);
+  };
+  auto writeType = [&](const std::string &type) {
+    uint8_t index = std::find(std::begin(InterfaceTypes), std::end(InterfaceTypes), type) -
+                    std::begin(InterfaceTypes);
+    os << char(index);
+  };
+  auto writeName = [&](const std::string &name) {
+    writeU32(name.size());
+    os << name;
+  };
+  unsigned count = 0;
+  for (auto &node : nodes)
+    count += node->getFunction() || node->getVariable();
+  os << "MCI1";
+  writeU32(count);
+  for (auto &node : nodes) {
+    if (FunctionAST *function = node->getFunction()) {
+      PrototypeAST &proto = function->getProto();
+      os << char(0);
+      writeType(proto.getType());
+      writeName(proto.getName());
+      writeU32(proto.getArgs().size());
+      for (auto &arg : proto.getArgs()) {
+        writeType(arg->getType());
+        writeName(arg->getName());
+      }
+    } else if (VariableASTnode *global = node->getVariable()) {
+      os << char(1);
+      writeType(global->getType());
+      writeName(global->getName());
+    }
+  }
+}
+
+// readInterface - fill in header from the interface in data. False if data
+// isn't a well formed interface.
+static bool readInterface(StringRef data, HeaderCache::Header &header) {
+  size_t pos = 4;
+  auto readU32 = [&](uint32_t &value) {
+    if (data.size() - pos < 4)
+      return false;
+    value = support::endian::read32le(data.data() + pos);
+    pos += 4;
+    return true;
+  };
+  auto readByte = [&](uint8_t &value) {
+    if (pos == data.size())
+      return false;
+    value = data[pos++];
+    return true;
+  };
+  auto readType = [&](std::string &type) {
+    uint8_t index;
+    if (!readByte(index) || index >= std::size(InterfaceTypes))
+      return false;
+    type = InterfaceTypes[index];
+    return true;
+  };
+  auto readName = [&](std::string &name) {
+    uint32_t size;
+    if (!readU32(size) || data.size() - pos < size)
+      return false;
+    name = std::string(data.substr(pos, size));
+    pos += size;
+    return true;
+  };
+
+  uint32_t count;
+  if (!data.starts_with("MCI1") || !readU32(count))
+    return false;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t kind;
+    std::string type, name;
+    if (!readByte(kind) || !readType(type) || !readName(name))
+      return false;
+    if (kind == 1) {
+      header.Globals.push_back(std::make_unique<VariableASTnode>(type, name));
+      continue;
+    }
+    uint32_t params;
+    if (kind != 0 || !readU32(params))
+      return false;
+    std::vector<std::unique_ptr<VariableASTnode>> args;
+    for (uint32_t j = 0; j < params; j++) {
+      std::string argType, argName;
+      if (!readType(argType) || !readName(argName))
+        return false;
+      args.push_back(std::make_unique<VariableASTnode>(argType, argName));
+    }
+    header.Externs.push_back(std::make_unique<PrototypeAST>(name, std::move(args), type));
+  }
+  return pos == data.size();
+}
+
+std::shared_ptr<const HeaderCache::Header>
+HeaderCache::lookup(const std::string &path, raw_ostream &diags) {
+  fs::file_status status;
+  if (fs::status(path, status)) {
+    diags << "Syntax error: Cannot open included file \"" << path << "\".\n";
+    return nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(Lock);
+    auto found = Headers.find(path);
+    if (found != Headers.end() &&
+        found->second->Modified == status.getLastModificationTime() &&
+        found->second->Size == status.getSize()) {
+      Reused++;
+      return found->second;
+    }
+  }
+
+  // Two threads may both parse a header that is not cached yet; the result is
+  // the same and the second one to finish replaces the first. A large file
+  // is mapped rather than read.
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+      MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    diags << "Syntax error: Cannot open included file \"" << path << "\".\n";
+    return nullptr;
+  }
+  auto header = std::make_shared<Header>();
+  header->Modified = status.getLastModificationTime();
+  header->Size = status.getSize();
+  if (path::extension(path) == ".mci") {
+    if (!readInterface((*buffer)->getBuffer(), *header)) {
+      diags << "Syntax error: " << path << " is not a module interface.\n";
+      return nullptr;
+    }
+    Loaded++;
+    std::lock_guard<std::mutex> lock(Lock);
+    Headers[path] = header;
+    return header;
+  }
+  std::string errors;
+  raw_string_ostream errorStream(errors);
+  Lexer lexer((*buffer)->getBuffer());
+  Parser parser(lexer, errorStream);
+  parser.IncludeDir = std::string(path::parent_path(path));
+  if (!parser.parseHeader(*header)) {
+    diags << "In included file " << path << ":\n" << errorStream.str();
+    return nullptr;
   }
+  Loaded++;
+  std::lock_guard<std::mutex> lock(Lock);
+  Headers[path] = header;
+  return header;
 }
 
 
-static void parser() {
+std::unique_ptr<rootASTnode> Parser::parse(raw_ostream &out) {
   getNextToken();
   // fprintf(stderr, "Token: %s with type %d\n", CurTok.lexeme.c_str(),
   //           CurTok.type);
   auto root = program();
+  std::unique_ptr<ASTnode> end;
+  finished(end);
   if (root && CurTok.type == EOF_TOK && !errorReported){
     // llvm::outs() << root << "\n";
-    std::cout<<root->to_string()<<std::endl;
-    std::cout<<"Parsing successful."<<std::endl;
-    // return true;
+    int indentDepth = 0;
+    if (PrintTree)
+      out<<root->to_string(indentDepth)<<"\n";
+    out<<"Parsing successful."<<"\n";
+    return root;
 
   }
   else{
     if(!errorReported)
             {errs()<<"Syntax error: Invalid token1 at line "<<CurTok.lineNo<<" column "<<CurTok.columnNo<<".\n";}
     errorReported = true;
-    std::cout<<"Parsing Failed"<<std::endl;
-    // return false;
+    out<<"Parsing Failed"<<"\n";
+    return nullptr;
   }
 }
 
 //===----------------------------------------------------------------------===//
-// Code Generation
+// Semantic Analysis
 //===----------------------------------------------------------------------===//
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::unique_ptr<Module> TheModule;
+// Analysis runs in two phases. declare() is called on every top level node in
+// order on one thread and fills in the GlobalScope. After that the GlobalScope
+// is only read, so each function body is checked on its own thread with its
+// own LocalScope and DiagnosticList.
 
-//===----------------------------------------------------------------------===//
-// AST Printer
-//===----------------------------------------------------------------------===//
+struct FunctionSignature {
+  std::string returnType;
+  std::vector<std::string> paramTypes;
+  bool defined;
+};
 
-inline llvm::raw_ostream &operator<<(llvm::raw_ostream &os,
-                                     const ASTnode &ast) {
-  os << ast.to_string();
-  return os;
+struct GlobalScope {
+  std::map<std::string, std::string> variables;
+  std::map<std::string, FunctionSignature> functions;
+};
+
+class LocalScope {
+  struct Local {
+    std::string Type;
+    int Slot;
+  };
+  std::vector<std::map<std::string, Local>> Blocks;
+
+public:
+  const GlobalScope &Globals;
+  DiagnosticList &Diags;
+  std::string ReturnType;
+  // Each local of the function gets a slot of its own, numbered in the
+  // order they are declared, for the interpreter to keep it in
+  int NumLocals = 0;
+
+  LocalScope(const GlobalScope &globals, DiagnosticList &diags, std::string returnType)
+      : Globals(globals), Diags(diags), ReturnType(returnType) {}
+
+  void push() { Blocks.emplace_back(); }
+  void pop() { Blocks.pop_back(); }
+
+  bool declare(const std::string &name, const std::string &type) {
+    if (!Blocks.back().insert({name, {type, NumLocals}}).second)
+      return false;
+    NumLocals++;
+    return true;
+  }
+
+  // innermost local first, then globals, "" if the name is not declared
+  std::string lookup(const std::string &name) const {
+    if (const Local *local = lookupLocal(name))
+      return local->Type;
+    auto global = Globals.variables.find(name);
+    if (global != Globals.variables.end())
+      return global->second;
+    return "";
+  }
+
+  // The slot of the innermost local called name, or -1 if there is none
+  int lookupSlot(const std::string &name) const {
+    const Local *local = lookupLocal(name);
+    return local ? local->Slot : -1;
+  }
+
+  void error(const ASTnode &node, const std::string &message) {
+    Diags.push_back({node.getLineNo(), node.getColumnNo(), message});
+  }
+
+private:
+  const Local *lookupLocal(const std::string &name) const {
+    for (auto it = Blocks.rbegin(); it != Blocks.rend(); ++it) {
+      auto var = it->find(name);
+      if (var != it->end())
+        return &var->second;
+    }
+    return nullptr;
+  }
+};
+
+// Mini-C allows the widening conversions bool -> int -> float implicitly
+static bool canConvert(const std::string &from, const std::string &to) {
+  if (from == to)
+    return true;
+  if (from == "bool")
+    return to == "int" || to == "float";
+  return from == "int" && to == "float";
 }
 
-//===----------------------------------------------------------------------===//
-// Main driver code.
-//===----------------------------------------------------------------------===//
+// Type of an arithmetic expression: bool operands are promoted to int
+static std::string arithmeticType(const std::string &lhs, const std::string &rhs) {
+  return (lhs == "float" || rhs == "float") ? "float" : "int";
+}
 
-int main(int argc, char **argv) {
-  if (argc == 2) {
-    pFile = fopen(argv[1], "r");
-    if (pFile == NULL)
-      perror("Error opening file");
-  } else {
-    std::cout << "Usage: ./code InputFile\n";
-    return 1;
+// The parser represents "f(void)" as a single parameter of type void
+static std::vector<std::string> paramTypes(const PrototypeAST &proto) {
+  std::vector<std::string> types;
+  for (const auto &arg : proto.getArgs())
+    if (arg->getType() != "void")
+      types.push_back(arg->getType());
+  return types;
+}
+
+static void declareFunction(const PrototypeAST &proto, bool defined,
+                            GlobalScope &globals, DiagnosticList &diags) {
+  FunctionSignature sig = {proto.getType(), paramTypes(proto), defined};
+  auto existing = globals.functions.find(proto.getName());
+  if (existing == globals.functions.end()) {
+    globals.functions[proto.getName()] = sig;
+    return;
   }
+  FunctionSignature &prev = existing->second;
+  if (prev.returnType != sig.returnType || prev.paramTypes != sig.paramTypes)
+    diags.push_back({proto.getLineNo(), proto.getColumnNo(),
+                     "conflicting types for function '" + proto.getName() + "'"});
+  else if (prev.defined && defined)
+    diags.push_back({proto.getLineNo(), proto.getColumnNo(),
+                     "redefinition of function '" + proto.getName() + "'"});
+  prev.defined = prev.defined || defined;
+}
 
-  // initialize line number and column numbers to zero
-  lineNo = 1;
-  columnNo = 1;
+void PrototypeAST::declare(GlobalScope &globals, DiagnosticList &diags) {
+  declareFunction(*this, false, globals, diags);
+}
 
-  // get the first token
-  // getNextToken();
-  // while (CurTok.type != EOF_TOK) {
-  //   fprintf(stderr, "Token: %s with type %d\n", CurTok.lexeme.c_str(),
-  //           CurTok.type);
-  //   getNextToken();
-  // }
-  fprintf(stderr, "Lexer Finished\n");
-  
- 
+void FunctionAST::declare(GlobalScope &globals, DiagnosticList &diags) {
+  declareFunction(*Proto, true, globals, diags);
+}
 
-  // Make the module, which holds all the code.
-  TheModule = std::make_unique<Module>("mini-c", TheContext);
+void VariableASTnode::declare(GlobalScope &globals, DiagnosticList &diags) {
+  if (!globals.variables.insert({Val, Type}).second)
+    diags.push_back({LineNo, ColumnNo, "redefinition of global variable '" + Val + "'"});
+}
 
-  // fseek(pFile,0,SEEK_SET);
-  // clearTokBuffer(); //clear token buffer before re-reading file and starting parsing
+void FunctionAST::checkBody(const GlobalScope &globals, DiagnosticList &diags) {
+  LocalScope scope(globals, diags, Proto->getType());
+  scope.push();
+  for (const auto &arg : Proto->getArgs()) {
+    if (arg->getType() != "void" && !scope.declare(arg->getName(), arg->getType()))
+      scope.error(*arg, "redefinition of parameter '" + arg->getName() + "'");
+  }
+  Body->check(scope);
+  scope.pop();
+  NumLocals = scope.NumLocals;
+}
 
-  // lineNo = 1;
-  // columnNo = 1;
-//  fprintf(stderr, "Token: %s with type %d\n", CurTok.lexeme.c_str(),
-//             CurTok.type);
-  // Run the parser now.
-  // getNextToken();
-  parser();
-  fprintf(stderr, "Parsing Finished\n");
+std::string BlockASTnode::check(LocalScope &scope) {
+  scope.push();
+  for (auto &decl : localDecls)
+    decl->check(scope);
+  for (auto &stmt : stmtList)
+    stmt->check(scope);
+  scope.pop();
+  return "";
+}
 
-  //********************* Start printing final IR **************************
-  // Print out all of the generated code into a file called output.ll
-  auto Filename = "output.ll";
-  std::error_code EC;
-  raw_fd_ostream dest(Filename, EC, sys::fs::OF_None);
+// Local declaration
+std::string VariableASTnode::check(LocalScope &scope) {
+  if (!scope.declare(Val, Type))
+    scope.error(*this, "redefinition of local variable '" + Val + "'");
+  Slot = scope.lookupSlot(Val);
+  return "";
+}
 
-  if (EC) {
-    errs() << "Could not open file: " << EC.message();
-    return 1;
+std::string VariableRefASTnode::check(LocalScope &scope) {
+  ExprType = scope.lookup(Name);
+  Slot = scope.lookupSlot(Name);
+  if (ExprType == "")
+    scope.error(*this, "use of undeclared variable '" + Name + "'");
+  return ExprType;
+}
+
+std::string UnaryExprASTnode::check(LocalScope &scope) {
+  std::string operand = Operand->check(scope);
+  if (operand == "")
+    return ExprType = "";
+  if (operand == "void") {
+    scope.error(*this, "invalid operand of type void to unary '" + Opcode + "'");
+    return ExprType = "";
   }
-  // TheModule->print(errs(), nullptr); // print IR to terminal
-  TheModule->print(dest, nullptr);
-  //********************* End printing final IR ****************************
+  if (Opcode == "!")
+    return ExprType = "bool";
+  return ExprType = (operand == "bool") ? "int" : operand;
+}
 
-  fclose(pFile); // close the file that contains the code that was parsed
-  return 0;
+std::string BinaryExprASTnode::check(LocalScope &scope) {
+  std::string lhs = LHS->check(scope);
+  std::string rhs = RHS->check(scope);
+  if (lhs == "" || rhs == "")
+    return ExprType = "";
+
+  if (Opcode == "=") {
+    if (!canConvert(rhs, lhs)) {
+      scope.error(*this, "cannot assign a value of type " + rhs + " to a variable of type " + lhs);
+      return ExprType = "";
+    }
+    return ExprType = lhs;
+  }
+
+  if (lhs == "void" || rhs == "void") {
+    scope.error(*this, "invalid operand of type void to binary '" + Opcode + "'");
+    return ExprType = "";
+  }
+  if (Opcode == "&&" || Opcode == "||" || Opcode == "==" || Opcode == "!=" ||
+      Opcode == "<" || Opcode == "<=" || Opcode == ">" || Opcode == ">=")
+    return ExprType = "bool";
+  return ExprType = arithmeticType(lhs, rhs);
+}
+
+std::string CallExprAST::check(LocalScope &scope) {
+  std::vector<std::string> argTypes;
+  bool argsValid = true;
+  for (auto &arg : Args) {
+    argTypes.push_back(arg->check(scope));
+    argsValid = argsValid && argTypes.back() != "";
+  }
+
+  auto sig = scope.Globals.functions.find(Callee);
+  if (sig == scope.Globals.functions.end()) {
+    scope.error(*this, "call to undeclared function '" + Callee + "'");
+    return ExprType = "";
+  }
+  const std::vector<std::string> &params = sig->second.paramTypes;
+  if (params.size() != argTypes.size()) {
+    scope.error(*this, "function '" + Callee + "' expects " + std::to_string(params.size()) +
+                           " arguments but " + std::to_string(argTypes.size()) + " were given");
+    return ExprType = "";
+  }
+  for (size_t i = 0; i < params.size(); i++) {
+    if (argsValid && !canConvert(argTypes[i], params[i])) {
+      scope.error(*Args[i], "cannot pass a value of type " + argTypes[i] + " as parameter " +
+                                std::to_string(i + 1) + " of type " + params[i] + " to '" + Callee + "'");
+      return ExprType = "";
+    }
+  }
+  return ExprType = sig->second.returnType;
+}
+
+std::string IfExprAST::check(LocalScope &scope) {
+  if (Cond->check(scope) == "void")
+    scope.error(*Cond, "if condition has type void");
+  Then->check(scope);
+  if (Else)
+    Else->check(scope);
+  return "";
+}
+
+std::string WhileExprAST::check(LocalScope &scope) {
+  if (Cond->check(scope) == "void")
+    scope.error(*Cond, "while condition has type void");
+  Then->check(scope);
+  return "";
+}
+
+std::string ReturnExprAST::check(LocalScope &scope) {
+  if (!ReturnExpr) {
+    if (scope.ReturnType != "void")
+      scope.error(*this, "non-void function must return a value of type " + scope.ReturnType);
+    return "";
+  }
+  std::string type = ReturnExpr->check(scope);
+  if (type == "")
+    return "";
+  if (scope.ReturnType == "void")
+    scope.error(*this, "void function cannot return a value");
+  else if (!canConvert(type, scope.ReturnType))
+    scope.error(*this, "cannot return a value of type " + type + " from a function returning " + scope.ReturnType);
+  return "";
+}
+
+static void sortDiagnostics(DiagnosticList &diags) {
+  std::stable_sort(diags.begin(), diags.end(), [](const Diagnostic &a, const Diagnostic &b) {
+    return a.lineNo != b.lineNo ? a.lineNo < b.lineNo : a.columnNo < b.columnNo;
+  });
+}
+
+// Phase one collects every top level declaration. Phase two checks the
+// function bodies in parallel, each into its own DiagnosticList, and the lists
+// are merged and sorted by position so the output does not depend on the
+// order the threads finished in.
+bool rootASTnode::analyse(DiagnosticList &diags, unsigned numThreads) {
+  GlobalScope globals;
+  std::vector<FunctionAST *> functions;
+  for (auto &node : TopNodes) {
+    node->declare(globals, diags);
+    if (FunctionAST *function = node->getFunction())
+      functions.push_back(function);
+  }
+
+  std::vector<DiagnosticList> functionDiags(functions.size());
+  numThreads = std::min<unsigned>(numThreads, functions.size());
+  if (numThreads <= 1) {
+    for (size_t i = 0; i < functions.size(); i++)
+      functions[i]->checkBody(globals, functionDiags[i]);
+  } else {
+    ThreadPool pool(hardware_concurrency(numThreads));
+    for (size_t i = 0; i < functions.size(); i++)
+      pool.async([&, i] { functions[i]->checkBody(globals, functionDiags[i]); });
+    pool.wait();
+  }
+
+  for (auto &list : functionDiags)
+    diags.insert(diags.end(), list.begin(), list.end());
+  sortDiagnostics(diags);
+  return diags.empty();
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+// Local variables never live in memory. An assignment records the new value
+// of the variable for the current block, and a read looks the value up
+// through the block's predecessors, adding phi nodes where control flow
+// joins (Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form"). A block is sealed once all of its predecessors are
+// known; a read in an unsealed block (a loop header) gets an empty phi that
+// is filled in when the block is sealed. Globals are loaded and stored.
+
+/// ModuleDeclarations - the program's functions, externs and globals. A
+/// module holding only some of the function bodies declares the rest of
+/// these as it first refers to them.
+struct ModuleDeclarations {
+  std::vector<FunctionAST *> Functions;
+  std::map<std::string, FunctionAST *> Definitions;
+  std::map<std::string, PrototypeAST *> Prototypes;
+  std::map<std::string, VariableASTnode *> Globals;
+};
+
+class CodeGenerator {
+public:
+  LLVMContext &Context;
+  IRBuilder<> &Builder;
+  Module &TheModule;
+  const ModuleDeclarations &Decls;
+  raw_ostream &Diags;
+  bool HadError = false;
+  bool Verify = true; // run the verifier over each finished function
+  // -tiered: generate functions as continuations entered at this loop,
+  // from the interpreter's locals; see enterLoop()
+  const ASTnode *EntryLoop = nullptr;
+
+  CodeGenerator(LLVMContext &context, IRBuilder<> &builder, Module &module,
+                const ModuleDeclarations &decls, raw_ostream &diags)
+      : Context(context), Builder(builder), TheModule(module), Decls(decls),
+        Diags(diags) {}
+
+  Type *getType(const std::string &type) {
+    if (type == "int")
+      return Type::getInt32Ty(Context);
+    if (type == "float")
+      return Type::getFloatTy(Context);
+    if (type == "bool")
+      return Type::getInt1Ty(Context);
+    return Type::getVoidTy(Context);
+  }
+
+  // Widening conversions: bool -> int -> float
+  Value *convert(Value *value, Type *to) {
+    Type *from = value->getType();
+    if (from == to)
+      return value;
+    if (to->isFloatTy())
+      return from->isIntegerTy(1) ? Builder.CreateUIToFP(value, to, "booltofp")
+                                  : Builder.CreateSIToFP(value, to, "inttofp");
+    return Builder.CreateZExt(value, to, "booltoint");
+  }
+
+  Value *toBool(Value *value) {
+    Type *type = value->getType();
+    if (type->isIntegerTy(1))
+      return value;
+    if (type->isFloatTy())
+      return Builder.CreateFCmpUNE(value, ConstantFP::get(type, 0.0), "tobool");
+    return Builder.CreateICmpNE(value, ConstantInt::get(type, 0), "tobool");
+  }
+
+  Function *getFunction(const std::string &name);
+
+  // Globals this module refers to but does not define are external
+  GlobalVariable *getGlobal(const std::string &name) {
+    if (GlobalVariable *global = TheModule.getNamedGlobal(name))
+      return global;
+    return new GlobalVariable(TheModule, getType(Decls.Globals.at(name)->getType()),
+                              false, GlobalValue::ExternalLinkage, nullptr, name);
+  }
+
+  Function *currentFunction() const { return CurFunction; }
+
+  void startFunction(Function *function, int line = 0) {
+    CurFunction = function;
+    if (DebugInfo) {
+      DISubprogram *subprogram = DebugInfo->createFunction(
+          DebugFile, function->getName(), StringRef(), DebugFile, line,
+          DebugInfo->createSubroutineType(DebugInfo->getOrCreateTypeArray({})), line,
+          DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+      function->setSubprogram(subprogram);
+      Builder.SetCurrentDebugLocation(DILocation::get(Context, line, 0, subprogram));
+    }
+    BasicBlock *entry = BasicBlock::Create(Context, "entry", function);
+    sealBlock(entry);
+    Builder.SetInsertPoint(entry);
+    pushScope();
+  }
+
+  void finishFunction() {
+    Builder.SetCurrentDebugLocation(DebugLoc());
+    if (DebugInfo)
+      DebugInfo->finalizeSubprogram(CurFunction->getSubprogram());
+    popScope();
+    // returns and if statements whose branches both return leave blocks
+    // with no predecessors behind them
+    EliminateUnreachableBlocks(*CurFunction);
+    CurFunction = nullptr;
+    VarTypes.clear();
+    VarNames.clear();
+    VarSlots.clear();
+    CurrentDef.clear();
+    SealedBlocks.clear();
+    IncompletePhis.clear();
+  }
+
+  void pushScope() { Scopes.emplace_back(); }
+  void popScope() { Scopes.pop_back(); }
+
+  // slot is where the interpreter keeps the local
+  void declareLocal(const std::string &name, Type *type, Value *init, int slot) {
+    unsigned var = VarTypes.size();
+    VarTypes.push_back(type);
+    VarNames.push_back(name);
+    VarSlots.push_back(slot);
+    CurrentDef.emplace_back();
+    Scopes.back()[name] = var;
+    writeVariable(var, Builder.GetInsertBlock(), init);
+  }
+
+  // Index of the innermost local called name, or -1 if it is a global
+  int lookupLocal(const std::string &name) const {
+    for (auto it = Scopes.rbegin(); it != Scopes.rend(); ++it) {
+      auto var = it->find(name);
+      if (var != it->end())
+        return var->second;
+    }
+    return -1;
+  }
+
+  Value *readLocal(unsigned var) { return readVariable(var, Builder.GetInsertBlock()); }
+  void writeLocal(unsigned var, Value *value) {
+    writeVariable(var, Builder.GetInsertBlock(), value);
+  }
+
+  // Blocks are created detached and added to the function by emitBlock(),
+  // so they appear in the order their code is generated
+  BasicBlock *createBlock(const Twine &name) {
+    return BasicBlock::Create(Context, name);
+  }
+
+  void emitBlock(BasicBlock *block) {
+    block->insertInto(CurFunction);
+    Builder.SetInsertPoint(block);
+  }
+
+  // A continuation of a function with proto, name.loop(locals), entered at
+  // EntryLoop with its locals in the interpreter's slots at locals, and
+  // returning what the function returns
+  Function *createContinuation(const PrototypeAST &proto) {
+    Type *returnType = getType(proto.getType());
+    FunctionType *type =
+        FunctionType::get(returnType, {Type::getInt64Ty(Context)->getPointerTo()}, false);
+    Function *function = Function::Create(type, Function::ExternalLinkage,
+                                          proto.getName() + ".loop", TheModule);
+    if (returnType->isIntegerTy(1))
+      function->addRetAttr(Attribute::ZExt);
+    return function;
+  }
+
+  // Called by EntryLoop before it places its condition block: a new entry
+  // block loads every local in scope from its slot and branches to cond.
+  // The code before the loop is left unreachable and is removed.
+  void enterLoop(BasicBlock *cond) {
+    BasicBlock *entry =
+        BasicBlock::Create(Context, "loop.entry", CurFunction, &CurFunction->getEntryBlock());
+    IRBuilder<> builder(entry);
+    Type *slotType = builder.getInt64Ty();
+    for (auto &scope : Scopes)
+      for (auto &local : scope) {
+        unsigned var = local.second;
+        // bools are i1 in registers and a byte in memory
+        Type *type = VarTypes[var];
+        Type *memoryType = type->isIntegerTy(1) ? builder.getInt8Ty() : type;
+        Value *address = builder.CreateConstGEP1_32(slotType, CurFunction->getArg(0), VarSlots[var]);
+        address = builder.CreateBitCast(address, memoryType->getPointerTo());
+        Value *value = builder.CreateLoad(memoryType, address, VarNames[var]);
+        writeVariable(var, entry, builder.CreateTrunc(value, type));
+      }
+    builder.CreateBr(cond);
+    sealBlock(entry);
+  }
+
+  // -perf: a line table for each function, so that a profile of the JIT
+  // compiled code can name Mini-C lines. Code is attributed to the line of
+  // the statement or call it was generated for. Call startDebugInfo()
+  // before generating functions and finishDebugInfo() after.
+  void startDebugInfo(StringRef sourceName) {
+    SmallString<128> source(sourceName);
+    sys::fs::make_absolute(source);
+    DebugInfo = std::make_unique<DIBuilder>(TheModule);
+    DebugFile = DebugInfo->createFile(path::filename(source), path::parent_path(source));
+    DebugInfo->createCompileUnit(dwarf::DW_LANG_C, DebugFile, "mccomp", false, "", 0, "",
+                                 DICompileUnit::LineTablesOnly);
+    TheModule.addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+  }
+
+  void finishDebugInfo() {
+    if (DebugInfo)
+      DebugInfo->finalize();
+  }
+
+  void setLocation(const ASTnode &node) {
+    if (DebugInfo && CurFunction && node.getLineNo() > 0)
+      Builder.SetCurrentDebugLocation(
+          DILocation::get(Context, node.getLineNo(), 0, CurFunction->getSubprogram()));
+  }
+
+  // A block nothing branches to, used for statements after a return
+  bool isDead(BasicBlock *block) {
+    return pred_empty(block) && block != &CurFunction->getEntryBlock();
+  }
+
+  // Finish the current block with a branch to target, unless it ended in a
+  // return or can never be reached
+  void branchTo(BasicBlock *target) {
+    BasicBlock *current = Builder.GetInsertBlock();
+    if (current->getTerminator())
+      return;
+    if (isDead(current))
+      Builder.CreateUnreachable();
+    else
+      Builder.CreateBr(target);
+  }
+
+  // Code after a return goes into a fresh block that nothing branches to
+  void startDeadBlock() {
+    BasicBlock *dead = createBlock("dead");
+    sealBlock(dead);
+    emitBlock(dead);
+  }
+
+  void sealBlock(BasicBlock *block) {
+    auto incomplete = IncompletePhis.find(block);
+    if (incomplete != IncompletePhis.end()) {
+      std::vector<std::pair<unsigned, PHINode *>> phis = std::move(incomplete->second);
+      IncompletePhis.erase(incomplete);
+      SealedBlocks.insert(block);
+      for (auto &phi : phis)
+        addPhiOperands(phi.first, phi.second);
+      return;
+    }
+    SealedBlocks.insert(block);
+  }
+
+private:
+  Function *CurFunction = nullptr;
+  std::unique_ptr<DIBuilder> DebugInfo; // with -perf
+  DIFile *DebugFile = nullptr;
+  std::vector<std::map<std::string, unsigned>> Scopes;
+  std::vector<Type *> VarTypes;
+  std::vector<std::string> VarNames;
+  std::vector<int> VarSlots;
+  // CurrentDef[var][block] is the value var has at the end of block. The
+  // handles follow replaceAllUsesWith when a trivial phi is removed.
+  std::vector<DenseMap<BasicBlock *, WeakTrackingVH>> CurrentDef;
+  SmallPtrSet<BasicBlock *, 32> SealedBlocks;
+  DenseMap<BasicBlock *, std::vector<std::pair<unsigned, PHINode *>>> IncompletePhis;
+
+  void writeVariable(unsigned var, BasicBlock *block, Value *value) {
+    CurrentDef[var][block] = value;
+  }
+
+  Value *readVariable(unsigned var, BasicBlock *block) {
+    auto def = CurrentDef[var].find(block);
+    if (def != CurrentDef[var].end())
+      return def->second;
+    return readVariableRecursive(var, block);
+  }
+
+  PHINode *createPhi(unsigned var, BasicBlock *block) {
+    IRBuilder<> phiBuilder(block, block->begin());
+    return phiBuilder.CreatePHI(VarTypes[var], 2, VarNames[var]);
+  }
+
+  Value *readVariableRecursive(unsigned var, BasicBlock *block) {
+    Value *value;
+    if (!SealedBlocks.count(block)) {
+      PHINode *phi = createPhi(var, block);
+      IncompletePhis[block].push_back({var, phi});
+      value = phi;
+    } else if (BasicBlock *pred = block->getSinglePredecessor()) {
+      value = readVariable(var, pred);
+    } else {
+      // the phi is recorded first so that a loop back to this block finds it
+      PHINode *phi = createPhi(var, block);
+      writeVariable(var, block, phi);
+      value = addPhiOperands(var, phi);
+    }
+    writeVariable(var, block, value);
+    return value;
+  }
+
+  Value *addPhiOperands(unsigned var, PHINode *phi) {
+    for (BasicBlock *pred : predecessors(phi->getParent()))
+      phi->addIncoming(readVariable(var, pred), pred);
+    return tryRemoveTrivialPhi(phi);
+  }
+
+  // A phi whose operands are all itself or one other value is replaced by
+  // that value. Phis that used it may become trivial in turn.
+  Value *tryRemoveTrivialPhi(PHINode *phi) {
+    BasicBlock *block = phi->getParent();
+    if (!SealedBlocks.count(block) ||
+        phi->getNumIncomingValues() != pred_size(block))
+      return phi; // still being filled in
+    Value *same = nullptr;
+    for (Value *op : phi->incoming_values()) {
+      if (op == same || op == phi)
+        continue;
+      if (same)
+        return phi; // merges at least two values
+      same = op;
+    }
+    if (!same)
+      same = UndefValue::get(phi->getType()); // unreachable block
+
+    SmallVector<WeakVH, 8> users;
+    for (User *user : phi->users())
+      if (user != phi && isa<PHINode>(user))
+        users.push_back(user);
+    phi->replaceAllUsesWith(same);
+    phi->eraseFromParent();
+
+    // same may itself be one of the users and be replaced below
+    WeakTrackingVH result = same;
+    for (WeakVH &user : users)
+      if (auto *userPhi = dyn_cast_or_null<PHINode>(user))
+        tryRemoveTrivialPhi(userPhi);
+    return result;
+  }
+};
+
+Value *IntASTnode::codegen(CodeGenerator &gen) {
+  return ConstantInt::get(gen.getType("int"), Val, true);
+}
+
+Value *FloatASTnode::codegen(CodeGenerator &gen) {
+  return ConstantFP::get(gen.getType("float"), Val);
+}
+
+Value *BoolASTnode::codegen(CodeGenerator &gen) {
+  return ConstantInt::get(gen.getType("bool"), Val);
+}
+
+// Globals at the top level, locals inside a function. Locals start as zero.
+Value *VariableASTnode::codegen(CodeGenerator &gen) {
+  llvm::Type *type = gen.getType(Type);
+  if (gen.currentFunction()) {
+    gen.declareLocal(Val, type, Constant::getNullValue(type), Slot);
+    return nullptr;
+  }
+  if (GlobalVariable *existing = gen.TheModule.getNamedGlobal(Val))
+    return existing;
+  return new GlobalVariable(gen.TheModule, type, false, GlobalValue::CommonLinkage,
+                            Constant::getNullValue(type), Val);
+}
+
+Value *VariableRefASTnode::codegen(CodeGenerator &gen) {
+  int var = gen.lookupLocal(Name);
+  if (var >= 0)
+    return gen.readLocal(var);
+  GlobalVariable *global = gen.getGlobal(Name);
+  return gen.Builder.CreateLoad(global->getValueType(), global, Name);
+}
+
+Value *UnaryExprASTnode::codegen(CodeGenerator &gen) {
+  Value *operand = Operand->codegen(gen);
+  if (Opcode == "!")
+    return gen.Builder.CreateNot(gen.toBool(operand), "nottmp");
+  operand = gen.convert(operand, gen.getType(ExprType));
+  if (operand->getType()->isFloatTy())
+    return gen.Builder.CreateFNeg(operand, "negtmp");
+  return gen.Builder.CreateNeg(operand, "negtmp");
+}
+
+Value *BinaryExprASTnode::codegen(CodeGenerator &gen) {
+  IRBuilder<> &Builder = gen.Builder;
+
+  if (Opcode == "=") {
+    gen.setLocation(*this);
+    const std::string &name = static_cast<VariableRefASTnode *>(LHS.get())->getName();
+    Value *value = gen.convert(RHS->codegen(gen), gen.getType(ExprType));
+    int var = gen.lookupLocal(name);
+    if (var >= 0)
+      gen.writeLocal(var, value);
+    else
+      Builder.CreateStore(value, gen.getGlobal(name));
+    return value;
+  }
+
+  // && and || only evaluate the right operand when it decides the result
+  if (Opcode == "&&" || Opcode == "||") {
+    Value *lhs = gen.toBool(LHS->codegen(gen));
+    BasicBlock *lhsBB = Builder.GetInsertBlock();
+    BasicBlock *rhsBB = gen.createBlock(Opcode == "&&" ? "and.rhs" : "or.rhs");
+    BasicBlock *mergeBB = gen.createBlock(Opcode == "&&" ? "and.end" : "or.end");
+    if (Opcode == "&&")
+      Builder.CreateCondBr(lhs, rhsBB, mergeBB);
+    else
+      Builder.CreateCondBr(lhs, mergeBB, rhsBB);
+    gen.sealBlock(rhsBB);
+
+    gen.emitBlock(rhsBB);
+    Value *rhs = gen.toBool(RHS->codegen(gen));
+    BasicBlock *rhsEndBB = Builder.GetInsertBlock();
+    Builder.CreateBr(mergeBB);
+    gen.sealBlock(mergeBB);
+
+    gen.emitBlock(mergeBB);
+    PHINode *phi = Builder.CreatePHI(gen.getType("bool"), 2, Opcode == "&&" ? "andtmp" : "ortmp");
+    phi->addIncoming(ConstantInt::get(gen.getType("bool"), Opcode == "||"), lhsBB);
+    phi->addIncoming(rhs, rhsEndBB);
+    return phi;
+  }
+
+  Value *lhs = LHS->codegen(gen);
+  Value *rhs = RHS->codegen(gen);
+  // operands are promoted to a common type; bools compare as ints
+  Type *operandType = gen.getType(arithmeticType(LHS->getExprType(), RHS->getExprType()));
+  lhs = gen.convert(lhs, operandType);
+  rhs = gen.convert(rhs, operandType);
+
+  if (operandType->isFloatTy()) {
+    if (Opcode == "+") return Builder.CreateFAdd(lhs, rhs, "addtmp");
+    if (Opcode == "-") return Builder.CreateFSub(lhs, rhs, "subtmp");
+    if (Opcode == "*") return Builder.CreateFMul(lhs, rhs, "multmp");
+    if (Opcode == "/") return Builder.CreateFDiv(lhs, rhs, "divtmp");
+    if (Opcode == "%") return Builder.CreateFRem(lhs, rhs, "modtmp");
+    if (Opcode == "==") return Builder.CreateFCmpOEQ(lhs, rhs, "eqtmp");
+    if (Opcode == "!=") return Builder.CreateFCmpUNE(lhs, rhs, "netmp");
+    if (Opcode == "<") return Builder.CreateFCmpOLT(lhs, rhs, "lttmp");
+    if (Opcode == "<=") return Builder.CreateFCmpOLE(lhs, rhs, "letmp");
+    if (Opcode == ">") return Builder.CreateFCmpOGT(lhs, rhs, "gttmp");
+    if (Opcode == ">=") return Builder.CreateFCmpOGE(lhs, rhs, "getmp");
+  } else {
+    if (Opcode == "+") return Builder.CreateAdd(lhs, rhs, "addtmp");
+    if (Opcode == "-") return Builder.CreateSub(lhs, rhs, "subtmp");
+    if (Opcode == "*") return Builder.CreateMul(lhs, rhs, "multmp");
+    if (Opcode == "/") return Builder.CreateSDiv(lhs, rhs, "divtmp");
+    if (Opcode == "%") return Builder.CreateSRem(lhs, rhs, "modtmp");
+    if (Opcode == "==") return Builder.CreateICmpEQ(lhs, rhs, "eqtmp");
+    if (Opcode == "!=") return Builder.CreateICmpNE(lhs, rhs, "netmp");
+    if (Opcode == "<") return Builder.CreateICmpSLT(lhs, rhs, "lttmp");
+    if (Opcode == "<=") return Builder.CreateICmpSLE(lhs, rhs, "letmp");
+    if (Opcode == ">") return Builder.CreateICmpSGT(lhs, rhs, "gttmp");
+    if (Opcode == ">=") return Builder.CreateICmpSGE(lhs, rhs, "getmp");
+  }
+  return nullptr;
+}
+
+Value *CallExprAST::codegen(CodeGenerator &gen) {
+  Function *callee = gen.getFunction(Callee);
+  std::vector<Value *> args;
+  for (size_t i = 0; i < Args.size(); i++)
+    args.push_back(gen.convert(Args[i]->codegen(gen), callee->getArg(i)->getType()));
+  gen.setLocation(*this);
+  return gen.Builder.CreateCall(callee, args, callee->getReturnType()->isVoidTy() ? "" : "calltmp");
+}
+
+Value *IfExprAST::codegen(CodeGenerator &gen) {
+  IRBuilder<> &Builder = gen.Builder;
+  gen.setLocation(*this);
+  Value *cond = gen.toBool(Cond->codegen(gen));
+
+  BasicBlock *thenBB = gen.createBlock("if.then");
+  BasicBlock *elseBB = Else ? gen.createBlock("if.else") : nullptr;
+  BasicBlock *mergeBB = gen.createBlock("if.end");
+  Builder.CreateCondBr(cond, thenBB, Else ? elseBB : mergeBB);
+
+  gen.sealBlock(thenBB);
+  gen.emitBlock(thenBB);
+  Then->codegen(gen);
+  gen.branchTo(mergeBB);
+
+  if (Else) {
+    gen.sealBlock(elseBB);
+    gen.emitBlock(elseBB);
+    Else->codegen(gen);
+    gen.branchTo(mergeBB);
+  }
+
+  gen.sealBlock(mergeBB);
+  gen.emitBlock(mergeBB);
+  return nullptr;
+}
+
+Value *WhileExprAST::codegen(CodeGenerator &gen) {
+  IRBuilder<> &Builder = gen.Builder;
+  BasicBlock *condBB = gen.createBlock("while.cond");
+  BasicBlock *bodyBB = gen.createBlock("while.body");
+  BasicBlock *endBB = gen.createBlock("while.end");
+  gen.branchTo(condBB);
+  if (gen.EntryLoop == this)
+    gen.enterLoop(condBB);
+
+  // the condition block stays unsealed until the back edge exists
+  gen.emitBlock(condBB);
+  gen.setLocation(*this);
+  Value *cond = gen.toBool(Cond->codegen(gen));
+  Builder.CreateCondBr(cond, bodyBB, endBB);
+
+  gen.sealBlock(bodyBB);
+  gen.emitBlock(bodyBB);
+  Then->codegen(gen);
+  gen.branchTo(condBB);
+
+  gen.sealBlock(condBB);
+  gen.sealBlock(endBB);
+  gen.emitBlock(endBB);
+  return nullptr;
+}
+
+Value *ReturnExprAST::codegen(CodeGenerator &gen) {
+  gen.setLocation(*this);
+  if (ReturnExpr) {
+    Value *value = ReturnExpr->codegen(gen);
+    gen.setLocation(*this);
+    gen.Builder.CreateRet(gen.convert(value, gen.currentFunction()->getReturnType()));
+  } else {
+    gen.Builder.CreateRetVoid();
+  }
+  gen.startDeadBlock();
+  return nullptr;
+}
+
+Value *BlockASTnode::codegen(CodeGenerator &gen) {
+  gen.pushScope();
+  for (auto &decl : localDecls)
+    decl->codegen(gen);
+  for (auto &stmt : stmtList)
+    stmt->codegen(gen);
+  gen.popScope();
+  return nullptr;
+}
+
+Function *PrototypeAST::codegen(CodeGenerator &gen) {
+  if (Function *existing = gen.TheModule.getFunction(Name))
+    return existing;
+
+  std::vector<llvm::Type *> params;
+  for (const auto &arg : Args)
+    if (arg->getType() != "void")
+      params.push_back(gen.getType(arg->getType()));
+  FunctionType *type = FunctionType::get(gen.getType(Type), params, false);
+  Function *function = Function::Create(type, Function::ExternalLinkage, Name, gen.TheModule);
+
+  // bools are passed and returned zero extended, as C does
+  if (type->getReturnType()->isIntegerTy(1))
+    function->addRetAttr(Attribute::ZExt);
+  unsigned i = 0;
+  for (auto &arg : function->args()) {
+    arg.setName(Args[i++]->getName());
+    if (arg.getType()->isIntegerTy(1))
+      arg.addAttr(Attribute::ZExt);
+  }
+  return function;
+}
+
+Value *FunctionAST::codegen(CodeGenerator &gen) {
+  Function *function = gen.EntryLoop ? gen.createContinuation(*Proto) : Proto->codegen(gen);
+  gen.startFunction(function, LineNo);
+  // names come from the AST, as the context may be discarding value names.
+  // Parameters have the first slots.
+  unsigned i = 0;
+  for (auto &param : Proto->getArgs()) {
+    if (param->getType() == "void")
+      continue;
+    llvm::Type *type = gen.getType(param->getType());
+    // a continuation finds its parameters with the other locals
+    Value *value = gen.EntryLoop ? Constant::getNullValue(type)
+                                 : static_cast<Value *>(function->getArg(i));
+    gen.declareLocal(param->getName(), type, value, i++);
+  }
+
+  Body->codegen(gen);
+
+  // falling off the end returns zero (or nothing from a void function)
+  if (!gen.Builder.GetInsertBlock()->getTerminator()) {
+    llvm::Type *returnType = function->getReturnType();
+    if (returnType->isVoidTy())
+      gen.Builder.CreateRetVoid();
+    else
+      gen.Builder.CreateRet(Constant::getNullValue(returnType));
+  }
+  gen.finishFunction();
+
+  if (gen.Verify && verifyFunction(*function, &gen.Diags)) {
+    gen.Diags << "Code generation error: invalid IR for function '" << Proto->getName() << "'.\n";
+    gen.HadError = true;
+  }
+  return function;
+}
+
+Function *CodeGenerator::getFunction(const std::string &name) {
+  if (Function *function = TheModule.getFunction(name))
+    return function;
+  return Decls.Prototypes.at(name)->codegen(*this);
+}
+
+// Declares every extern, global and function prototype in source order.
+// The function bodies are generated separately, in shards.
+Value *rootASTnode::codegen(CodeGenerator &gen) {
+  for (auto &node : TopNodes) {
+    if (PrototypeAST *proto = node->getPrototype())
+      proto->codegen(gen);
+    else
+      node->codegen(gen);
+  }
+  return nullptr;
+}
+
+static void collectDeclaration(ASTnode &node, ModuleDeclarations &decls) {
+  if (FunctionAST *function = node.getFunction()) {
+    decls.Functions.push_back(function);
+    decls.Definitions[function->getProto().getName()] = function;
+  }
+  if (PrototypeAST *proto = node.getPrototype())
+    decls.Prototypes[proto->getName()] = proto;
+  else if (VariableASTnode *global = node.getVariable())
+    decls.Globals[global->getName()] = global;
+}
+
+void rootASTnode::collectDeclarations(ModuleDeclarations &decls) {
+  for (auto &node : TopNodes)
+    collectDeclaration(*node, decls);
+}
+
+//===----------------------------------------------------------------------===//
+// Compilation Cache
+//===----------------------------------------------------------------------===//
+
+// Fingerprints are s-expressions over the AST. Layout, comments and source
+// locations don't appear in them; float literals are written as their bits.
+// Every node is a list headed by its kind, so that no two different trees,
+// such as a variable i5 and the literal 5, are written the same way.
+void IntASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (int " + std::to_string(Val) + ")";
+}
+
+void FloatASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (float " + utohexstr(FloatToBits(Val)) + ")";
+}
+
+void BoolASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += Val ? " (bool true)" : " (bool false)";
+}
+
+void VariableASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (var " + Type + " " + Val + ")";
+}
+
+void VariableRefASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (ref " + Name + ")";
+  fp.References.insert(Name);
+}
+
+void UnaryExprASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (unary " + Opcode;
+  Operand->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void BinaryExprASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (binary " + Opcode;
+  if (fp.Lines && Opcode == "=")
+    fp.Text += " @" + std::to_string(LineNo);
+  LHS->fingerprint(fp);
+  RHS->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void CallExprAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (call " + Callee;
+  if (fp.Lines)
+    fp.Text += " @" + std::to_string(LineNo);
+  fp.References.insert(Callee);
+  for (auto &arg : Args)
+    arg->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void IfExprAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (if";
+  if (fp.Lines)
+    fp.Text += " @" + std::to_string(LineNo);
+  Cond->fingerprint(fp);
+  Then->fingerprint(fp);
+  if (Else)
+    Else->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void WhileExprAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (while";
+  if (fp.Lines)
+    fp.Text += " @" + std::to_string(LineNo);
+  Cond->fingerprint(fp);
+  Then->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void ReturnExprAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (return";
+  if (fp.Lines)
+    fp.Text += " @" + std::to_string(LineNo);
+  if (ReturnExpr)
+    ReturnExpr->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void BlockASTnode::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (block";
+  for (auto &decl : localDecls)
+    decl->fingerprint(fp);
+  for (auto &stmt : stmtList)
+    stmt->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void PrototypeAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (proto " + Type + " " + Name;
+  for (auto &arg : Args)
+    arg->fingerprint(fp);
+  fp.Text += ")";
+}
+
+void FunctionAST::fingerprint(Fingerprint &fp) const {
+  fp.Text += " (function";
+  if (fp.Lines)
+    fp.Text += " @" + std::to_string(LineNo);
+  Proto->fingerprint(fp);
+  Body->fingerprint(fp);
+  fp.Text += ")";
+}
+
+/// DiskCache - a directory of compiled fragments, each stored in a file
+/// named by the hash of its key. A hit refreshes the file's modification
+/// time, so prune() can evict least recently used entries until the
+/// directory fits in MaxBytes. Entries are written to a temporary file and
+/// renamed into place, so threads and processes can share a directory, and
+/// a hit that is mapped rather than read stays valid when its entry is
+/// replaced or evicted.
+class DiskCache {
+public:
+  std::atomic<unsigned> Hits{0}, Misses{0};
+
+  DiskCache(StringRef dir, uint64_t maxBytes) : Dir(dir.str()), MaxBytes(maxBytes) {}
+
+  bool create(raw_ostream &diags) {
+    if (std::error_code EC = sys::fs::create_directories(Dir)) {
+      diags << "Could not create cache directory " << Dir << ": " << EC.message() << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<MemoryBuffer> lookup(StringRef key) {
+    std::string path = entryPath(key);
+    int fd;
+    if (sys::fs::openFileForRead(path, fd)) {
+      Misses++;
+      return nullptr;
+    }
+    sys::fs::file_t file = sys::fs::convertFDToNativeFile(fd);
+    auto buffer = MemoryBuffer::getOpenFile(file, path, -1, /*RequiresNullTerminator=*/false);
+    sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+    sys::fs::closeFile(file);
+    if (!buffer) {
+      Misses++;
+      return nullptr;
+    }
+    Hits++;
+    return std::move(*buffer);
+  }
+
+  void store(StringRef key, StringRef data) {
+    int fd;
+    SmallString<128> temp;
+    if (sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%", fd, temp))
+      return;
+    {
+      raw_fd_ostream os(fd, /*shouldClose=*/true);
+      os << data;
+    }
+    if (sys::fs::rename(temp, entryPath(key)))
+      sys::fs::remove(temp);
+  }
+
+  void prune() {
+    struct Entry {
+      std::string Path;
+      uint64_t Size;
+      sys::TimePoint<> Used;
+    };
+    std::vector<Entry> entries;
+    std::error_code EC;
+    for (sys::fs::directory_iterator it(Dir, EC), end; it != end && !EC; it.increment(EC)) {
+      sys::fs::file_status status;
+      if (!StringRef(it->path()).ends_with(".entry") || sys::fs::status(it->path(), status))
+        continue;
+      entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+    }
+    llvm::sort(entries, [](const Entry &a, const Entry &b) { return a.Used > b.Used; });
+    uint64_t total = 0;
+    for (const Entry &entry : entries) {
+      total += entry.Size;
+      if (total > MaxBytes)
+        sys::fs::remove(entry.Path);
+    }
+  }
+
+private:
+  std::string Dir;
+  uint64_t MaxBytes;
+
+  std::string entryPath(StringRef key) const {
+    return Dir + "/" + toHex(SHA1::hash(arrayRefFromStringRef(key)), true) + ".entry";
+  }
+};
+
+/// ShardMemo - the shards of the last build of a file, kept in memory by
+/// --watch so that a rebuild only generates shards whose functions have
+/// changed. A shard is keyed by the cache keys of its functions, and those
+/// are remembered for as long as the function's AST is kept. A shard's
+/// object file is made when an object is first wanted and stays until the
+/// shard is dropped. Shards that only become objects are grouped by what
+/// changed rather than by position, see group().
+class ShardMemo {
+public:
+  struct Shard {
+    std::string Bitcode;
+    SmallString<128> Object; // path of its object file, if made
+    unsigned Build = 0;      // the last build that used it
+  };
+
+  std::map<const FunctionAST *, std::string> FunctionKeys;
+  unsigned Reused = 0, Generated = 0; // shards, in the current build
+
+  ShardMemo() = default;
+  ShardMemo(const ShardMemo &) = delete;
+  ~ShardMemo() {
+    for (auto &shard : Shards)
+      removeObject(shard.second);
+  }
+
+  void startBuild() {
+    Build++;
+    Reused = Generated = 0;
+  }
+
+  Shard *lookup(StringRef key) {
+    auto shard = Shards.find(hash(key));
+    if (shard == Shards.end())
+      return nullptr;
+    shard->second.Build = Build;
+    Reused++;
+    return &shard->second;
+  }
+
+  Shard *insert(StringRef key, std::string bitcode) {
+    Shard &shard = Shards[hash(key)];
+    removeObject(shard);
+    shard.Bitcode = std::move(bitcode);
+    shard.Build = Build;
+    Generated++;
+    return &shard;
+  }
+
+  // Split functions, whose keys are given, into shards. The unchanged
+  // functions of each shard of the last grouping stay together; the rest,
+  // new or edited, are taken in order, perShard at a time. So an edit
+  // regenerates the rest of the edited function's shard once, and after
+  // that the function is a shard of its own and only it is regenerated.
+  std::vector<std::vector<FunctionAST *>> group(ArrayRef<FunctionAST *> functions,
+                                                ArrayRef<std::string> keys, unsigned perShard) {
+    std::map<StringRef, FunctionAST *> byKey;
+    for (unsigned i = 0; i < functions.size(); i++)
+      byKey[keys[i]] = functions[i];
+    std::vector<std::vector<FunctionAST *>> groups;
+    std::vector<std::vector<std::string>> groupKeys;
+    for (auto &last : Groups) {
+      groups.emplace_back();
+      groupKeys.emplace_back();
+      for (auto &key : last) {
+        auto function = byKey.find(key);
+        if (function == byKey.end())
+          continue;
+        groups.back().push_back(function->second);
+        groupKeys.back().push_back(key);
+        byKey.erase(function);
+      }
+      if (groups.back().empty()) {
+        groups.pop_back();
+        groupKeys.pop_back();
+      }
+    }
+    for (unsigned i = 0, fresh = perShard; i < functions.size(); i++) {
+      if (!byKey.count(keys[i]))
+        continue;
+      if (fresh == perShard) {
+        groups.emplace_back();
+        groupKeys.emplace_back();
+        fresh = 0;
+      }
+      groups.back().push_back(functions[i]);
+      groupKeys.back().push_back(keys[i]);
+      fresh++;
+    }
+    Groups = std::move(groupKeys);
+    return groups;
+  }
+
+  // Drop the shards the current build didn't use
+  void prune() {
+    for (auto shard = Shards.begin(); shard != Shards.end();) {
+      if (shard->second.Build == Build) {
+        ++shard;
+        continue;
+      }
+      removeObject(shard->second);
+      shard = Shards.erase(shard);
+    }
+  }
+
+private:
+  std::map<std::string, Shard> Shards;
+  std::vector<std::vector<std::string>> Groups; // function keys, see group()
+  unsigned Build = 0;
+
+  static std::string hash(StringRef key) {
+    return toHex(SHA1::hash(arrayRefFromStringRef(key)), true);
+  }
+
+  static void removeObject(Shard &shard) {
+    if (shard.Object.empty())
+      return;
+    sys::fs::remove(shard.Object);
+    sys::DontRemoveFileOnSignal(shard.Object);
+    shard.Object.clear();
+  }
+};
+
+//===----------------------------------------------------------------------===//
+// Compiler Session
+//===----------------------------------------------------------------------===//
+
+/// CompilerOptions - settings taken from the command line.
+struct CompilerOptions {
+  enum OutputKind { EmitIR, EmitBitcode, EmitAssembly, EmitObject, EmitInterface };
+
+  OptimizationLevel OptLevel = OptimizationLevel::O0;
+  OutputKind Emit = EmitIR;
+  // empty means output.ll, .bc, .s or .o, or for an interface the input's
+  // name with .mci
+  std::string OutputFile;
+  unsigned NumThreads = 1;
+  // -jN was given. Without it NumThreads is the number of cores, but an
+  // object file is still built as one partition, so it is the same however
+  // many cores the compile ran on
+  bool SplitObject = false;
+  // -fast: shortest time to an object file. Values are left unnamed, no
+  // passes run, the backend uses FastISel and the fast register allocator,
+  // and builds without assertions skip the IR verifier.
+  bool FastCompile = false;
+  // -cache-dir: reuse the optimised IR of functions that haven't changed,
+  // and with --run the objects the JIT compiled for them
+  std::string CacheDir;
+  uint64_t CacheBytes = 512 << 20;
+  // -pipeline: lex, parse and generate code at the same time
+  bool Pipeline = false;
+  // -stream: free each function once it is compiled; needs -c
+  bool Stream = false;
+  // -lazy: with --run, generate and compile each function when it is first
+  // called, or with more than one of NumThreads, on a compile thread as soon
+  // as a function that calls it is compiled
+  bool Lazy = false;
+  // -tiered: with --run, interpret functions until they are hot
+  bool Tiered = false;
+  // -vm: with --run, compile to bytecode and run that, without LLVM
+  bool VM = false;
+  // -repeat: with --run, how many times to call the entry point
+  unsigned Repeat = 1;
+  // -perf: with --run, tell perf where JIT compiled functions are, and
+  // generate line tables for them
+  bool Perf = false;
+
+  bool verifyIR() const {
+#ifdef NDEBUG
+    return !FastCompile;
+#else
+    return true;
+#endif
+  }
+};
+
+// The backend optimisation level that goes with an -O level
+static CodeGenOptLevel codeGenOptLevel(OptimizationLevel level) {
+  switch (level.getSpeedupLevel()) {
+  case 0:
+    return CodeGenOptLevel::None;
+  case 1:
+    return CodeGenOptLevel::Less;
+  case 3:
+    return CodeGenOptLevel::Aggressive;
+  default:
+    return CodeGenOptLevel::Default;
+  }
+}
+
+// A TargetMachine for the host, so the optimiser's cost model knows the
+// vector width and the backend can emit native code
+static std::unique_ptr<TargetMachine> createHostTargetMachine(const CompilerOptions &options,
+                                                              std::string &error) {
+  std::string triple = sys::getDefaultTargetTriple();
+  const Target *target = TargetRegistry::lookupTarget(triple, error);
+  if (!target)
+    return nullptr;
+  std::unique_ptr<TargetMachine> machine(target->createTargetMachine(
+      triple, sys::getHostCPUName(), "", TargetOptions(), Reloc::PIC_,
+      std::nullopt, codeGenOptLevel(options.OptLevel)));
+  if (options.FastCompile)
+    machine->setFastISel(true);
+  return machine;
+}
+
+// Run the standard new pass manager pipeline for level over module
+static void optimizeModule(Module &module, TargetMachine &target,
+                           OptimizationLevel level) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB(&target);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(level);
+  MPM.run(module, MAM);
+}
+
+// Run the backend for module, writing an object or assembly file
+static bool emitModule(Module &module, TargetMachine &target, raw_pwrite_stream &dest,
+                       CodeGenFileType type, std::string &error) {
+  legacy::PassManager pass;
+  if (target.addPassesToEmitFile(pass, dest, nullptr, type)) {
+    error = "The target can't emit a file of this type\n";
+    return false;
+  }
+  pass.run(module);
+  dest.flush();
+  return true;
+}
+
+static bool emitModule(Module &module, TargetMachine &target, StringRef filename,
+                       CodeGenFileType type, std::string &error) {
+  std::error_code EC;
+  raw_fd_ostream dest(filename, EC,
+                      type == CodeGenFileType::AssemblyFile ? sys::fs::OF_Text
+                                                            : sys::fs::OF_None);
+  if (EC) {
+    error = "Could not open file: " + EC.message() + "\n";
+    return false;
+  }
+  return emitModule(module, target, dest, type, error);
+}
+
+/// TargetMachinePool - TargetMachines kept for reuse by later compiles in
+/// the same process, such as the requests a compile server handles. Each
+/// machine is used by one thread at a time.
+class TargetMachinePool {
+public:
+  std::unique_ptr<TargetMachine> acquire(const CompilerOptions &options, std::string &error) {
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      auto &free = Free[key(options)];
+      if (!free.empty()) {
+        std::unique_ptr<TargetMachine> machine = std::move(free.back());
+        free.pop_back();
+        return machine;
+      }
+    }
+    return createHostTargetMachine(options, error);
+  }
+
+  void release(const CompilerOptions &options, std::unique_ptr<TargetMachine> machine) {
+    if (!machine)
+      return;
+    std::lock_guard<std::mutex> lock(Lock);
+    Free[key(options)].push_back(std::move(machine));
+  }
+
+private:
+  std::mutex Lock;
+  std::map<std::string, std::vector<std::unique_ptr<TargetMachine>>> Free;
+
+  // the options createHostTargetMachine() looks at
+  static std::string key(const CompilerOptions &options) {
+    return std::to_string(options.OptLevel.getSpeedupLevel()) +
+           (options.FastCompile ? " fast" : "");
+  }
+};
+
+/// CompilerSession - the lexer, parser, diagnostics and LLVM state for
+/// compiling one source file. Sessions share no mutable state, so separate
+/// sessions can be used on separate threads at the same time.
+class CompilerSession {
+public:
+  std::unique_ptr<MemoryBuffer> Source;
+  raw_ostream &Out;   // AST dump and progress messages
+  raw_ostream &Diags; // syntax and semantic errors
+  CompilerOptions Options;
+
+  Lexer TheLexer;
+  Parser TheParser;
+  std::unique_ptr<rootASTnode> Root;
+
+  // owned by the session unless a library caller takes it with the module
+  std::unique_ptr<LLVMContext> ContextOwner = std::make_unique<LLVMContext>();
+  LLVMContext &TheContext = *ContextOwner;
+  IRBuilder<> Builder;
+  std::unique_ptr<Module> TheModule;
+  std::unique_ptr<TargetMachine> TheTarget;
+  std::unique_ptr<DiskCache> Cache; // set by codegen() when there is a cache
+  TargetMachinePool *Machines;      // where TargetMachines come from, if set
+  ShardMemo *Memo = nullptr;        // shards of earlier builds, for --watch
+  std::vector<ShardMemo::Shard *> MemoShards; // this build's, if not linked
+
+  CompilerSession(std::unique_ptr<MemoryBuffer> source, raw_ostream &out,
+                  raw_ostream &diags, const CompilerOptions &options = {},
+                  TargetMachinePool *machines = nullptr)
+      : Source(std::move(source)), Out(out), Diags(diags), Options(options),
+        TheLexer(Source->getBuffer()), TheParser(TheLexer, Diags),
+        Builder(TheContext), Machines(machines) {
+    TheContext.setDiscardValueNames(Options.FastCompile);
+    // #include paths are relative to the directory of the file compiled
+    TheParser.IncludeDir = std::string(path::parent_path(Source->getBufferIdentifier()));
+    // Make the module, which holds all the code.
+    TheModule = std::make_unique<Module>("mini-c", TheContext);
+  }
+
+  ~CompilerSession() { releaseTargetMachine(std::move(TheTarget)); }
+
+  bool parse() {
+    if (Options.Pipeline)
+      return parsePipelined();
+    Root = TheParser.parse(Out);
+    return Root != nullptr;
+  }
+
+  /// PipelineStats - how long each stage of a pipelined parse ran for, and
+  /// how much of that it spent waiting on the stage before or after it.
+  struct PipelineStats {
+    TokenRing::Clock::duration LexerTime{}, LexerStalled{};
+    TokenRing::Clock::duration ParserTime{}, ParserStalled{};
+    TokenRing::Clock::duration WorkerTime{}, WorkerStalled{};
+    TokenRing::Clock::duration Drain{}; // parser waiting for the worker to finish
+    unsigned ShardsGenerated = 0, ShardsUsed = 0;
+  } Stats;
+
+  // -pipeline: the lexer runs on a thread of its own and feeds the parser
+  // through a TokenRing, and the parser passes each top level declaration
+  // it finishes to a code generation thread. That thread declares what it
+  // is given, and once a shard's worth of functions has arrived it checks
+  // them against the declarations seen so far. A shard that checks cleanly
+  // uses nothing declared further down the file, so it is generated and
+  // optimised there and then, exactly as codegen() would have done, and
+  // codegen() picks up the result. Anything else is left to the usual
+  // stages, so the output is the same with or without -pipeline.
+  bool parsePipelined() {
+    using Clock = TokenRing::Clock;
+    Clock::time_point start = Clock::now();
+    bool speculate = Options.CacheDir.empty() && createTargetMachine();
+
+    TokenRing tokens;
+    std::thread lexer([&] {
+      for (;;) {
+        TOKEN tok = TheLexer.gettok();
+        bool end = tok.type == EOF_TOK;
+        if (!tokens.push(std::move(tok)) || end)
+          break;
+      }
+      Stats.LexerTime = Clock::now() - start;
+    });
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<ASTnode *> nodes;
+    bool done = false;
+    std::thread worker([&] {
+      GlobalScope globals;
+      DiagnosticList diags;
+      ModuleDeclarations decls;
+      for (;;) {
+        ASTnode *node;
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          if (nodes.empty()) {
+            Clock::time_point wait = Clock::now();
+            ready.wait(guard, [&] { return done || !nodes.empty(); });
+            Stats.WorkerStalled += Clock::now() - wait;
+          }
+          if (nodes.empty())
+            break;
+          node = nodes.front();
+          nodes.pop_front();
+        }
+        // after a bad declaration analyse() will fail, so stop speculating
+        if (!speculate || !diags.empty())
+          continue;
+        node->declare(globals, diags);
+        collectDeclaration(*node, decls);
+        // a shard is complete once the first function of the next arrives
+        unsigned count = decls.Functions.size();
+        if (node->getFunction() && count > FunctionsPerShard && count % FunctionsPerShard == 1)
+          speculateShard(count / FunctionsPerShard - 1, globals, decls);
+      }
+      Stats.WorkerTime = Clock::now() - start;
+    });
+
+    TheParser.Tokens = &tokens;
+    TheParser.OnTopLevel = [&](std::unique_ptr<ASTnode> &node) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (node)
+          nodes.push_back(node.get());
+        else
+          done = true;
+      }
+      ready.notify_one();
+      if (node)
+        return;
+      // the tree may be freed once parse() returns, so wait for the worker
+      Clock::time_point end = Clock::now();
+      Stats.ParserTime = end - start;
+      tokens.close();
+      lexer.join();
+      worker.join();
+      Stats.Drain = Clock::now() - end;
+    };
+    Root = TheParser.parse(Out);
+    TheParser.Tokens = nullptr;
+    TheParser.OnTopLevel = nullptr;
+    Stats.LexerStalled = tokens.ProducerStalled;
+    Stats.ParserStalled = tokens.ConsumerStalled;
+    Stats.ShardsGenerated = SpeculativeShards.size();
+    return Root != nullptr;
+  }
+
+  void printPipelineStats(raw_ostream &os) const {
+    auto ms = [](TokenRing::Clock::duration time) {
+      return format("%10.1f", std::chrono::duration<double, std::milli>(time).count());
+    };
+    os << "Pipeline    busy ms  stalled ms\n"
+       << "  lexer  " << ms(Stats.LexerTime - Stats.LexerStalled) << ms(Stats.LexerStalled)
+       << "  (token ring full)\n"
+       << "  parser " << ms(Stats.ParserTime - Stats.ParserStalled) << ms(Stats.ParserStalled)
+       << "  (token ring empty)\n"
+       << "  codegen" << ms(Stats.WorkerTime - Stats.WorkerStalled) << ms(Stats.WorkerStalled)
+       << "  (no declarations to take)\n"
+       << "  parser waited" << ms(Stats.Drain) << " ms for codegen to finish; "
+       << Stats.ShardsUsed << " of " << Stats.ShardsGenerated
+       << " shards generated early were used\n";
+  }
+
+  bool analyse() {
+    DiagnosticList diags;
+    if (Root->analyse(diags, Options.NumThreads))
+      return true;
+    reportSemanticErrors(diags);
+    return false;
+  }
+
+  void reportSemanticErrors(const DiagnosticList &diags) {
+    for (const auto &diag : diags)
+      Diags << "Semantic error: " << diag.message << " at line " << diag.lineNo
+            << " column " << diag.columnNo << ".\n";
+    Out << "Semantic Analysis Failed\n";
+  }
+
+  // Functions are generated and optimised in shards of FunctionsPerShard,
+  // each in a context of its own so that shards can be built in parallel.
+  // Each shard comes back as bitcode and is linked, in source order, into
+  // TheModule, which already declares everything in source order. The
+  // shards do not depend on the number of threads, so neither does the
+  // output. With a cache, every function is a shard of its own.
+  static const unsigned FunctionsPerShard = 64;
+
+  bool codegen() {
+    if (!createTargetMachine())
+      return false;
+
+    ModuleDeclarations decls;
+    Root->collectDeclarations(decls);
+    ArrayRef<FunctionAST *> functions = decls.Functions;
+    CodeGenerator gen(TheContext, Builder, *TheModule, decls, Diags);
+    gen.Verify = Options.verifyIR();
+    // when objects are made from memo shards TheModule only needs the globals
+    bool shardObjects = Memo && Options.CacheDir.empty() &&
+                        Options.Emit == CompilerOptions::EmitObject &&
+                        functions.size() > FunctionsPerShard;
+    if (shardObjects) {
+      for (auto &node : Root->getNodes())
+        if (node->getVariable())
+          node->codegen(gen);
+    } else {
+      Root->codegen(gen);
+    }
+
+    // a single shard is generated in place, skipping the bitcode round trip
+    if (functions.size() <= FunctionsPerShard && Options.CacheDir.empty()) {
+      if (Options.Perf)
+        gen.startDebugInfo(Source->getBufferIdentifier());
+      for (FunctionAST *function : functions)
+        function->codegen(gen);
+      gen.finishDebugInfo();
+      if (gen.HadError)
+        return false;
+      if (Options.OptLevel != OptimizationLevel::O0)
+        optimizeModule(*TheModule, *TheTarget, Options.OptLevel);
+      return !Options.verifyIR() || !verifyModule(*TheModule, &Diags);
+    }
+
+    std::vector<ShardResult> shards;
+    std::vector<std::vector<FunctionAST *>> groups; // the shards, if shardObjects
+    std::vector<unsigned> pending; // the shards still to be generated
+    std::function<void(unsigned)> generate;
+    if (!Options.CacheDir.empty()) {
+      Cache = std::make_unique<DiskCache>(Options.CacheDir, Options.CacheBytes);
+      if (!Cache->create(Diags))
+        return false;
+      shards.resize(functions.size());
+      generate = [&](unsigned i) { generateCached(functions[i], decls, shards[i]); };
+    } else if (shardObjects) {
+      std::vector<std::string> keys;
+      for (FunctionAST *function : functions)
+        keys.push_back(functionKey(function, decls));
+      groups = Memo->group(functions, keys, FunctionsPerShard);
+      shards.resize(groups.size());
+      generate = [&](unsigned i) { generateShard(groups[i], {}, decls, shards[i]); };
+    } else {
+      shards.resize((functions.size() + FunctionsPerShard - 1) / FunctionsPerShard);
+      for (auto &shard : SpeculativeShards) {
+        shards[shard.first] = std::move(shard.second);
+        Stats.ShardsUsed++;
+      }
+      SpeculativeShards.clear();
+      generate = [&](unsigned i) {
+        generateShard(shardFunctions(functions, i), {}, decls, shards[i]);
+      };
+    }
+    std::vector<std::string> memoKeys;
+    if (Memo && !Cache) {
+      for (unsigned i = 0; i < shards.size(); i++) {
+        memoKeys.push_back(memoKey(shardObjects ? ArrayRef<FunctionAST *>(groups[i])
+                                                : shardFunctions(functions, i),
+                                   decls));
+        MemoShards.push_back(Memo->lookup(memoKeys.back()));
+        if (MemoShards.back())
+          shards[i].Bitcode = MemoShards.back()->Bitcode;
+      }
+    }
+    for (unsigned i = 0; i < shards.size(); i++)
+      if (shards[i].Bitcode.empty())
+        pending.push_back(i);
+    unsigned numThreads = std::min<unsigned>(Options.NumThreads, pending.size());
+    if (numThreads <= 1) {
+      for (unsigned i : pending)
+        generate(i);
+    } else {
+      ThreadPool pool(hardware_concurrency(numThreads));
+      for (unsigned i : pending)
+        pool.async(generate, i);
+      pool.wait();
+    }
+    if (Cache)
+      Cache->prune();
+
+    bool ok = !gen.HadError;
+    for (auto &shard : shards) {
+      Diags << shard.Diags;
+      ok &= !shard.HadError;
+    }
+    if (!memoKeys.empty()) {
+      for (unsigned i = 0; i < shards.size(); i++)
+        if (!MemoShards[i] && !shards[i].HadError)
+          MemoShards[i] = Memo->insert(memoKeys[i], shards[i].Bitcode);
+      // objects are made from the shards themselves; see emitFile()
+      if (shardObjects)
+        return ok && (!Options.verifyIR() || !verifyModule(*TheModule, &Diags));
+      MemoShards.clear();
+    }
+
+    Linker linker(*TheModule);
+    for (auto &shard : shards) {
+      if (shard.HadError)
+        continue;
+      auto module = parseBitcodeFile(MemoryBufferRef(shard.Bitcode, "shard"), TheContext);
+      if (!module) {
+        Diags << "Code generation error: " << toString(module.takeError()) << "\n";
+        ok = false;
+      } else if (linker.linkInModule(std::move(*module))) {
+        ok = false;
+      }
+    }
+    return ok && (!Options.verifyIR() || !verifyModule(*TheModule, &Diags));
+  }
+
+  bool createTargetMachine() {
+    if (TheTarget)
+      return true;
+    std::string error;
+    TheTarget = acquireTargetMachine(error);
+    if (!TheTarget) {
+      Diags << error << "\n";
+      return false;
+    }
+    TheModule->setTargetTriple(TheTarget->getTargetTriple().str());
+    TheModule->setDataLayout(TheTarget->createDataLayout());
+    return true;
+  }
+
+  // For the lazy JIT: TheModule gets the globals and declares the functions,
+  // and each function is generated by buildFunction() when it is first
+  // called. decls must outlive the generated code.
+  bool codegenDeclarations(ModuleDeclarations &decls) {
+    if (!createTargetMachine())
+      return false;
+    Root->collectDeclarations(decls);
+    CodeGenerator gen(TheContext, Builder, *TheModule, decls, Diags);
+    Root->codegen(gen);
+    return !gen.HadError;
+  }
+
+  // Generate and optimise function into module, which is empty and has a
+  // context of its own. Safe to call from any thread.
+  bool buildFunction(FunctionAST *function, const ModuleDeclarations &decls, Module &module,
+                     raw_ostream &diags) const {
+    return buildShard(function, {}, decls, module, diags);
+  }
+
+  // Generate and optimise the continuation of function from loop, for
+  // -tiered; see CodeGenerator::enterLoop()
+  bool buildContinuation(FunctionAST *function, const ASTnode *loop,
+                         const ModuleDeclarations &decls, Module &module,
+                         raw_ostream &diags) const {
+    return buildShard(function, {}, decls, module, diags, loop);
+  }
+
+  // The object file for the module, built on this thread into memory
+  std::unique_ptr<MemoryBuffer> emitObject() {
+    if (!createTargetMachine())
+      return nullptr;
+    SmallVector<char, 0> object;
+    raw_svector_ostream os(object);
+    std::string error;
+    if (!emitModule(*TheModule, *TheTarget, os, CodeGenFileType::ObjectFile, error)) {
+      Diags << error;
+      return nullptr;
+    }
+    return std::make_unique<SmallVectorMemoryBuffer>(std::move(object));
+  }
+
+  // Write the module as native assembly or an object file for the host.
+  // With -jN for more than one thread, objects are built by the parallel
+  // backend.
+  bool emitFile(StringRef filename, CodeGenFileType type) {
+    if (!createTargetMachine())
+      return false;
+    if (!MemoShards.empty())
+      return emitObjectFromShards(filename);
+
+    unsigned defined = 0;
+    for (Function &function : *TheModule)
+      defined += !function.isDeclaration();
+    unsigned numParts = Options.SplitObject ? std::min(Options.NumThreads, defined) : 1;
+    if (type == CodeGenFileType::ObjectFile && numParts > 1)
+      return emitObjectParallel(filename, numParts);
+
+    std::string error;
+    if (!emitModule(*TheModule, *TheTarget, filename, type, error)) {
+      Diags << error;
+      return false;
+    }
+    return true;
+  }
+
+  // Split the module into numParts partitions and run instruction
+  // selection, register allocation and object emission for each on its own
+  // thread and TargetMachine, then combine the objects with ld -r.
+  // Partitions are passed to the threads as bitcode, since a context can't
+  // be shared between threads.
+  bool emitObjectParallel(StringRef filename, unsigned numParts) {
+    std::vector<SmallString<0>> parts;
+    SplitModule(*TheModule, numParts, [&](std::unique_ptr<Module> part) {
+      parts.emplace_back();
+      raw_svector_ostream os(parts.back());
+      WriteBitcodeToFile(*part, os);
+    });
+
+    std::vector<SmallString<128>> objects(parts.size());
+    for (auto &object : objects)
+      if (!createTemporaryObject(object))
+        return false;
+
+    std::vector<std::string> errors(parts.size());
+    {
+      ThreadPool pool(hardware_concurrency(parts.size()));
+      for (unsigned i = 0; i < parts.size(); i++)
+        pool.async([&, i] {
+          LLVMContext context;
+          auto part = parseBitcodeFile(MemoryBufferRef(parts[i], "part"), context);
+          if (!part) {
+            errors[i] = toString(part.takeError()) + "\n";
+            return;
+          }
+          std::unique_ptr<TargetMachine> target = acquireTargetMachine(errors[i]);
+          if (target)
+            emitModule(**part, *target, objects[i], CodeGenFileType::ObjectFile, errors[i]);
+          releaseTargetMachine(std::move(target));
+        });
+      pool.wait();
+    }
+
+    bool ok = true;
+    for (auto &error : errors) {
+      Diags << error;
+      ok &= error.empty();
+    }
+    return combineObjects(objects, filename, ok);
+  }
+
+  // -stream: compile a file without ever holding all of it in memory. The
+  // parser hands each function over as soon as it is parsed, and it is
+  // checked against the declarations seen so far. Functions that check
+  // cleanly are generated, optimised and emitted to a temporary object file
+  // a shard at a time, after which their bodies and IR are freed. Only
+  // prototypes, externs and globals stay resident. A function that uses
+  // something declared further down the file has to wait for the end of
+  // the file to be checked, so it is kept until then. Finally the globals
+  // are emitted and the objects combined with ld -r. The diagnostics are
+  // the same as for a normal compile; the code differs only in that
+  // functions in different shards can't be inlined into each other.
+  bool stream(StringRef filename) {
+    if (!createTargetMachine())
+      return false;
+
+    GlobalScope globals;
+    DiagnosticList diags;
+    ModuleDeclarations decls;
+    std::vector<std::unique_ptr<FunctionAST>> shard, deferred;
+    std::vector<std::unique_ptr<PrototypeAST>> prototypes; // of emitted functions
+    std::vector<SmallString<128>> objects;
+    bool ok = true;
+
+    auto flush = [&](ArrayRef<std::unique_ptr<FunctionAST>> functions) {
+      if (ok && diags.empty()) {
+        std::vector<FunctionAST *> pointers;
+        for (auto &function : functions)
+          pointers.push_back(function.get());
+        LLVMContext context;
+        Module module("mini-c", context);
+        objects.emplace_back();
+        std::string error;
+        ok = createTemporaryObject(objects.back()) &&
+             buildShard(pointers, {}, decls, module, Diags) &&
+             emitModule(module, *TheTarget, objects.back(), CodeGenFileType::ObjectFile, error);
+        Diags << error;
+      }
+      for (auto &function : functions)
+        prototypes.push_back(function->takeProto());
+    };
+
+    TheParser.PrintTree = false;
+    TheParser.OnTopLevel = [&](std::unique_ptr<ASTnode> &node) {
+      if (!node)
+        return;
+      node->declare(globals, diags);
+      if (!node->getFunction()) {
+        collectDeclaration(*node, decls);
+        return;
+      }
+      std::unique_ptr<FunctionAST> function(node.release()->getFunction());
+      decls.Prototypes[function->getProto().getName()] = &function->getProto();
+      DiagnosticList bodyDiags;
+      function->checkBody(globals, bodyDiags);
+      if (!bodyDiags.empty()) {
+        deferred.push_back(std::move(function));
+        return;
+      }
+      shard.push_back(std::move(function));
+      if (shard.size() == FunctionsPerShard) {
+        flush(shard);
+        shard.clear();
+      }
+    };
+    Root = TheParser.parse(Out);
+    TheParser.OnTopLevel = nullptr;
+    Diags << "Parsing Finished\n";
+    if (!Root)
+      return combineObjects(objects, filename, false);
+
+    for (auto &function : deferred)
+      function->checkBody(globals, diags);
+    if (!diags.empty()) {
+      sortDiagnostics(diags);
+      reportSemanticErrors(diags);
+      return combineObjects(objects, filename, false);
+    }
+    Diags << "Semantic Analysis Finished\n";
+
+    flush(shard);
+    for (size_t first = 0; first < deferred.size(); first += FunctionsPerShard)
+      flush(ArrayRef<std::unique_ptr<FunctionAST>>(deferred).slice(
+          first, std::min<size_t>(FunctionsPerShard, deferred.size() - first)));
+    shard.clear();
+    deferred.clear();
+
+    // externs and globals, which never left the tree
+    CodeGenerator gen(TheContext, Builder, *TheModule, decls, Diags);
+    gen.Verify = Options.verifyIR();
+    Root->codegen(gen);
+    objects.emplace_back();
+    std::string error;
+    ok = ok && !gen.HadError && createTemporaryObject(objects.back()) &&
+         emitModule(*TheModule, *TheTarget, objects.back(), CodeGenFileType::ObjectFile, error);
+    Diags << error;
+    if (ok)
+      Diags << "Code Generation Finished\n";
+    return combineObjects(objects, filename, ok);
+  }
+
+  // --watch: each shard's object file is kept from one build to the next,
+  // so only new shards go through the backend. TheModule, holding the
+  // globals, is emitted on its own and ld -r combines the lot.
+  bool emitObjectFromShards(StringRef filename) {
+    std::vector<ShardMemo::Shard *> missing;
+    for (ShardMemo::Shard *shard : MemoShards)
+      if (shard->Object.empty())
+        missing.push_back(shard);
+    std::vector<std::string> errors(missing.size());
+    auto emit = [&](unsigned i) {
+      LLVMContext context;
+      auto module = parseBitcodeFile(MemoryBufferRef(missing[i]->Bitcode, "shard"), context);
+      if (!module) {
+        errors[i] = toString(module.takeError()) + "\n";
+        return;
+      }
+      SmallString<128> object;
+      if (std::error_code EC = sys::fs::createTemporaryFile("mccomp", "o", object)) {
+        errors[i] = "Could not create temporary file: " + EC.message() + "\n";
+        return;
+      }
+      sys::RemoveFileOnSignal(object);
+      std::unique_ptr<TargetMachine> target = acquireTargetMachine(errors[i]);
+      if (target && emitModule(**module, *target, object, CodeGenFileType::ObjectFile, errors[i]))
+        missing[i]->Object = object;
+      else
+        sys::fs::remove(object);
+      releaseTargetMachine(std::move(target));
+    };
+    unsigned numThreads = std::min<unsigned>(Options.NumThreads, missing.size());
+    if (numThreads <= 1) {
+      for (unsigned i = 0; i < missing.size(); i++)
+        emit(i);
+    } else {
+      ThreadPool pool(hardware_concurrency(numThreads));
+      for (unsigned i = 0; i < missing.size(); i++)
+        pool.async(emit, i);
+      pool.wait();
+    }
+    bool ok = true;
+    for (auto &error : errors) {
+      Diags << error;
+      ok &= error.empty();
+    }
+
+    SmallString<128> globals;
+    std::string error;
+    if (ok && createTemporaryObject(globals) &&
+        emitModule(*TheModule, *TheTarget, globals, CodeGenFileType::ObjectFile, error)) {
+      std::vector<StringRef> objects = {globals};
+      for (ShardMemo::Shard *shard : MemoShards)
+        objects.push_back(shard->Object);
+      ok = linkObjects(objects, filename);
+    } else {
+      Diags << error;
+      ok = false;
+    }
+    if (!globals.empty())
+      sys::fs::remove(globals);
+    return ok;
+  }
+
+  // Bitcode keeps an index of function bodies, so readers can load the
+  // module lazily and only materialise the functions they use
+  bool writeBitcode(StringRef filename) {
+    std::error_code EC;
+    raw_fd_ostream dest(filename, EC, sys::fs::OF_None);
+
+    if (EC) {
+      Diags << "Could not open file: " << EC.message();
+      return false;
+    }
+    WriteBitcodeToFile(*TheModule, dest);
+    return true;
+  }
+
+  // The module interface, for files that import this one. Only the checked
+  // AST is needed, so this is written instead of generating code.
+  bool writeInterface(StringRef filename) {
+    std::error_code EC;
+    raw_fd_ostream dest(filename, EC, sys::fs::OF_None);
+
+    if (EC) {
+      Diags << "Could not open file: " << EC.message();
+      return false;
+    }
+    detail::writeInterface(Root->getNodes(), dest);
+    return true;
+  }
+
+  bool writeIR(StringRef filename) {
+    std::error_code EC;
+    raw_fd_ostream dest(filename, EC, sys::fs::OF_None);
+
+    if (EC) {
+      Diags << "Could not open file: " << EC.message();
+      return false;
+    }
+    // TheModule->print(errs(), nullptr); // print IR to terminal
+    TheModule->print(dest, nullptr);
+    return true;
+  }
+
+private:
+  std::unique_ptr<TargetMachine> acquireTargetMachine(std::string &error) const {
+    if (Machines)
+      return Machines->acquire(Options, error);
+    return createHostTargetMachine(Options, error);
+  }
+
+  void releaseTargetMachine(std::unique_ptr<TargetMachine> machine) const {
+    if (Machines)
+      Machines->release(Options, std::move(machine));
+  }
+
+  struct ShardResult {
+    std::string Bitcode;
+    std::string Diags;
+    bool HadError = false;
+  };
+
+  // shards generated by a pipelined parse, by index; see parsePipelined()
+  std::map<unsigned, ShardResult> SpeculativeShards;
+
+  // Runs on the pipeline's worker thread, once the functions of shard have
+  // all been parsed
+  void speculateShard(unsigned shard, const GlobalScope &globals,
+                      const ModuleDeclarations &decls) {
+    ArrayRef<FunctionAST *> functions =
+        ArrayRef<FunctionAST *>(decls.Functions).slice(shard * FunctionsPerShard, FunctionsPerShard);
+    for (FunctionAST *function : functions) {
+      DiagnosticList diags;
+      function->checkBody(globals, diags);
+      if (!diags.empty())
+        return;
+    }
+    ShardResult result;
+    generateShard(functions, {}, decls, result);
+    if (!result.HadError)
+      SpeculativeShards[shard] = std::move(result);
+  }
+
+  // Runs on a worker thread: touches nothing but its own context and result
+  // (and the cache, which is thread safe)
+  // Cache key for a function: its fingerprint and those of the functions
+  // it may inline, the declarations they use, and everything that changes
+  // the code generated for them. The version goes up whenever the code
+  // generator or the fingerprint format changes, so that entries made by
+  // an older mccomp are never used.
+  std::string cacheKey(FunctionAST *function, ArrayRef<FunctionAST *> imports,
+                       const ModuleDeclarations &decls) const {
+    Fingerprint fp;
+    fp.Text = "mccomp function v2 LLVM " LLVM_VERSION_STRING " ";
+    fp.Text += TheTarget->getTargetTriple().str() + " " + TheTarget->getTargetCPU().str();
+    fp.Text += " O" + std::to_string(Options.OptLevel.getSpeedupLevel()) + "s" +
+               std::to_string(Options.OptLevel.getSizeLevel()) +
+               (Options.FastCompile ? " fast" : "");
+    if (Options.Perf) {
+      fp.Text += " lines " + Source->getBufferIdentifier().str();
+      fp.Lines = true;
+    }
+    function->fingerprint(fp);
+    for (FunctionAST *import : imports)
+      import->fingerprint(fp);
+    for (const std::string &name : fp.References) {
+      auto proto = decls.Prototypes.find(name);
+      if (proto != decls.Prototypes.end())
+        proto->second->fingerprint(fp);
+      auto global = decls.Globals.find(name);
+      if (global != decls.Globals.end())
+        fp.Text += " (global " + global->second->getType() + " " + name + ")";
+    }
+    return fp.Text;
+  }
+
+  static ArrayRef<FunctionAST *> shardFunctions(ArrayRef<FunctionAST *> functions,
+                                                unsigned shard) {
+    unsigned first = shard * FunctionsPerShard;
+    return functions.slice(first, std::min<size_t>(FunctionsPerShard, functions.size() - first));
+  }
+
+  // The hash of a function's cache key, remembered for the next build
+  const std::string &functionKey(FunctionAST *function, const ModuleDeclarations &decls) {
+    std::string &key = Memo->FunctionKeys[function];
+    if (key.empty()) {
+      auto hash = SHA1::hash(arrayRefFromStringRef(cacheKey(function, {}, decls)));
+      key.assign(hash.begin(), hash.end());
+    }
+    return key;
+  }
+
+  // A shard's key in the memo: the hashes of its functions' cache keys
+  std::string memoKey(ArrayRef<FunctionAST *> functions, const ModuleDeclarations &decls) {
+    std::string key;
+    for (FunctionAST *function : functions)
+      key += functionKey(function, decls);
+    return key;
+  }
+
+  // Runs on a worker thread. When optimising, the functions this one calls
+  // are generated alongside it as available_externally so that they can be
+  // inlined; the optimiser drops their bodies afterwards.
+  void generateCached(FunctionAST *function, const ModuleDeclarations &decls,
+                      ShardResult &result) const {
+    std::vector<FunctionAST *> imports;
+    if (Options.OptLevel != OptimizationLevel::O0) {
+      Fingerprint calls;
+      function->fingerprint(calls);
+      for (const std::string &name : calls.References) {
+        auto callee = decls.Definitions.find(name);
+        if (callee != decls.Definitions.end() && callee->second != function)
+          imports.push_back(callee->second);
+      }
+    }
+
+    std::string key = cacheKey(function, imports, decls);
+    if (std::unique_ptr<MemoryBuffer> hit = Cache->lookup(key)) {
+      result.Bitcode = hit->getBuffer().str();
+      return;
+    }
+    generateShard(function, imports, decls, result);
+    if (!result.HadError)
+      Cache->store(key, result.Bitcode);
+  }
+
+  void generateShard(ArrayRef<FunctionAST *> functions, ArrayRef<FunctionAST *> imports,
+                     const ModuleDeclarations &decls, ShardResult &result) const {
+    LLVMContext context;
+    Module module("mini-c", context);
+    raw_string_ostream diags(result.Diags);
+    result.HadError = !buildShard(functions, imports, decls, module, diags);
+    if (result.HadError)
+      return;
+    raw_string_ostream bitcode(result.Bitcode);
+    WriteBitcodeToFile(module, bitcode);
+  }
+
+  // Generate and optimise functions, and imports as available_externally,
+  // into module, which is empty and has a context of its own. With
+  // entryLoop, functions are generated as continuations from it.
+  bool buildShard(ArrayRef<FunctionAST *> functions, ArrayRef<FunctionAST *> imports,
+                  const ModuleDeclarations &decls, Module &module, raw_ostream &diags,
+                  const ASTnode *entryLoop = nullptr) const {
+    LLVMContext &context = module.getContext();
+    IRBuilder<> builder(context);
+    module.setTargetTriple(TheTarget->getTargetTriple().str());
+    module.setDataLayout(TheTarget->createDataLayout());
+
+    context.setDiscardValueNames(Options.FastCompile);
+    CodeGenerator gen(context, builder, module, decls, diags);
+    gen.Verify = Options.verifyIR();
+    gen.EntryLoop = entryLoop;
+    if (Options.Perf)
+      gen.startDebugInfo(Source->getBufferIdentifier());
+    for (FunctionAST *function : functions)
+      function->codegen(gen);
+    gen.EntryLoop = nullptr;
+    for (FunctionAST *import : imports)
+      static_cast<Function *>(import->codegen(gen))
+          ->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    gen.finishDebugInfo();
+    if (gen.HadError)
+      return false;
+
+    if (Options.OptLevel != OptimizationLevel::O0) {
+      std::string error;
+      std::unique_ptr<TargetMachine> target = acquireTargetMachine(error);
+      if (!target) {
+        diags << error << "\n";
+        return false;
+      }
+      optimizeModule(module, *target, Options.OptLevel);
+      releaseTargetMachine(std::move(target));
+    }
+    return true;
+  }
+
+  bool createTemporaryObject(SmallString<128> &object) {
+    if (std::error_code EC = sys::fs::createTemporaryFile("mccomp", "o", object)) {
+      Diags << "Could not create temporary file: " << EC.message() << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // Combine objects into one relocatable object with ld -r
+  bool linkObjects(ArrayRef<StringRef> objects, StringRef filename) {
+    auto ld = sys::findProgramByName("ld");
+    if (!ld) {
+      Diags << "Could not find ld to combine the object files\n";
+      return false;
+    }
+    std::vector<StringRef> args = {*ld, "-r", "-o", filename};
+    args.insert(args.end(), objects.begin(), objects.end());
+    std::string error;
+    if (sys::ExecuteAndWait(*ld, args, std::nullopt, {}, 0, 0, &error) != 0) {
+      Diags << "Could not combine the object files: " << error << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // Combine temporary objects with linkObjects(), if ok, and remove them
+  bool combineObjects(ArrayRef<SmallString<128>> objects, StringRef filename, bool ok) {
+    if (ok) {
+      std::vector<StringRef> paths(objects.begin(), objects.end());
+      ok = linkObjects(paths, filename);
+    }
+    for (auto &object : objects)
+      sys::fs::remove(object);
+    return ok;
+  }
+};
+
+//===----------------------------------------------------------------------===//
+// AST Printer
+//===----------------------------------------------------------------------===//
+
+inline llvm::raw_ostream &operator<<(llvm::raw_ostream &os,
+                                     const ASTnode &ast) {
+  int indentDepth = 0;
+  os << ast.to_string(indentDepth);
+  return os;
+}
+
+//===----------------------------------------------------------------------===//
+// Library API
+//===----------------------------------------------------------------------===//
+
+// The functions declared in mccomp.h. Each compile is a CompilerSession over
+// the caller's string, with the AST dump discarded and the errors captured
+// and split into Diagnostics. Objects are emitted into memory by one backend
+// thread, so ld is never run, and nothing is written to disk unless there
+// is a cache directory.
+
+static void initializeLibrary() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  });
+}
+
+// Errors are written as lines of the form
+// "<Stage> error: <message> at line <L> column <C>."
+static void addDiagnostics(StringRef text, std::vector<mccomp::Diagnostic> &diags) {
+  SmallVector<StringRef, 8> lines;
+  text.split(lines, '\n', -1, /*KeepEmpty=*/false);
+  for (StringRef line : lines) {
+    mccomp::Diagnostic diag;
+    if (line.consume_front("Syntax error: "))
+      diag.Kind = mccomp::Diagnostic::Syntax;
+    else if (line.consume_front("Semantic error: "))
+      diag.Kind = mccomp::Diagnostic::Semantic;
+    else if (line.consume_front("Code generation error: "))
+      diag.Kind = mccomp::Diagnostic::CodeGeneration;
+    size_t at = line.rfind(" at line ");
+    StringRef place = line.substr(at == StringRef::npos ? line.size() : at + 9);
+    StringRef lineNo, columnNo;
+    std::tie(lineNo, columnNo) = place.rtrim('.').split(" column ");
+    if (at != StringRef::npos && !lineNo.getAsInteger(10, diag.Line) &&
+        !columnNo.getAsInteger(10, diag.Column))
+      line = line.take_front(at);
+    else
+      diag.Line = diag.Column = 0;
+    diag.Message = std::string(line);
+    diags.push_back(std::move(diag));
+  }
+}
+
+/// LibraryCompile - one compile from memory, as far as the optimised module
+struct LibraryCompile {
+  std::string Errors;
+  raw_string_ostream ErrorStream{Errors};
+  CompilerSession Session;
+
+  LibraryCompile(StringRef source, const mccomp::Options &options)
+      : Session(MemoryBuffer::getMemBuffer(source, "<memory>", false), nulls(), ErrorStream,
+                sessionOptions(options)) {
+    Session.TheParser.PrintTree = false;
+  }
+
+  static CompilerOptions sessionOptions(const mccomp::Options &options) {
+    static const OptimizationLevel levels[] = {OptimizationLevel::O0, OptimizationLevel::O1,
+                                               OptimizationLevel::O2, OptimizationLevel::O3};
+    CompilerOptions result;
+    result.OptLevel = levels[std::min(options.OptLevel, 3u)];
+    result.FastCompile = options.FastCompile;
+    result.NumThreads = std::max(options.NumThreads, 1u);
+    result.CacheDir = options.CacheDir;
+    result.CacheBytes = uint64_t(options.CacheSize) << 20;
+    result.Perf = options.Perf;
+    if (result.FastCompile)
+      result.OptLevel = OptimizationLevel::O0;
+    return result;
+  }
+
+  bool run() {
+    initializeLibrary();
+    return Session.parse() && Session.analyse() && Session.codegen();
+  }
+
+  // add the errors so far to diags
+  void report(std::vector<mccomp::Diagnostic> &diags) {
+    addDiagnostics(ErrorStream.str(), diags);
+    Errors.clear();
+  }
+};
+
+/// JITObjectCache - the objects the JIT compiles, kept in a DiskCache so
+/// that a later process loading the same module skips the backend. An
+/// object's key is the hash of its module's bitcode, with the target, CPU,
+/// features, optimisation level and backend optimisation level it was
+/// compiled for.
+class JITObjectCache : public ObjectCache {
+public:
+  DiskCache Disk;
+
+  explicit JITObjectCache(const CompilerOptions &options)
+      : Disk(options.CacheDir, options.CacheBytes), MaxBytes(options.CacheBytes) {
+    Target = "mccomp object v2 LLVM " LLVM_VERSION_STRING " O" +
+             std::to_string(options.OptLevel.getSpeedupLevel()) + "s" +
+             std::to_string(options.OptLevel.getSizeLevel()) +
+             (options.FastCompile ? " fast" : "");
+  }
+  ~JITObjectCache() override { Disk.prune(); }
+
+  // Called by createJIT with the machine objects are compiled for, and the
+  // backend level it set, which the builder has no getter for
+  void setTarget(const orc::JITTargetMachineBuilder &machine, CodeGenOptLevel backend) {
+    Target += " backend" + std::to_string(static_cast<int>(backend)) + " " +
+              machine.getTargetTriple().str() + " " + machine.getCPU() + " " +
+              machine.getFeatures().getString() + " ";
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *module) override {
+    std::string bitcode;
+    raw_string_ostream stream(bitcode);
+    WriteBitcodeToFile(*module, stream);
+    std::string key = Target + toHex(SHA1::hash(arrayRefFromStringRef(stream.str())));
+    std::unique_ptr<MemoryBuffer> object = Disk.lookup(key);
+    // the backend changes the module, so the key is kept for the store
+    if (!object) {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Pending[module] = std::move(key);
+    }
+    return object;
+  }
+
+  void notifyObjectCompiled(const Module *module, MemoryBufferRef object) override {
+    std::string key;
+    bool prune;
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      auto pending = Pending.find(module);
+      if (pending == Pending.end())
+        return;
+      key = std::move(pending->second);
+      Pending.erase(pending);
+      // a long lived JIT prunes as it goes, not just when it is destroyed
+      Stored += object.getBufferSize();
+      prune = Stored > MaxBytes / 8;
+      if (prune)
+        Stored = 0;
+    }
+    Disk.store(key, object.getBuffer());
+    if (prune)
+      Disk.prune();
+  }
+
+private:
+  std::string Target;
+  uint64_t MaxBytes;
+  std::mutex Mutex;
+  std::map<const Module *, std::string> Pending;
+  uint64_t Stored = 0; // bytes since the last prune
+};
+
+/// PerfMap - writes /tmp/perf-<pid>.map, the file perf reads the names of
+/// JIT compiled functions from. Each object the JIT loads adds a line for
+/// each of its functions: the address, size and name. There is one for the
+/// process, as there is one map file, and it is never destroyed, since code
+/// may be loaded until exit.
+class PerfMap : public JITEventListener {
+public:
+  static PerfMap &get() {
+    static PerfMap *map = new PerfMap();
+    return *map;
+  }
+
+  void notifyObjectLoaded(ObjectKey, const object::ObjectFile &object,
+                          const RuntimeDyld::LoadedObjectInfo &info) override {
+    // the object with its sections at the addresses they were loaded to
+    object::OwningBinary<object::ObjectFile> loaded = info.getObjectForDebug(object);
+    if (!loaded.getBinary())
+      return;
+    std::string lines;
+    raw_string_ostream out(lines);
+    for (auto &symbol : object::computeSymbolSizes(*loaded.getBinary())) {
+      Expected<object::SymbolRef::Type> type = symbol.first.getType();
+      Expected<StringRef> name = symbol.first.getName();
+      Expected<uint64_t> address = symbol.first.getAddress();
+      if (type && *type == object::SymbolRef::ST_Function && name && address && symbol.second)
+        out << format("%llx %llx ", (unsigned long long)*address,
+                      (unsigned long long)symbol.second)
+            << *name << "\n";
+      consumeError(type.takeError());
+      consumeError(name.takeError());
+      consumeError(address.takeError());
+    }
+
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (!File) {
+      std::string path = "/tmp/perf-" + std::to_string(::getpid()) + ".map";
+      std::error_code EC;
+      File = std::make_unique<raw_fd_ostream>(path, EC, sys::fs::OF_Append);
+      if (EC) {
+        errs() << "Could not open " << path << ": " << EC.message() << "\n";
+        File.reset();
+        return;
+      }
+    }
+    // perf may read the file at any time, so each object is written whole
+    *File << out.str();
+    File->flush();
+  }
+
+private:
+  std::mutex Mutex;
+  std::unique_ptr<raw_fd_ostream> File;
+};
+
+// An LLJIT holding module, if there is one, whose backend runs at the
+// level that goes with the -O level in options. Its externs are bound to
+// symbols, or failing that to the symbols of this process. If there is a
+// cache, compiled objects are looked up in and added to it. With
+// compileThreads, materialization runs on a pool of that many threads
+// rather than on the thread that looks a symbol up. With -perf, the
+// functions it loads are written to the perf map and, if LLVM was built
+// with perf support, to a jitdump file with their line tables, for perf
+// inject --jit.
+static Expected<std::unique_ptr<orc::LLJIT>> createJIT(orc::ThreadSafeModule module,
+                                                       const mccomp::SymbolMap &symbols,
+                                                       const CompilerOptions &options,
+                                                       JITObjectCache *cache = nullptr,
+                                                       unsigned compileThreads = 0) {
+  auto machine = orc::JITTargetMachineBuilder::detectHost();
+  if (!machine)
+    return machine.takeError();
+  CodeGenOptLevel backend = codeGenOptLevel(options.OptLevel);
+  machine->setCodeGenOptLevel(backend);
+  if (cache)
+    cache->setTarget(*machine, backend);
+  orc::LLJITBuilder builder;
+  builder.setJITTargetMachineBuilder(std::move(*machine));
+  // each compile makes its own TargetMachine, so that threads can compile
+  // at the same time, as -tiered does
+  builder.setCompileFunctionCreator(
+      [cache](orc::JITTargetMachineBuilder machine)
+          -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+        return std::make_unique<orc::ConcurrentIRCompiler>(std::move(machine), cache);
+      });
+  if (compileThreads)
+    builder.setNumCompileThreads(compileThreads);
+  // RuntimeDyld tells JITEventListeners about the objects it loads
+  if (options.Perf)
+    builder.setObjectLinkingLayerCreator(
+        [](orc::ExecutionSession &session,
+           const Triple &) -> Expected<std::unique_ptr<orc::ObjectLayer>> {
+          auto layer = std::make_unique<orc::RTDyldObjectLinkingLayer>(
+              session, [] { return std::make_unique<SectionMemoryManager>(); });
+          layer->registerJITEventListener(PerfMap::get());
+          if (JITEventListener *jitdump = JITEventListener::createPerfJITEventListener())
+            layer->registerJITEventListener(*jitdump);
+          return std::move(layer);
+        });
+  auto jit = builder.create();
+  if (!jit)
+    return jit.takeError();
+  orc::JITDylib &main = (*jit)->getMainJITDylib();
+  if (!symbols.empty()) {
+    orc::SymbolMap bound;
+    for (auto &symbol : symbols)
+      bound[(*jit)->mangleAndIntern(symbol.first)] = orc::ExecutorSymbolDef(
+          orc::ExecutorAddr::fromPtr(symbol.second), JITSymbolFlags::Exported);
+    if (Error error = main.define(orc::absoluteSymbols(std::move(bound))))
+      return std::move(error);
+  }
+  auto process = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*jit)->getDataLayout().getGlobalPrefix());
+  if (!process)
+    return process.takeError();
+  main.addGenerator(std::move(*process));
+  if (module)
+    if (Error error = (*jit)->addIRModule(std::move(module)))
+      return std::move(error);
+  return jit;
+}
+
+} // namespace detail
+} // namespace mccomp
+
+mccomp::CompiledModule::CompiledModule() = default;
+mccomp::CompiledModule::CompiledModule(CompiledModule &&) = default;
+mccomp::CompiledModule::~CompiledModule() = default;
+
+mccomp::CompiledModule mccomp::compileToModule(StringRef source, std::vector<Diagnostic> &diags,
+                                               const Options &options) {
+  detail::LibraryCompile compile(source, options);
+  CompiledModule result;
+  if (compile.run()) {
+    result.Module = std::move(compile.Session.TheModule);
+    result.Context = std::move(compile.Session.ContextOwner);
+  }
+  compile.report(diags);
+  return result;
+}
+
+std::unique_ptr<MemoryBuffer> mccomp::compileToObject(StringRef source,
+                                                      std::vector<Diagnostic> &diags,
+                                                      const Options &options) {
+  detail::LibraryCompile compile(source, options);
+  std::unique_ptr<MemoryBuffer> object;
+  if (compile.run())
+    object = compile.Session.emitObject();
+  compile.report(diags);
+  return object;
+}
+
+struct mccomp::Program::Impl {
+  std::unique_ptr<detail::JITObjectCache> Cache; // outlives the JIT
+  std::unique_ptr<orc::LLJIT> JIT;
+};
+
+mccomp::Program::Program(std::unique_ptr<Impl> impl) : TheImpl(std::move(impl)) {}
+mccomp::Program::~Program() = default;
+
+void *mccomp::Program::getAddress(StringRef name) const {
+  auto symbol = TheImpl->JIT->lookup(name);
+  if (!symbol) {
+    consumeError(symbol.takeError());
+    return nullptr;
+  }
+  return symbol->toPtr<void *>();
+}
+
+std::unique_ptr<mccomp::Program> mccomp::compileToProgram(StringRef source,
+                                                          std::vector<Diagnostic> &diags,
+                                                          const Options &options,
+                                                          const SymbolMap &symbols) {
+  CompiledModule compiled = compileToModule(source, diags, options);
+  if (!compiled.Module)
+    return nullptr;
+  auto impl = std::make_unique<Program::Impl>();
+  detail::CompilerOptions sessionOptions = detail::LibraryCompile::sessionOptions(options);
+  if (!options.CacheDir.empty())
+    impl->Cache = std::make_unique<detail::JITObjectCache>(sessionOptions);
+  auto jit = detail::createJIT(orc::ThreadSafeModule(std::move(compiled.Module),
+                                                     std::move(compiled.Context)),
+                               symbols, sessionOptions, impl->Cache.get());
+  if (!jit) {
+    diags.push_back({Diagnostic::Other, 0, 0, toString(jit.takeError())});
+    return nullptr;
+  }
+  impl->JIT = std::move(*jit);
+  return std::make_unique<Program>(std::move(impl));
+}
+
+namespace mccomp {
+namespace detail {
+
+//===----------------------------------------------------------------------===//
+// Compiler Driver
+//===----------------------------------------------------------------------===//
+
+static void usage(raw_ostream &out) {
+  out << "Usage: ./code [-O0|-O1|-O2|-O3|-Os] [-S|-c|-emit-bc] [-fast] [-jN]\n"
+         "              [-pipeline|-stream] [-cache-dir Dir] [-cache-size MB]\n"
+         "              [-o OutputFile|OutputDir] InputFile...\n"
+         "       ./code --emit-interface [-o Output.mci|OutputDir] InputFile...\n"
+         "       ./code --run Entry [-lazy|-tiered|-vm] [-repeat N] [-perf] [options]\n"
+         "              InputFile [Arg...]\n"
+         "       ./code --watch [options] InputFile...\n"
+         "       ./code --server SocketPath\n";
+}
+
+static const char *outputExtension(CompilerOptions::OutputKind kind) {
+  switch (kind) {
+  case CompilerOptions::EmitObject:
+    return ".o";
+  case CompilerOptions::EmitAssembly:
+    return ".s";
+  case CompilerOptions::EmitBitcode:
+    return ".bc";
+  case CompilerOptions::EmitInterface:
+    return ".mci";
+  case CompilerOptions::EmitIR:
+    break;
+  }
+  return ".ll";
+}
+
+// Compile one file through every stage. The AST goes to out; progress
+// messages and errors go to diags.
+static bool compileFile(std::unique_ptr<MemoryBuffer> source, StringRef outputFile,
+                        const CompilerOptions &options, TargetMachinePool *machines,
+                        raw_ostream &out, raw_ostream &diags) {
+  CompilerSession session(std::move(source), out, diags, options, machines);
+  diags << "Lexer Finished\n";
+  if (options.Stream)
+    return session.stream(outputFile);
+
+  // Run the parser now.
+  bool parsed = session.parse();
+  diags << "Parsing Finished\n";
+  HeaderCache &headers = HeaderCache::get();
+  if (headers.Loaded || headers.Reused) // so far in this process
+    diags << "Headers: " << headers.Loaded.load() << " loaded, "
+          << headers.Reused.load() << " reused\n";
+
+  if (!parsed || !session.analyse())
+    return false;
+  diags << "Semantic Analysis Finished\n";
+  if (options.Emit == CompilerOptions::EmitInterface)
+    return session.writeInterface(outputFile);
+
+  if (!session.codegen())
+    return false;
+  diags << "Code Generation Finished\n";
+  if (session.Cache)
+    diags << "Cache: " << session.Cache->Hits.load() << " hits, "
+          << session.Cache->Misses.load() << " misses\n";
+  if (options.Pipeline)
+    session.printPipelineStats(diags);
+
+  switch (options.Emit) {
+  case CompilerOptions::EmitObject:
+    return session.emitFile(outputFile, CodeGenFileType::ObjectFile);
+  case CompilerOptions::EmitAssembly:
+    return session.emitFile(outputFile, CodeGenFileType::AssemblyFile);
+  case CompilerOptions::EmitBitcode:
+    return session.writeBitcode(outputFile);
+  case CompilerOptions::EmitIR:
+  case CompilerOptions::EmitInterface:
+    break;
+  }
+
+  //********************* Start printing final IR **************************
+  // Print out all of the generated code into the output file
+  return session.writeIR(outputFile);
+  //********************* End printing final IR ****************************
+}
+
+/// CompileRequest - one run of the compiler: its command line, the
+/// directory relative paths are resolved against (the current one if
+/// empty), and, for a compile server, the client's standard input, which
+/// is read for an input file named "-".
+struct CompileRequest {
+  std::vector<std::string> Args;
+  std::string WorkingDir;
+  std::optional<std::string> Stdin;
+};
+
+static std::string resolvePath(StringRef path, StringRef workingDir) {
+  SmallString<128> resolved(path);
+  if (!workingDir.empty() && path != "-")
+    sys::fs::make_absolute(workingDir, resolved);
+  return std::string(resolved);
+}
+
+// Parse the command line into options and the input and output files
+static bool parseCommandLine(const CompileRequest &request, CompilerOptions &options,
+                             std::vector<std::string> &inputFiles,
+                             std::vector<std::string> &outputFiles, raw_ostream &out,
+                             raw_ostream &err) {
+  const std::vector<std::string> &args = request.Args;
+  options.NumThreads = std::thread::hardware_concurrency();
+  for (unsigned i = 0; i < args.size(); i++) {
+    StringRef arg = args[i];
+    if (arg == "-O0")
+      options.OptLevel = OptimizationLevel::O0;
+    else if (arg == "-O1")
+      options.OptLevel = OptimizationLevel::O1;
+    else if (arg == "-O2")
+      options.OptLevel = OptimizationLevel::O2;
+    else if (arg == "-O3")
+      options.OptLevel = OptimizationLevel::O3;
+    else if (arg == "-Os")
+      options.OptLevel = OptimizationLevel::Os;
+    else if (arg == "-S")
+      options.Emit = CompilerOptions::EmitAssembly;
+    else if (arg == "-c")
+      options.Emit = CompilerOptions::EmitObject;
+    else if (arg == "-fast")
+      options.FastCompile = true;
+    else if (arg == "-pipeline")
+      options.Pipeline = true;
+    else if (arg == "-stream")
+      options.Stream = true;
+    else if (arg == "-lazy")
+      options.Lazy = true;
+    else if (arg == "-tiered")
+      options.Tiered = true;
+    else if (arg == "-vm")
+      options.VM = true;
+    else if (arg == "-perf")
+      options.Perf = true;
+    else if (arg == "-emit-bc")
+      options.Emit = CompilerOptions::EmitBitcode;
+    else if (arg == "--emit-interface")
+      options.Emit = CompilerOptions::EmitInterface;
+    else if (arg.starts_with("-j")) {
+      // worker threads for semantic analysis, code generation and the backend
+      if (arg.drop_front(2).getAsInteger(10, options.NumThreads) ||
+          options.NumThreads == 0) {
+        usage(out);
+        return false;
+      }
+      options.SplitObject = true;
+    }
+    else if (arg == "-cache-dir" && i + 1 < args.size())
+      options.CacheDir = resolvePath(args[++i], request.WorkingDir);
+    else if (arg == "-cache-size" && i + 1 < args.size()) {
+      if (StringRef(args[++i]).getAsInteger(10, options.CacheBytes)) {
+        usage(out);
+        return false;
+      }
+      options.CacheBytes <<= 20;
+    } else if (arg == "-repeat" && i + 1 < args.size()) {
+      if (StringRef(args[++i]).getAsInteger(10, options.Repeat) || !options.Repeat) {
+        usage(out);
+        return false;
+      }
+    } else if (arg == "-o" && i + 1 < args.size())
+      options.OutputFile = resolvePath(args[++i], request.WorkingDir);
+    else if (arg.starts_with("-") && arg != "-") {
+      usage(out);
+      return false;
+    } else
+      inputFiles.push_back(resolvePath(arg, request.WorkingDir));
+  }
+  if (inputFiles.empty()) {
+    usage(out);
+    return false;
+  }
+  if (options.FastCompile)
+    options.OptLevel = OptimizationLevel::O0;
+  if (options.Stream && options.Emit != CompilerOptions::EmitObject) {
+    err << "-stream writes object files only, and needs -c\n";
+    return false;
+  }
+
+  // A single file is written to -o, or to output.ll (.bc, .s, .o). With
+  // several files, or when -o names a directory, each file gets its own
+  // output in that directory (or the current one), named after the input.
+  // An interface is always named after its input unless -o names a file,
+  // since import finds it by that name.
+  const char *extension = outputExtension(options.Emit);
+  bool named = options.Emit == CompilerOptions::EmitInterface && options.OutputFile.empty();
+  if (inputFiles.size() == 1 && !named && !sys::fs::is_directory(options.OutputFile)) {
+    outputFiles.push_back(options.OutputFile.empty()
+                              ? resolvePath(std::string("output") + extension,
+                                            request.WorkingDir)
+                              : options.OutputFile);
+  } else {
+    std::string dir = options.OutputFile.empty() ? resolvePath(".", request.WorkingDir)
+                                                 : options.OutputFile;
+    if (std::error_code EC = sys::fs::create_directories(dir)) {
+      err << "Could not create directory " << dir << ": " << EC.message() << "\n";
+      return false;
+    }
+    std::set<std::string> seen;
+    for (const std::string &input : inputFiles) {
+      SmallString<128> output(dir);
+      sys::path::append(output, sys::path::stem(input) + extension);
+      if (!seen.insert(std::string(output)).second) {
+        err << "More than one input would be written to " << output << "\n";
+        return false;
+      }
+      outputFiles.push_back(std::string(output));
+    }
+  }
+
+  return true;
+}
+
+// Parse the command line and compile every input, returning the exit status
+static int runCompiler(const CompileRequest &request, TargetMachinePool *machines,
+                       raw_ostream &out, raw_ostream &err) {
+  CompilerOptions options;
+  std::vector<std::string> inputFiles, outputFiles;
+  if (!parseCommandLine(request, options, inputFiles, outputFiles, out, err))
+    return 1;
+  if (options.Perf) {
+    err << "-perf describes JIT compiled code, and needs --run\n";
+    return 1;
+  }
+
+  auto compile = [&](unsigned i, const CompilerOptions &options, raw_ostream &out,
+                     raw_ostream &diags) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> source =
+        inputFiles[i] == "-" && request.Stdin
+            // named so that its #include paths are relative to the client's directory
+            ? MemoryBuffer::getMemBufferCopy(*request.Stdin,
+                                              resolvePath("<stdin>", request.WorkingDir))
+            : MemoryBuffer::getFileOrSTDIN(inputFiles[i]);
+    if (!source) {
+      diags << "Error opening file: " << source.getError().message() << "\n";
+      return false;
+    }
+    return compileFile(std::move(*source), outputFiles[i], options, machines, out, diags);
+  };
+
+  if (inputFiles.size() == 1)
+    return compile(0, options, out, err) ? 0 : 1;
+
+  // Files are compiled side by side, sharing the threads between them. Each
+  // file's output is collected and printed in one piece once it finishes.
+  CompilerOptions fileOptions = options;
+  fileOptions.NumThreads = std::max<unsigned>(1, options.NumThreads / inputFiles.size());
+  std::mutex printLock;
+  bool failed = false;
+  ThreadPool pool(hardware_concurrency(
+      std::min<unsigned>(options.NumThreads, inputFiles.size())));
+  for (unsigned i = 0; i < inputFiles.size(); i++)
+    pool.async([&, i] {
+      std::string fileOut, fileDiags;
+      raw_string_ostream outStream(fileOut), diagsStream(fileDiags);
+      bool ok = compile(i, fileOptions, outStream, diagsStream);
+      std::lock_guard<std::mutex> lock(printLock);
+      out << inputFiles[i] << ":\n" << outStream.str();
+      out.flush();
+      err << inputFiles[i] << ":\n" << diagsStream.str();
+      failed |= !ok;
+    });
+  pool.wait();
+  return failed ? 1 : 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Compile Server
+//===----------------------------------------------------------------------===//
+
+// A compile server keeps LLVM initialised and its TargetMachines warm, and
+// runs each request from mcclient as if it were a fresh command line. Every
+// request gets its own CompilerSession (and so its own LLVMContext), which
+// keeps the server's memory flat however many requests it handles.
+//
+// Requests and replies are framed as described in mcprotocol.h, which
+// mcclient shares.
+
+using mcprotocol::readField;
+using mcprotocol::writeField;
+
+static void serveRequest(int fd, TargetMachinePool &machines) {
+  CompileRequest request;
+  std::string hasStdin, stdinText, count;
+  unsigned numArgs;
+  const uint32_t maxField = mcprotocol::MaxRequestField;
+  if (!readField(fd, request.WorkingDir, maxField) || !readField(fd, hasStdin, maxField) ||
+      !readField(fd, stdinText, maxField) || !readField(fd, count, maxField) ||
+      StringRef(count).getAsInteger(10, numArgs) || numArgs > mcprotocol::MaxRequestArgs)
+    return;
+  if (hasStdin == "1")
+    request.Stdin = std::move(stdinText);
+  request.Args.resize(numArgs);
+  for (std::string &arg : request.Args)
+    if (!readField(fd, arg, maxField))
+      return;
+
+  std::string out, err;
+  raw_string_ostream outStream(out), errStream(err);
+  int status = runCompiler(request, &machines, outStream, errStream);
+  writeField(fd, std::to_string(status)) && writeField(fd, outStream.str()) &&
+      writeField(fd, errStream.str());
+}
+
+static int runServer(StringRef socketPath) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    errs() << "Socket path is too long: " << socketPath << "\n";
+    return 1;
+  }
+  memcpy(address.sun_path, socketPath.data(), socketPath.size());
+
+  // Replace a socket left by an earlier server, but nothing else that
+  // happens to have the path
+  struct stat existing;
+  if (::lstat(address.sun_path, &existing) == 0) {
+    if (!S_ISSOCK(existing.st_mode)) {
+      errs() << "Could not listen on " << socketPath << ": it exists and is not a socket\n";
+      return 1;
+    }
+    ::unlink(address.sun_path);
+  }
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || ::bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+      ::listen(listener, 64) < 0) {
+    errs() << "Could not listen on " << socketPath << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  errs() << "Listening on " << socketPath << "\n";
+
+  TargetMachinePool machines;
+  ThreadPool pool(hardware_concurrency());
+  while (true) {
+    int fd = ::accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      errs() << "accept failed: " << strerror(errno) << "\n";
+      return 1;
+    }
+    pool.async([fd, &machines] {
+      serveRequest(fd, machines);
+      ::close(fd);
+    });
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// JIT Execution
+//===----------------------------------------------------------------------===//
+
+// mccomp --run Entry [options] InputFile [Arg...] compiles InputFile, loads
+// it into an ORC LLJIT in this process and calls Entry with the Args, in
+// place of writing output.ll, linking it with a driver and running that.
+// Externs are bound to the functions the test drivers define, or else to
+// the symbols of this process, such as the C library's.
+
+static int runtimePrintInt(int X) {
+  fprintf(stderr, "%d\n", X);
+  return 0;
+}
+
+static float runtimePrintFloat(float X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+static const mccomp::SymbolMap &runtimeSymbols() {
+  static const mccomp::SymbolMap symbols = {
+      {"print_int", reinterpret_cast<void *>(runtimePrintInt)},
+      {"print_float", reinterpret_cast<void *>(runtimePrintFloat)}};
+  return symbols;
+}
+
+/// RunValue - an argument or result of the entry point
+union RunValue {
+  int32_t Int;
+  float Float;
+  bool Bool;
+  uint64_t Bits;
+};
+
+// The entry point is called through a function added to the module,
+//   void mccomp.run(RunValue *args, RunValue *result)
+// which passes it args[0] and on and stores what it returns, so that a
+// function of any Mini-C signature can be called from here.
+static void addRunThunk(Module &module, Function &entry, StringRef name = "mccomp.run") {
+  LLVMContext &context = module.getContext();
+  IRBuilder<> builder(context);
+  Type *slot = builder.getInt64Ty();
+  FunctionType *type = FunctionType::get(builder.getVoidTy(),
+                                         {slot->getPointerTo(), slot->getPointerTo()}, false);
+  Function *thunk = Function::Create(type, Function::ExternalLinkage, name, module);
+  builder.SetInsertPoint(BasicBlock::Create(context, "entry", thunk));
+
+  // bools are i1 in registers and a byte in memory
+  auto memoryType = [&](Type *type) {
+    return type->isIntegerTy(1) ? builder.getInt8Ty() : type;
+  };
+  std::vector<Value *> args;
+  for (unsigned i = 0; i < entry.arg_size(); i++) {
+    Type *argType = entry.getFunctionType()->getParamType(i);
+    // a -tiered loop continuation is passed the interpreter's locals
+    if (argType->isPointerTy()) {
+      args.push_back(builder.CreateBitCast(thunk->getArg(0), argType));
+      continue;
+    }
+    Value *address = builder.CreateConstGEP1_32(slot, thunk->getArg(0), i);
+    address = builder.CreateBitCast(address, memoryType(argType)->getPointerTo());
+    Value *arg = builder.CreateLoad(memoryType(argType), address);
+    args.push_back(builder.CreateTrunc(arg, argType));
+  }
+  Value *result = builder.CreateCall(&entry, args);
+  if (!result->getType()->isVoidTy()) {
+    result = builder.CreateZExt(result, memoryType(result->getType()));
+    builder.CreateStore(result, builder.CreateBitCast(thunk->getArg(1),
+                                                      result->getType()->getPointerTo()));
+  }
+  builder.CreateRetVoid();
+}
+
+static bool parseRunValue(StringRef text, StringRef type, RunValue &value) {
+  value.Bits = 0;
+  if (type == "bool") {
+    value.Bool = text == "true" || text == "1";
+    return value.Bool || text == "false" || text == "0";
+  }
+  if (type == "float") {
+    double parsed;
+    if (text.getAsDouble(parsed))
+      return false;
+    value.Float = parsed;
+    return true;
+  }
+  return !text.getAsInteger(10, value.Int);
+}
+
+// With -lazy, TheModule holds only the globals and declarations, and each
+// function is a FunctionUnit: the body of foo is the JIT symbol foo.body,
+// which nothing refers to directly. foo itself is a stub made by
+// lazyReexports that, when first called, has the FunctionUnit generate
+// and compile the body and then jumps there; later calls go straight
+// through. Bodies live in a JITDylib of their own whose calls to other
+// functions are resolved from the main one, so that they go through the
+// stubs rather than pulling in every callee as each body is linked.
+//
+// Given more than one -j thread, a --run -lazy JIT materializes on a pool
+// of that many compile threads, and a FunctionUnit starts by asking for the bodies of the functions it calls,
+// which the pool compiles while this one is generated and compiled. So
+// whatever is reachable from a called function is compiled ahead of the
+// execution that needs it, in parallel, and a stub that is then called
+// finds its body ready or being compiled, rather than compiling the call
+// graph one callee at a time as execution reaches each. A function that is
+// never reached is still never compiled. With one thread the pool would
+// only add a hand-off to every compile, so -lazy compiles on the calling
+// thread as before.
+
+/// Speculation - the lookups a -lazy run has made for callee bodies ahead
+/// of their first call. They must finish before the stubs are destroyed,
+/// as the bodies they compile are linked against them.
+class Speculation {
+public:
+  ~Speculation() {
+    std::unique_lock<std::mutex> lock(Lock);
+    Done.wait(lock, [&] { return Pending == 0; });
+  }
+
+  void lookup(orc::JITDylib &bodies, orc::SymbolLookupSet symbols) {
+    if (symbols.empty())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      Pending++;
+    }
+    // a body that fails is reported when it is materialized, and again to
+    // the stub that calls it
+    bodies.getExecutionSession().lookup(
+        orc::LookupKind::Static, orc::makeJITDylibSearchOrder(&bodies), std::move(symbols),
+        orc::SymbolState::Ready,
+        [this](Expected<orc::SymbolMap> result) {
+          consumeError(result.takeError());
+          std::lock_guard<std::mutex> lock(Lock);
+          if (--Pending == 0)
+            Done.notify_all();
+        },
+        orc::NoDependenciesToRegister);
+  }
+
+private:
+  std::mutex Lock;
+  std::condition_variable Done;
+  unsigned Pending = 0;
+};
+
+/// FunctionUnit - the body of one function, generated from its AST when it
+/// is first needed
+class FunctionUnit : public orc::MaterializationUnit {
+  orc::LLJIT &JIT;
+  const CompilerSession &Session;
+  const ModuleDeclarations &Decls;
+  FunctionAST *Function;
+  Speculation *Speculate; // null to compile only what is called
+
+public:
+  FunctionUnit(orc::LLJIT &jit, const CompilerSession &session, const ModuleDeclarations &decls,
+               FunctionAST *function, orc::SymbolStringPtr body, Speculation *speculate)
+      : MaterializationUnit(Interface(
+            orc::SymbolFlagsMap{{body, JITSymbolFlags::Exported | JITSymbolFlags::Callable}},
+            nullptr)),
+        JIT(jit), Session(session), Decls(decls), Function(function), Speculate(speculate) {}
+
+  StringRef getName() const override { return "FunctionUnit"; }
+
+  void materialize(std::unique_ptr<orc::MaterializationResponsibility> responsibility) override {
+    const std::string &name = Function->getProto().getName();
+    if (Speculate) {
+      Fingerprint calls;
+      Function->fingerprint(calls);
+      orc::SymbolLookupSet callees;
+      for (const std::string &callee : calls.References)
+        if (callee != name && Decls.Definitions.count(callee))
+          callees.add(JIT.mangleAndIntern(callee + ".body"));
+      Speculate->lookup(responsibility->getTargetJITDylib(), std::move(callees));
+    }
+
+    auto context = std::make_unique<LLVMContext>();
+    auto module = std::make_unique<Module>("mini-c", *context);
+    std::string errors;
+    raw_string_ostream diags(errors);
+    if (!Session.buildFunction(Function, Decls, *module, diags)) {
+      JIT.getExecutionSession().reportError(
+          make_error<StringError>(diags.str(), inconvertibleErrorCode()));
+      responsibility->failMaterialization();
+      return;
+    }
+    // recursive calls are renamed with it, and so skip the stub
+    module->getFunction(name)->setName(name + ".body");
+    JIT.getIRCompileLayer().emit(std::move(responsibility),
+                                 orc::ThreadSafeModule(std::move(module), std::move(context)));
+  }
+
+private:
+  void discard(const orc::JITDylib &, const orc::SymbolStringPtr &) override {}
+};
+
+/// LazyFunctions - the stubs of a -lazy run and what they need. Destroy them
+/// before the JIT, as LLLazyJIT does; the other way round corrupts the heap
+/// now and then at exit.
+struct LazyFunctions {
+  std::unique_ptr<orc::LazyCallThroughManager> CallThrough;
+  std::unique_ptr<orc::IndirectStubsManager> Stubs;
+  orc::JITDylib *Bodies = nullptr;
+  Speculation Speculative; // destroyed first
+
+  // With speculate, compiling a body queues the bodies it calls, which is
+  // only worth doing if the JIT has compile threads to run them on
+  Error add(orc::LLJIT &jit, const CompilerSession &session, const ModuleDeclarations &decls,
+            bool speculate = false) {
+    const Triple &triple = jit.getTargetTriple();
+    auto callThrough = orc::createLocalLazyCallThroughManager(triple, jit.getExecutionSession(),
+                                                              orc::ExecutorAddr());
+    if (!callThrough)
+      return callThrough.takeError();
+    CallThrough = std::move(*callThrough);
+    Stubs = orc::createLocalIndirectStubsManagerBuilder(triple)();
+
+    auto bodies = jit.createJITDylib("bodies");
+    if (!bodies)
+      return bodies.takeError();
+    Bodies = &*bodies;
+    bodies->addToLinkOrder(jit.getMainJITDylib());
+    orc::SymbolAliasMap stubs;
+    for (FunctionAST *function : decls.Functions) {
+      const std::string &name = function->getProto().getName();
+      orc::SymbolStringPtr body = jit.mangleAndIntern(name + ".body");
+      if (Error error = bodies->define(
+              std::make_unique<FunctionUnit>(jit, session, decls, function, body,
+                                             speculate ? &Speculative : nullptr)))
+        return error;
+      stubs[jit.mangleAndIntern(name)] =
+          orc::SymbolAliasMapEntry(body, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    }
+    return jit.getMainJITDylib().define(
+        orc::lazyReexports(*CallThrough, *Stubs, *bodies, std::move(stubs)));
+  }
+};
+
+/// RunTimes - when each stage of a --run finished
+struct RunTimes {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point Start = Clock::now(), Compiled, Loaded, Finished;
+};
+
+// Run entry, compiled in full or, with -lazy, as each function is called
+static bool runJIT(CompilerSession &session, FunctionAST &entry, RunValue *args,
+                   RunValue &result, RunTimes &times) {
+  const CompilerOptions &options = session.Options;
+  ModuleDeclarations decls; // what -lazy generates functions from
+  unsigned compileThreads = options.Lazy && options.NumThreads > 1 ? options.NumThreads : 0;
+  if (!(options.Lazy ? session.codegenDeclarations(decls) : session.codegen()))
+    return false;
+  addRunThunk(*session.TheModule, *session.TheModule->getFunction(entry.getProto().getName()));
+  times.Compiled = RunTimes::Clock::now();
+
+  std::unique_ptr<JITObjectCache> objects;
+  if (!options.CacheDir.empty()) {
+    objects = std::make_unique<JITObjectCache>(options);
+    if (!objects->Disk.create(errs()))
+      return false;
+  }
+  auto jit = createJIT(orc::ThreadSafeModule(std::move(session.TheModule),
+                                             std::move(session.ContextOwner)),
+                       runtimeSymbols(), options, objects.get(), compileThreads);
+  if (!jit) {
+    errs() << toString(jit.takeError()) << "\n";
+    return false;
+  }
+  LazyFunctions lazy; // destroyed before the JIT
+  if (options.Lazy) {
+    if (Error error = lazy.add(**jit, session, decls, compileThreads > 0)) {
+      errs() << toString(std::move(error)) << "\n";
+      return false;
+    }
+  }
+  // the backend runs when the symbol is first looked up
+  auto thunk = (*jit)->lookup("mccomp.run");
+  if (!thunk) {
+    errs() << toString(thunk.takeError()) << "\n";
+    return false;
+  }
+  void *thunkAddress = thunk->toPtr<void *>();
+  auto run = reinterpret_cast<void (*)(RunValue *, RunValue *)>(thunkAddress);
+  times.Loaded = RunTimes::Clock::now();
+
+  for (unsigned i = 0; i < options.Repeat; i++)
+    run(args, &result);
+  times.Finished = RunTimes::Clock::now();
+  if (objects)
+    errs() << "Objects: " << objects->Disk.Hits.load() << " loaded, "
+           << objects->Disk.Misses.load() << " compiled\n";
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Tiered Execution
+//===----------------------------------------------------------------------===//
+
+// With -tiered, --run starts without LLVM: functions are run by an
+// interpreter over the checked AST, with each local in the slot check()
+// gave it. The interpreter counts the calls to each function and the back
+// edges its loops take, and a function that passes HotCalls or
+// HotBackedges is queued for a compile thread. That thread generates and
+// optimises it as -lazy would, compiles it, and publishes a thunk to call
+// the result through. Every interpreted call checks for the thunk, so the
+// switch is one atomic load. A call that is already running carries on in
+// the interpreter, unless a loop in it takes HotBackedges back edges: then
+// the rest of the function, entered at the loop's condition with the
+// interpreter's locals, is queued as a continuation of its own, and the
+// loop checks for it on each later back edge and finishes the call in it.
+// Compiled code calls other functions through the -lazy stubs, so a callee
+// first called from compiled code is compiled there and then.
+//
+// Globals live in the interpreter and are given to the JIT as absolute
+// symbols, so both tiers see the same values. Externs are called through
+// thunks as well, compiled when first called by the same thread, ahead of
+// the queue, while the interpreter waits.
+
+static const unsigned HotCalls = 100, HotBackedges = 1000;
+
+using NativeThunk = void (*)(RunValue *args, RunValue *result);
+
+// 'i', 'f', 'b' or 'v' for a type, the interpreter's shorthand
+static char typeCode(const std::string &type) { return type.empty() ? 'v' : type[0]; }
+
+/// TieredFunction - a function or extern as the interpreter calls it, or
+/// the continuation of a function from a loop, which is passed its locals
+struct TieredFunction {
+  std::string Name;
+  FunctionAST *Function = nullptr; // null for an extern
+  const ASTnode *Loop = nullptr;   // the loop a continuation starts at
+  std::string ParamTypes;          // a typeCode() for each parameter
+  char ReturnType = 'v';
+  unsigned Calls = 0, Backedges = 0; // counted on the interpreter's thread
+  unsigned NumLoops = 0;               // continuations made of it, likewise
+  bool Queued = false;                 // for the compile thread
+  bool Failed = false;                 // guarded by the TierCompiler's lock
+  std::atomic<NativeThunk> Native{nullptr};
+};
+
+/// TierCompiler - the JIT of a -tiered run, made when it is first needed,
+/// and the thread that compiles hot functions into it
+class TierCompiler {
+public:
+  std::vector<std::string> Promoted; // in the order they were compiled
+
+  TierCompiler(CompilerSession &session, const ModuleDeclarations &decls,
+               mccomp::SymbolMap symbols)
+      : Session(session), Decls(decls), Symbols(std::move(symbols)) {}
+
+  ~TierCompiler() { stop(); }
+
+  // Wait for the function being compiled, if any, and compile no more
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      Stopping = true;
+    }
+    Ready.notify_one();
+    if (Thread.joinable())
+      Thread.join();
+  }
+
+  // Compile function on the compile thread
+  void promote(TieredFunction &function) {
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      if (Stopping)
+        return;
+      Queue.push_back(&function);
+      start();
+    }
+    Ready.notify_one();
+  }
+
+  // Compile function next and wait for it. False if it could not be.
+  bool compileNow(TieredFunction &function) {
+    std::unique_lock<std::mutex> lock(Lock);
+    Queue.push_front(&function);
+    start();
+    Ready.notify_one();
+    Compiled.wait(lock, [&] { return function.Native.load() || function.Failed; });
+    return !function.Failed;
+  }
+
+private:
+  CompilerSession &Session;
+  const ModuleDeclarations &Decls;
+  mccomp::SymbolMap Symbols;
+
+  std::mutex Lock; // guards Queue, Stopping and Failed
+  std::condition_variable Ready, Compiled;
+  std::deque<TieredFunction *> Queue;
+  bool Stopping = false;
+  std::thread Thread;
+
+  // made and compiled into on the compile thread
+  std::unique_ptr<orc::LLJIT> JIT;
+  LazyFunctions Lazy;
+
+  void start() {
+    if (!Thread.joinable())
+      Thread = std::thread([this] { run(); });
+  }
+
+  // A thunk for function
+  Expected<NativeThunk> compile(TieredFunction &function) {
+    if (Error error = createJIT())
+      return std::move(error);
+    auto context = std::make_unique<LLVMContext>();
+    auto module = std::make_unique<Module>("mini-c", *context);
+    module->setDataLayout(JIT->getDataLayout());
+    IRBuilder<> builder(*context);
+    CodeGenerator gen(*context, builder, *module, Decls, nulls());
+    Function *callee;
+    if (function.Loop) {
+      std::string errors;
+      raw_string_ostream diags(errors);
+      if (!Session.buildContinuation(function.Function, function.Loop, Decls, *module, diags))
+        return make_error<StringError>(diags.str(), inconvertibleErrorCode());
+      callee = module->getFunction(function.Function->getProto().getName() + ".loop");
+      callee->setName(function.Name);
+    } else {
+      callee = gen.getFunction(function.Name);
+      // a function's thunk calls its body, not its stub
+      if (function.Function)
+        callee->setName(function.Name + ".body");
+    }
+    addRunThunk(*module, *callee, function.Name + ".tier");
+    if (Error error = JIT->addIRModule(*Lazy.Bodies, orc::ThreadSafeModule(std::move(module),
+                                                                          std::move(context))))
+      return std::move(error);
+    auto thunk = JIT->lookup(*Lazy.Bodies, function.Name + ".tier");
+    if (!thunk)
+      return thunk.takeError();
+    return reinterpret_cast<NativeThunk>(thunk->toPtr<void *>());
+  }
+
+  Error createJIT() {
+    if (JIT)
+      return Error::success();
+    if (!Session.createTargetMachine())
+      return make_error<StringError>("Could not create a target machine",
+                                     inconvertibleErrorCode());
+    auto jit = detail::createJIT(orc::ThreadSafeModule(), Symbols, Session.Options);
+    if (!jit)
+      return jit.takeError();
+    if (Error error = Lazy.add(**jit, Session, Decls))
+      return error;
+    JIT = std::move(*jit);
+    return Error::success();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(Lock);
+    while (true) {
+      Ready.wait(lock, [&] { return Stopping || !Queue.empty(); });
+      if (Stopping)
+        return;
+      TieredFunction *function = Queue.front();
+      Queue.pop_front();
+      lock.unlock();
+      // a function that fails to compile stays in the interpreter
+      auto thunk = compile(*function);
+      NativeThunk native = nullptr;
+      if (thunk) {
+        native = *thunk;
+        if (function->Function)
+          Promoted.push_back(function->Name);
+      } else {
+        errs() << toString(thunk.takeError()) << "\n";
+      }
+      lock.lock();
+      function->Native.store(native, std::memory_order_release);
+      function->Failed = !native;
+      Compiled.notify_all();
+    }
+  }
+};
+
+/// Interpreter - runs functions over their ASTs until they are compiled
+class Interpreter {
+public:
+  RunValue *Locals = nullptr; // the slots of the function running
+  TieredFunction *Current = nullptr;
+  RunValue Result; // set by a return statement
+  StringMap<RunValue> Globals;
+  StringMap<TieredFunction> Functions;
+  std::map<const ASTnode *, TieredFunction> Loops; // continuations, by loop
+  TierCompiler *Compiler = nullptr;
+
+  explicit Interpreter(const ModuleDeclarations &decls) {
+    for (auto &global : decls.Globals)
+      Globals[global.first].Bits = 0;
+    for (auto &proto : decls.Prototypes) {
+      TieredFunction &function = Functions[proto.first];
+      function.Name = proto.first;
+      auto definition = decls.Definitions.find(proto.first);
+      if (definition != decls.Definitions.end())
+        function.Function = definition->second;
+      for (const std::string &type : paramTypes(*proto.second))
+        function.ParamTypes += typeCode(type);
+      function.ReturnType = typeCode(proto.second->getType());
+    }
+  }
+
+  RunValue &global(const std::string &name) { return Globals.find(name)->second; }
+
+  RunValue call(TieredFunction &function, RunValue *args) {
+    RunValue result;
+    result.Bits = 0;
+    NativeThunk native = function.Native.load(std::memory_order_acquire);
+    if (!native && !function.Function)
+      native = compileExtern(function);
+    if (native) {
+      native(args, &result);
+      return result;
+    }
+    if (++function.Calls == HotCalls)
+      promote(function);
+
+    SmallVector<RunValue, 16> locals(function.Function->getNumLocals(), result);
+    std::copy(args, args + function.ParamTypes.size(), locals.begin());
+    RunValue *callerLocals = Locals;
+    TieredFunction *caller = Current;
+    Locals = locals.data();
+    Current = &function;
+    Result = result;
+    function.Function->getBody().execute(*this);
+    result = Result;
+    Locals = callerLocals;
+    Current = caller;
+    return result;
+  }
+
+  void countBackedge() {
+    if (++Current->Backedges == HotBackedges)
+      promote(*Current);
+  }
+
+  // Queue the continuation of the running function from loop, which has
+  // taken HotBackedges back edges in this call
+  TieredFunction &promoteLoop(const ASTnode &loop) {
+    auto inserted = Loops.try_emplace(&loop);
+    TieredFunction &continuation = inserted.first->second;
+    if (inserted.second) {
+      continuation.Name = Current->Name + ".loop" + std::to_string(Current->NumLoops++);
+      continuation.Function = Current->Function;
+      continuation.Loop = &loop;
+      continuation.ReturnType = Current->ReturnType;
+      promote(continuation);
+    }
+    return continuation;
+  }
+
+  // Finish the running call in continuation, if it has been compiled,
+  // setting Result. False if it hasn't.
+  bool finishIn(TieredFunction &continuation) {
+    NativeThunk native = continuation.Native.load(std::memory_order_acquire);
+    if (!native)
+      return false;
+    Result.Bits = 0;
+    native(Locals, &Result);
+    return true;
+  }
+
+private:
+  void promote(TieredFunction &function) {
+    if (!function.Queued)
+      Compiler->promote(function);
+    function.Queued = true;
+  }
+
+  // There is no way on from an extern that can't be called
+  NativeThunk compileExtern(TieredFunction &function) {
+    if (!Compiler->compileNow(function)) {
+      outs().flush();
+      exit(1);
+    }
+    return function.Native.load(std::memory_order_acquire);
+  }
+};
+
+static RunValue intValue(int32_t value) {
+  RunValue result;
+  result.Bits = 0;
+  result.Int = value;
+  return result;
+}
+
+static RunValue floatValue(float value) {
+  RunValue result;
+  result.Bits = 0;
+  result.Float = value;
+  return result;
+}
+
+static RunValue boolValue(bool value) {
+  RunValue result;
+  result.Bits = 0;
+  result.Bool = value;
+  return result;
+}
+
+// As CodeGenerator::convert: bool -> int -> float
+static RunValue convertValue(RunValue value, char from, char to) {
+  if (from == to || to == 'v')
+    return value;
+  if (to == 'f')
+    return floatValue(from == 'b' ? value.Bool : value.Int);
+  return intValue(value.Bool);
+}
+
+// As CodeGenerator::toBool
+static bool truthValue(RunValue value, char type) {
+  if (type == 'b')
+    return value.Bool;
+  return type == 'f' ? value.Float != 0.0f : value.Int != 0;
+}
+
+RunValue ASTnode::evaluate(Interpreter &interp) { return intValue(0); }
+
+bool ASTnode::execute(Interpreter &interp) {
+  evaluate(interp);
+  return false;
+}
+
+RunValue IntASTnode::evaluate(Interpreter &interp) { return intValue(Val); }
+
+RunValue FloatASTnode::evaluate(Interpreter &interp) { return floatValue(Val); }
+
+RunValue BoolASTnode::evaluate(Interpreter &interp) { return boolValue(Val); }
+
+// Locals start as zero
+bool VariableASTnode::execute(Interpreter &interp) {
+  interp.Locals[Slot] = intValue(0);
+  return false;
+}
+
+RunValue VariableRefASTnode::evaluate(Interpreter &interp) {
+  return Slot >= 0 ? interp.Locals[Slot] : interp.global(Name);
+}
+
+RunValue UnaryExprASTnode::evaluate(Interpreter &interp) {
+  char type = typeCode(Operand->getExprType());
+  RunValue operand = Operand->evaluate(interp);
+  if (Opcode == "!")
+    return boolValue(!truthValue(operand, type));
+  operand = convertValue(operand, type, typeCode(ExprType));
+  if (typeCode(ExprType) == 'f')
+    return floatValue(-operand.Float);
+  return intValue(0u - uint32_t(operand.Int));
+}
+
+// Integer arithmetic wraps, as it does in the generated code
+RunValue BinaryExprASTnode::evaluate(Interpreter &interp) {
+  char op = Opcode[0], next = Opcode.size() > 1 ? Opcode[1] : 0;
+  if (op == '=' && !next) {
+    auto &var = static_cast<VariableRefASTnode &>(*LHS);
+    RunValue value = convertValue(RHS->evaluate(interp), typeCode(RHS->getExprType()),
+                                  typeCode(ExprType));
+    (var.getSlot() >= 0 ? interp.Locals[var.getSlot()] : interp.global(var.getName())) = value;
+    return value;
+  }
+
+  // && and || only evaluate the right operand when it decides the result
+  if (op == '&' || op == '|') {
+    bool lhs = truthValue(LHS->evaluate(interp), typeCode(LHS->getExprType()));
+    if (lhs == (op == '|'))
+      return boolValue(lhs);
+    return boolValue(truthValue(RHS->evaluate(interp), typeCode(RHS->getExprType())));
+  }
+
+  char lhsType = typeCode(LHS->getExprType()), rhsType = typeCode(RHS->getExprType());
+  char type = lhsType == 'f' || rhsType == 'f' ? 'f' : 'i';
+  RunValue lhs = convertValue(LHS->evaluate(interp), lhsType, type);
+  RunValue rhs = convertValue(RHS->evaluate(interp), rhsType, type);
+  if (type == 'f') {
+    float a = lhs.Float, b = rhs.Float;
+    switch (op) {
+    case '+': return floatValue(a + b);
+    case '-': return floatValue(a - b);
+    case '*': return floatValue(a * b);
+    case '/': return floatValue(a / b);
+    case '%': return floatValue(std::fmod(a, b));
+    case '=': return boolValue(a == b);
+    case '!': return boolValue(a != b);
+    case '<': return boolValue(next ? a <= b : a < b);
+    case '>': return boolValue(next ? a >= b : a > b);
+    }
+  } else {
+    int32_t a = lhs.Int, b = rhs.Int;
+    switch (op) {
+    case '+': return intValue(uint32_t(a) + uint32_t(b));
+    case '-': return intValue(uint32_t(a) - uint32_t(b));
+    case '*': return intValue(uint32_t(a) * uint32_t(b));
+    case '/': return intValue(a / b);
+    case '%': return intValue(a % b);
+    case '=': return boolValue(a == b);
+    case '!': return boolValue(a != b);
+    case '<': return boolValue(next ? a <= b : a < b);
+    case '>': return boolValue(next ? a >= b : a > b);
+    }
+  }
+  return intValue(0);
+}
+
+RunValue CallExprAST::evaluate(Interpreter &interp) {
+  TieredFunction &callee = interp.Functions.find(Callee)->second;
+  SmallVector<RunValue, 8> args;
+  for (size_t i = 0; i < Args.size(); i++)
+    args.push_back(convertValue(Args[i]->evaluate(interp), typeCode(Args[i]->getExprType()),
+                                callee.ParamTypes[i]));
+  return interp.call(callee, args.data());
+}
+
+bool IfExprAST::execute(Interpreter &interp) {
+  if (truthValue(Cond->evaluate(interp), typeCode(Cond->getExprType())))
+    return Then->execute(interp);
+  return Else && Else->execute(interp);
+}
+
+// A loop that gets hot in this call finishes it in its continuation, from
+// the first back edge after that is compiled
+bool WhileExprAST::execute(Interpreter &interp) {
+  unsigned backedges = 0;
+  TieredFunction *continuation = nullptr;
+  while (truthValue(Cond->evaluate(interp), typeCode(Cond->getExprType()))) {
+    if (Then->execute(interp))
+      return true;
+    if (++backedges == HotBackedges)
+      continuation = &interp.promoteLoop(*this);
+    interp.countBackedge();
+    if (continuation && interp.finishIn(*continuation))
+      return true;
+  }
+  return false;
+}
+
+// Falling off the end of a function leaves Result zero
+bool ReturnExprAST::execute(Interpreter &interp) {
+  if (ReturnExpr)
+    interp.Result = convertValue(ReturnExpr->evaluate(interp),
+                                 typeCode(ReturnExpr->getExprType()), interp.Current->ReturnType);
+  return true;
+}
+
+bool BlockASTnode::execute(Interpreter &interp) {
+  for (auto &decl : localDecls)
+    decl->execute(interp);
+  for (auto &stmt : stmtList)
+    if (stmt->execute(interp))
+      return true;
+  return false;
+}
+
+// Run entry in the interpreter, compiling its hot functions as it goes
+static bool runTiered(CompilerSession &session, FunctionAST &entry, RunValue *args,
+                      RunValue &result, RunTimes &times) {
+  ModuleDeclarations decls;
+  session.Root->collectDeclarations(decls);
+  Interpreter interp(decls);
+  mccomp::SymbolMap symbols = runtimeSymbols();
+  for (auto &global : interp.Globals)
+    symbols[global.first().str()] = &global.second;
+  TierCompiler compiler(session, decls, std::move(symbols));
+  interp.Compiler = &compiler;
+  times.Compiled = times.Loaded = RunTimes::Clock::now();
+
+  TieredFunction &function = interp.Functions.find(entry.getProto().getName())->second;
+  for (unsigned i = 0; i < session.Options.Repeat; i++)
+    result = interp.call(function, args);
+  times.Finished = RunTimes::Clock::now();
+  compiler.stop();
+  errs() << "Promoted: "
+         << (compiler.Promoted.empty() ? "none" : join(compiler.Promoted, ", ")) << "\n";
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Bytecode VM
+//===----------------------------------------------------------------------===//
+
+// With -vm, --run compiles the checked AST to a register bytecode and runs
+// that in a VM, so a program starts with no JIT, TargetMachine or module,
+// for hosts where starting LLVM costs too much or isn't allowed. A function
+// has a frame of registers: its locals in the slots check() gave them,
+// parameters first, then temporaries. A call's arguments are evaluated into
+// consecutive registers at the top of the caller's frame and the callee's
+// frame starts at the first of them, so they are never copied.
+//
+// Opcodes are typed, so the VM never looks at a type at run time, and with
+// GCC or Clang they are dispatched by computed goto, each handler ending in
+// its own indirect jump for the branch predictor to learn. Superinstructions
+// cover the commonest pairs: an int comparison feeding a branch, against a
+// register or a constant, and adding a constant, as in x = x + 1.
+//
+// Externs are bound when the program is loaded, to the runtime functions
+// --run gives or else to the symbols of this process. Each is called
+// through a stub instantiated for its exact signature, which unpacks the
+// argument registers and calls the extern as a function of that type. There
+// are stubs for every return type and every list of up to MaxExternParams
+// (4) int, float or bool parameters; a program calling an extern with more
+// is refused when it is loaded, before anything runs.
+
+#define MCCOMP_OPCODES(X)                                                                   \
+  X(Move) X(Const) X(GlobalLoad) X(GlobalStore)                                             \
+  X(AddI) X(SubI) X(MulI) X(DivI) X(RemI) X(NegI) X(AddIK)                                   \
+  X(AddF) X(SubF) X(MulF) X(DivF) X(RemF) X(NegF) X(AddFK)                                   \
+  X(EqI) X(NeI) X(LtI) X(LeI) X(GtI) X(GeI)                                                 \
+  X(EqF) X(NeF) X(LtF) X(LeF) X(GtF) X(GeF)                                                 \
+  X(Not) X(IntToFloat) X(BoolToInt) X(BoolToFloat)                                           \
+  X(Jump) X(JumpIfTrue) X(JumpIfFalse)                                                       \
+  X(JumpEqI) X(JumpNeI) X(JumpLtI) X(JumpLeI) X(JumpGtI) X(JumpGeI)                         \
+  X(JumpEqIK) X(JumpNeIK) X(JumpLtIK) X(JumpLeIK) X(JumpGtIK) X(JumpGeIK)                   \
+  X(Call) X(CallExtern) X(Return) X(ReturnVoid)
+
+enum class BytecodeOp : uint32_t {
+#define MCCOMP_OPCODE(name) name,
+  MCCOMP_OPCODES(MCCOMP_OPCODE)
+#undef MCCOMP_OPCODE
+};
+
+/// BytecodeInstruction - an opcode and three operands. A is the register
+/// written, or read by a jump or return; B and C are registers read, except
+/// that a K opcode's constant is B for a jump and C otherwise, a jump's
+/// target is C, and a call's callee is B and its first argument is C.
+struct BytecodeInstruction {
+  BytecodeOp Op;
+  int32_t A = 0, B = 0, C = 0;
+};
+
+struct BytecodeFunction {
+  std::string Name;
+  unsigned Entry = 0;        // the index of its first instruction
+  unsigned NumParams = 0;
+  unsigned NumRegisters = 0; // locals, then temporaries
+};
+
+// Calls the function at address with args, through a pointer of its real
+// type, and returns what it returns
+typedef RunValue (*ExternStub)(void *address, const RunValue *args);
+
+struct BytecodeExtern {
+  std::string Name;
+  std::string ParamTypes; // a typeCode() for each parameter
+  char ReturnType = 'v';
+  void *Address = nullptr;   // set by bindExterns()
+  ExternStub Stub = nullptr; // likewise
+};
+
+/// BytecodeProgram - the code of every function in a source, and the
+/// globals and externs it refers to by index
+struct BytecodeProgram {
+  std::vector<BytecodeInstruction> Code;
+  std::vector<BytecodeFunction> Functions;
+  std::vector<BytecodeExtern> Externs; // those that are called
+  std::map<std::string, unsigned> FunctionIndex;
+  std::map<std::string, unsigned> GlobalIndex;
+
+  bool bindExterns(raw_ostream &diags);
+};
+
+// Externs are called through a stub instantiated for their signature, so
+// there is one for each return type and list of up to MaxExternParams
+// parameter types.
+static const unsigned MaxExternParams = 4;
+
+template <typename T> T externArg(const RunValue &value);
+template <> int32_t externArg<int32_t>(const RunValue &value) { return value.Int; }
+template <> float externArg<float>(const RunValue &value) { return value.Float; }
+template <> bool externArg<bool>(const RunValue &value) { return value.Bool; }
+
+static void setExternResult(RunValue &result, int32_t value) { result.Int = value; }
+static void setExternResult(RunValue &result, float value) { result.Float = value; }
+static void setExternResult(RunValue &result, bool value) { result.Bool = value; }
+
+template <typename Result, typename... Params, size_t... I>
+static RunValue callExternAs(void *address, const RunValue *args, std::index_sequence<I...>) {
+  auto function = reinterpret_cast<Result (*)(Params...)>(address);
+  RunValue result;
+  result.Bits = 0;
+  if constexpr (std::is_void_v<Result>)
+    function(externArg<Params>(args[I])...);
+  else
+    setExternResult(result, function(externArg<Params>(args[I])...));
+  return result;
+}
+
+template <typename Result, typename... Params>
+static RunValue externStub(void *address, const RunValue *args) {
+  return callExternAs<Result, Params...>(address, args, std::index_sequence_for<Params...>());
+}
+
+// The stub for a function returning Result whose parameters are Params and
+// then those in types, or null if there are too many
+template <typename Result, typename... Params>
+static ExternStub findExternStub(StringRef types) {
+  if (types.empty())
+    return externStub<Result, Params...>;
+  if constexpr (sizeof...(Params) < MaxExternParams) {
+    switch (types.front()) {
+    case 'f':
+      return findExternStub<Result, Params..., float>(types.drop_front());
+    case 'b':
+      return findExternStub<Result, Params..., bool>(types.drop_front());
+    default:
+      return findExternStub<Result, Params..., int32_t>(types.drop_front());
+    }
+  }
+  return nullptr;
+}
+
+static ExternStub findExternStub(const BytecodeExtern &callee) {
+  switch (callee.ReturnType) {
+  case 'f':
+    return findExternStub<float>(callee.ParamTypes);
+  case 'b':
+    return findExternStub<bool>(callee.ParamTypes);
+  case 'v':
+    return findExternStub<void>(callee.ParamTypes);
+  default:
+    return findExternStub<int32_t>(callee.ParamTypes);
+  }
+}
+
+bool BytecodeProgram::bindExterns(raw_ostream &diags) {
+  sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  for (BytecodeExtern &callee : Externs) {
+    callee.Stub = findExternStub(callee);
+    if (!callee.Stub) {
+      diags << "The VM can't call " << callee.Name << ": it takes more than "
+            << MaxExternParams << " arguments\n";
+      return false;
+    }
+    auto runtime = runtimeSymbols().find(callee.Name);
+    callee.Address = runtime != runtimeSymbols().end()
+                         ? runtime->second
+                         : sys::DynamicLibrary::SearchForAddressOfSymbol(callee.Name);
+    if (!callee.Address) {
+      diags << "Symbol not found: " << callee.Name << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/// BytecodeLabel - a place in the code that jumps go to
+struct BytecodeLabel {
+  int Position = -1;         // -1 until it is placed
+  std::vector<size_t> Jumps; // to patch when it is
+};
+
+/// BytecodeCompiler - generates the bytecode for a program one function at
+/// a time, through ASTnode::emit()
+class BytecodeCompiler {
+public:
+  BytecodeProgram &Program;
+  const ModuleDeclarations &Decls;
+  int NumLocals = 0;    // of the function being compiled
+  int Top = 0;          // the first free register
+  int NumRegisters = 0; // the most in use at once
+  char ReturnType = 'v';
+  size_t LastLabel = 0; // where a label was last placed
+
+  BytecodeCompiler(BytecodeProgram &program, const ModuleDeclarations &decls)
+      : Program(program), Decls(decls) {
+    for (FunctionAST *function : decls.Functions) {
+      Program.FunctionIndex[function->getProto().getName()] = Program.Functions.size();
+      Program.Functions.push_back({function->getProto().getName()});
+    }
+    for (auto &global : decls.Globals) {
+      unsigned index = Program.GlobalIndex.size();
+      Program.GlobalIndex[global.first] = index;
+    }
+  }
+
+  void compileFunction(FunctionAST &function) {
+    BytecodeFunction &compiled = Program.Functions[Program.FunctionIndex.at(
+        function.getProto().getName())];
+    compiled.Entry = Program.Code.size();
+    NumLocals = Top = NumRegisters = function.getNumLocals();
+    ReturnType = typeCode(function.getProto().getType());
+    compiled.NumParams = paramTypes(function.getProto()).size();
+    function.getBody().emit(*this, -1);
+    // falling off the end returns zero
+    if (ReturnType == 'v')
+      add(BytecodeOp::ReturnVoid);
+    else
+      add(BytecodeOp::Return, emitConstant(0, -1));
+    compiled.NumRegisters = NumRegisters;
+  }
+
+  // Temporaries live no longer than the statement that made them
+  void startStatement() { Top = NumLocals; }
+
+  int temp() {
+    NumRegisters = std::max(NumRegisters, Top + 1);
+    return Top++;
+  }
+
+  int target(int dest) { return dest >= 0 ? dest : temp(); }
+
+  void add(BytecodeOp op, int a = 0, int b = 0, int c = 0) {
+    Program.Code.push_back({op, a, b, c});
+  }
+
+  void jump(BytecodeOp op, int a, int b, BytecodeLabel &label) {
+    if (label.Position < 0)
+      label.Jumps.push_back(Program.Code.size());
+    add(op, a, b, label.Position);
+  }
+
+  void place(BytecodeLabel &label) {
+    label.Position = LastLabel = Program.Code.size();
+    for (size_t jump : label.Jumps)
+      Program.Code[jump].C = label.Position;
+  }
+
+  int emitConstant(uint32_t bits, int dest) {
+    dest = target(dest);
+    add(BytecodeOp::Const, dest, bits);
+    return dest;
+  }
+
+  int emitMove(int reg, int dest) {
+    if (dest < 0 || dest == reg)
+      return reg;
+    add(BytecodeOp::Move, dest, reg);
+    return dest;
+  }
+
+  // True if the last instruction is the only one to set reg: no label has
+  // been placed after it, so no path skips it
+  bool lastSets(int reg) const {
+    return !Program.Code.empty() && LastLabel < Program.Code.size() &&
+           Program.Code.back().A == reg;
+  }
+
+  // If the code since start is a constant loaded into reg, a temporary,
+  // take it out and return true, for an instruction with a K operand
+  bool takeConstant(size_t start, int reg, int32_t &value) {
+    if (Program.Code.size() != start + 1 || reg != Top - 1 || LastLabel > start ||
+        Program.Code.back().Op != BytecodeOp::Const || Program.Code.back().A != reg)
+      return false;
+    value = Program.Code.back().B;
+    Program.Code.pop_back();
+    Top--;
+    return true;
+  }
+
+  // The value in reg, of type from, as type to, in dest if that is not -1
+  int emitConvert(int reg, char from, char to, int dest) {
+    if (from == to || to == 'v')
+      return emitMove(reg, dest);
+    if (lastSets(reg) && Program.Code.back().Op == BytecodeOp::Const && reg >= NumLocals) {
+      // a constant is converted here and now
+      BytecodeInstruction &last = Program.Code.back();
+      RunValue value;
+      value.Bits = uint32_t(last.B);
+      value = convertValue(value, from, to);
+      last.B = int32_t(value.Bits);
+      if (dest >= 0)
+        last.A = dest;
+      return last.A;
+    }
+    dest = target(dest);
+    if (to == 'f')
+      add(from == 'b' ? BytecodeOp::BoolToFloat : BytecodeOp::IntToFloat, dest, reg);
+    else
+      add(BytecodeOp::BoolToInt, dest, reg);
+    return dest;
+  }
+
+  // The value of node, converted to type to
+  int emitValue(ASTnode &node, char to, int dest) {
+    char from = typeCode(node.getExprType());
+    if (from == to || to == 'v')
+      return node.emit(*this, dest);
+    return emitConvert(node.emit(*this, -1), from, to, dest);
+  }
+
+  // The value in reg, of type type, as a bool
+  int emitTruth(int reg, char type, int dest) {
+    if (type == 'b')
+      return emitMove(reg, dest);
+    int zero = emitConstant(0, -1);
+    dest = target(dest);
+    add(type == 'f' ? BytecodeOp::NeF : BytecodeOp::NeI, dest, reg, zero);
+    return dest;
+  }
+
+  // A left operand in a local that the right operand may assign to is
+  // copied first, as LLVM would read it first
+  int protect(int reg, ASTnode &rhs) {
+    if (reg < NumLocals && rhs.writesLocal())
+      return emitMove(reg, temp());
+    return reg;
+  }
+
+  int emitCall(const std::string &name, int dest, int first) {
+    auto function = Program.FunctionIndex.find(name);
+    if (function != Program.FunctionIndex.end()) {
+      add(BytecodeOp::Call, dest, function->second, first);
+      return dest;
+    }
+    auto known = ExternIndex.find(name);
+    if (known == ExternIndex.end()) {
+      const PrototypeAST &proto = *Decls.Prototypes.at(name);
+      BytecodeExtern callee;
+      callee.Name = name;
+      for (const std::string &type : paramTypes(proto))
+        callee.ParamTypes += typeCode(type);
+      callee.ReturnType = typeCode(proto.getType());
+      known = ExternIndex.insert({name, Program.Externs.size()}).first;
+      Program.Externs.push_back(callee);
+    }
+    add(BytecodeOp::CallExtern, dest, known->second, first);
+    return dest;
+  }
+
+  std::string paramCodes(const std::string &name) const {
+    std::string codes;
+    for (const std::string &type : paramTypes(*Decls.Prototypes.at(name)))
+      codes += typeCode(type);
+    return codes;
+  }
+
+private:
+  std::map<std::string, unsigned> ExternIndex;
+};
+
+static uint32_t floatBits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+int ASTnode::emit(BytecodeCompiler &bc, int dest) { return dest; }
+
+void ASTnode::emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) {
+  char type = typeCode(ExprType);
+  int reg = emit(bc, -1);
+  if (type == 'i') {
+    bc.jump(when ? BytecodeOp::JumpNeIK : BytecodeOp::JumpEqIK, reg, 0, target);
+    return;
+  }
+  reg = bc.emitTruth(reg, type, -1);
+  bc.jump(when ? BytecodeOp::JumpIfTrue : BytecodeOp::JumpIfFalse, reg, 0, target);
+}
+
+int IntASTnode::emit(BytecodeCompiler &bc, int dest) { return bc.emitConstant(Val, dest); }
+
+int FloatASTnode::emit(BytecodeCompiler &bc, int dest) {
+  return bc.emitConstant(floatBits(Val), dest);
+}
+
+int BoolASTnode::emit(BytecodeCompiler &bc, int dest) { return bc.emitConstant(Val, dest); }
+
+void BoolASTnode::emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) {
+  if (Val == when)
+    bc.jump(BytecodeOp::Jump, 0, 0, target);
+}
+
+// Locals start as zero
+int VariableASTnode::emit(BytecodeCompiler &bc, int dest) {
+  bc.emitConstant(0, Slot);
+  return -1;
+}
+
+int VariableRefASTnode::emit(BytecodeCompiler &bc, int dest) {
+  if (Slot >= 0)
+    return bc.emitMove(Slot, dest);
+  dest = bc.target(dest);
+  bc.add(BytecodeOp::GlobalLoad, dest, bc.Program.GlobalIndex.at(Name));
+  return dest;
+}
+
+int UnaryExprASTnode::emit(BytecodeCompiler &bc, int dest) {
+  if (Opcode == "!") {
+    int operand = bc.emitTruth(Operand->emit(bc, -1), typeCode(Operand->getExprType()), -1);
+    dest = bc.target(dest);
+    bc.add(BytecodeOp::Not, dest, operand);
+    return dest;
+  }
+  char type = typeCode(ExprType);
+  int operand = bc.emitValue(*Operand, type, -1);
+  dest = bc.target(dest);
+  bc.add(type == 'f' ? BytecodeOp::NegF : BytecodeOp::NegI, dest, operand);
+  return dest;
+}
+
+void UnaryExprASTnode::emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) {
+  if (Opcode == "!")
+    Operand->emitBranch(bc, !when, target);
+  else
+    ASTnode::emitBranch(bc, when, target);
+}
+
+// The opcode for a comparison or arithmetic operator on type ('i' or 'f')
+static BytecodeOp binaryOp(const std::string &opcode, char type) {
+  static const std::map<std::string, BytecodeOp> ints = {
+      {"+", BytecodeOp::AddI}, {"-", BytecodeOp::SubI}, {"*", BytecodeOp::MulI},
+      {"/", BytecodeOp::DivI}, {"%", BytecodeOp::RemI}, {"==", BytecodeOp::EqI},
+      {"!=", BytecodeOp::NeI}, {"<", BytecodeOp::LtI},  {"<=", BytecodeOp::LeI},
+      {">", BytecodeOp::GtI},  {">=", BytecodeOp::GeI}};
+  static const std::map<std::string, BytecodeOp> floats = {
+      {"+", BytecodeOp::AddF}, {"-", BytecodeOp::SubF}, {"*", BytecodeOp::MulF},
+      {"/", BytecodeOp::DivF}, {"%", BytecodeOp::RemF}, {"==", BytecodeOp::EqF},
+      {"!=", BytecodeOp::NeF}, {"<", BytecodeOp::LtF},  {"<=", BytecodeOp::LeF},
+      {">", BytecodeOp::GtF},  {">=", BytecodeOp::GeF}};
+  return (type == 'f' ? floats : ints).at(opcode);
+}
+
+// The compare-and-branch for an int comparison, jumping if it is when
+static BytecodeOp branchOp(const std::string &opcode, bool when, bool constant) {
+  static const std::map<std::string, std::string> negated = {
+      {"==", "!="}, {"!=", "=="}, {"<", ">="}, {">=", "<"}, {">", "<="}, {"<=", ">"}};
+  static const std::map<std::string, std::pair<BytecodeOp, BytecodeOp>> ops = {
+      {"==", {BytecodeOp::JumpEqI, BytecodeOp::JumpEqIK}},
+      {"!=", {BytecodeOp::JumpNeI, BytecodeOp::JumpNeIK}},
+      {"<", {BytecodeOp::JumpLtI, BytecodeOp::JumpLtIK}},
+      {"<=", {BytecodeOp::JumpLeI, BytecodeOp::JumpLeIK}},
+      {">", {BytecodeOp::JumpGtI, BytecodeOp::JumpGtIK}},
+      {">=", {BytecodeOp::JumpGeI, BytecodeOp::JumpGeIK}}};
+  auto op = ops.at(when ? opcode : negated.at(opcode));
+  return constant ? op.second : op.first;
+}
+
+static bool isComparison(const std::string &opcode) {
+  return opcode == "==" || opcode == "!=" || opcode == "<" || opcode == "<=" ||
+         opcode == ">" || opcode == ">=";
+}
+
+int BinaryExprASTnode::emit(BytecodeCompiler &bc, int dest) {
+  char type = typeCode(ExprType);
+  if (Opcode == "=") {
+    auto &var = static_cast<VariableRefASTnode &>(*LHS);
+    if (var.getSlot() >= 0)
+      return bc.emitMove(bc.emitValue(*RHS, type, var.getSlot()), dest);
+    int value = bc.emitValue(*RHS, type, dest);
+    bc.add(BytecodeOp::GlobalStore, bc.Program.GlobalIndex.at(var.getName()), value);
+    return value;
+  }
+
+  if (Opcode == "&&" || Opcode == "||") {
+    BytecodeLabel isFalse, end;
+    emitBranch(bc, false, isFalse);
+    dest = bc.target(dest);
+    bc.emitConstant(1, dest);
+    bc.jump(BytecodeOp::Jump, 0, 0, end);
+    bc.place(isFalse);
+    bc.emitConstant(0, dest);
+    bc.place(end);
+    return dest;
+  }
+
+  // comparisons are done as float if either side is, and as int otherwise
+  if (isComparison(Opcode))
+    type = LHS->getExprType() == "float" || RHS->getExprType() == "float" ? 'f' : 'i';
+  size_t start = bc.Program.Code.size();
+  int lhs = bc.protect(bc.emitValue(*LHS, type, -1), *RHS);
+  size_t middle = bc.Program.Code.size();
+  int rhs = bc.emitValue(*RHS, type, -1);
+
+  // x + c and x - c, and c + x when x needs no code
+  int32_t constant;
+  if ((Opcode == "+" || Opcode == "-") && bc.takeConstant(middle, rhs, constant)) {
+    if (Opcode == "-")
+      constant = type == 'f' ? int32_t(uint32_t(constant) ^ 0x80000000u)
+                             : int32_t(0u - uint32_t(constant));
+    dest = bc.target(dest);
+    bc.add(type == 'f' ? BytecodeOp::AddFK : BytecodeOp::AddIK, dest, lhs, constant);
+    return dest;
+  }
+  if (Opcode == "+" && bc.Program.Code.size() == middle && lhs >= bc.NumLocals &&
+      bc.takeConstant(start, lhs, constant)) {
+    dest = bc.target(dest);
+    bc.add(type == 'f' ? BytecodeOp::AddFK : BytecodeOp::AddIK, dest, rhs, constant);
+    return dest;
+  }
+  dest = bc.target(dest);
+  bc.add(binaryOp(Opcode, type), dest, lhs, rhs);
+  return dest;
+}
+
+void BinaryExprASTnode::emitBranch(BytecodeCompiler &bc, bool when, BytecodeLabel &target) {
+  // a && b jumps if both are true, or if either is false, and || the reverse
+  if (Opcode == "&&" || Opcode == "||") {
+    if (when == (Opcode == "||")) {
+      LHS->emitBranch(bc, when, target);
+      RHS->emitBranch(bc, when, target);
+    } else {
+      BytecodeLabel skip;
+      LHS->emitBranch(bc, !when, skip);
+      RHS->emitBranch(bc, when, target);
+      bc.place(skip);
+    }
+    return;
+  }
+  if (!isComparison(Opcode) || LHS->getExprType() == "float" ||
+      RHS->getExprType() == "float") {
+    ASTnode::emitBranch(bc, when, target);
+    return;
+  }
+  int lhs = bc.protect(bc.emitValue(*LHS, 'i', -1), *RHS);
+  size_t middle = bc.Program.Code.size();
+  int rhs = bc.emitValue(*RHS, 'i', -1);
+  int32_t constant;
+  if (bc.takeConstant(middle, rhs, constant))
+    bc.jump(branchOp(Opcode, when, true), lhs, constant, target);
+  else
+    bc.jump(branchOp(Opcode, when, false), lhs, rhs, target);
+}
+
+bool BinaryExprASTnode::writesLocal() const {
+  if (Opcode == "=" && static_cast<VariableRefASTnode &>(*LHS).getSlot() >= 0)
+    return true;
+  return LHS->writesLocal() || RHS->writesLocal();
+}
+
+int CallExprAST::emit(BytecodeCompiler &bc, int dest) {
+  // the result register comes first, so the arguments are on top
+  dest = bc.target(dest);
+  int first = bc.Top;
+  for (size_t i = 0; i < Args.size(); i++)
+    bc.temp();
+  std::string params = bc.paramCodes(Callee);
+  for (size_t i = 0; i < Args.size(); i++)
+    bc.emitValue(*Args[i], params[i], first + i);
+  return bc.emitCall(Callee, dest, first);
+}
+
+bool CallExprAST::writesLocal() const {
+  for (auto &arg : Args)
+    if (arg->writesLocal())
+      return true;
+  return false;
+}
+
+int IfExprAST::emit(BytecodeCompiler &bc, int dest) {
+  BytecodeLabel otherwise, end;
+  Cond->emitBranch(bc, false, otherwise);
+  Then->emit(bc, -1);
+  if (Else) {
+    bc.jump(BytecodeOp::Jump, 0, 0, end);
+    bc.place(otherwise);
+    Else->emit(bc, -1);
+    bc.place(end);
+  } else {
+    bc.place(otherwise);
+  }
+  return -1;
+}
+
+// The condition goes after the body, so a loop takes one branch a trip
+int WhileExprAST::emit(BytecodeCompiler &bc, int dest) {
+  BytecodeLabel body, cond;
+  bc.jump(BytecodeOp::Jump, 0, 0, cond);
+  bc.place(body);
+  Then->emit(bc, -1);
+  bc.place(cond);
+  bc.startStatement();
+  Cond->emitBranch(bc, true, body);
+  return -1;
+}
+
+int ReturnExprAST::emit(BytecodeCompiler &bc, int dest) {
+  if (ReturnExpr)
+    bc.add(BytecodeOp::Return, bc.emitValue(*ReturnExpr, bc.ReturnType, -1));
+  else
+    bc.add(BytecodeOp::ReturnVoid);
+  return -1;
+}
+
+int BlockASTnode::emit(BytecodeCompiler &bc, int dest) {
+  for (auto &decl : localDecls)
+    decl->emit(bc, -1);
+  for (auto &stmt : stmtList) {
+    bc.startStatement();
+    stmt->emit(bc, -1);
+  }
+  return -1;
+}
+
+#if defined(__GNUC__)
+#define MCCOMP_COMPUTED_GOTO
+#endif
+
+/// VirtualMachine - runs a BytecodeProgram. Frames are kept in one array of
+/// registers, allocated up front and only touched as deep as calls go.
+class VirtualMachine {
+public:
+  static const size_t StackSize = 1 << 20; // registers
+
+  explicit VirtualMachine(const BytecodeProgram &program)
+      : Program(program), Globals(program.GlobalIndex.size()),
+        Stack(new RunValue[StackSize]) {
+    for (RunValue &global : Globals)
+      global.Bits = 0;
+  }
+
+  // Call function with args, which it has the right number of
+  bool run(unsigned function, const RunValue *args, RunValue &result);
+
+private:
+  struct Frame {
+    const BytecodeInstruction *Call; // in the caller, which has the result register
+    RunValue *Registers;             // the caller's
+  };
+
+  const BytecodeProgram &Program;
+  std::vector<RunValue> Globals;
+  std::unique_ptr<RunValue[]> Stack;
+  std::vector<Frame> Frames;
+
+  bool overflow(const BytecodeFunction &function) {
+    errs() << "The VM ran out of registers calling " << function.Name << "\n";
+    return false;
+  }
+};
+
+bool VirtualMachine::run(unsigned function, const RunValue *args, RunValue &result) {
+  const BytecodeInstruction *code = Program.Code.data();
+  const BytecodeFunction *functions = Program.Functions.data();
+  const BytecodeFunction &entry = functions[function];
+  RunValue *globals = Globals.data();
+  RunValue *end = Stack.get() + StackSize;
+  if (entry.NumRegisters > StackSize)
+    return overflow(entry);
+  RunValue *R = Stack.get();
+  std::copy(args, args + entry.NumParams, R);
+  const BytecodeInstruction *pc = code + entry.Entry;
+  Frames.clear();
+  Frames.reserve(64);
+
+#ifdef MCCOMP_COMPUTED_GOTO
+  static const void *const labels[] = {
+#define MCCOMP_OPCODE(name) &&Op##name,
+      MCCOMP_OPCODES(MCCOMP_OPCODE)
+#undef MCCOMP_OPCODE
+  };
+#define CASE(name) Op##name:
+#define DISPATCH() goto *labels[uint32_t(pc->Op)]
+  DISPATCH();
+#else
+#define CASE(name) case BytecodeOp::name:
+#define DISPATCH() continue
+  for (;;)
+    switch (pc->Op) {
+#endif
+
+  CASE(Move) R[pc->A] = R[pc->B]; ++pc; DISPATCH();
+  CASE(Const) R[pc->A].Bits = uint32_t(pc->B); ++pc; DISPATCH();
+  CASE(GlobalLoad) R[pc->A] = globals[pc->B]; ++pc; DISPATCH();
+  CASE(GlobalStore) globals[pc->A] = R[pc->B]; ++pc; DISPATCH();
+
+  // int arithmetic wraps, as it does in the generated code
+  CASE(AddI) R[pc->A].Int = uint32_t(R[pc->B].Int) + uint32_t(R[pc->C].Int); ++pc; DISPATCH();
+  CASE(SubI) R[pc->A].Int = uint32_t(R[pc->B].Int) - uint32_t(R[pc->C].Int); ++pc; DISPATCH();
+  CASE(MulI) R[pc->A].Int = uint32_t(R[pc->B].Int) * uint32_t(R[pc->C].Int); ++pc; DISPATCH();
+  CASE(DivI) R[pc->A].Int = R[pc->B].Int / R[pc->C].Int; ++pc; DISPATCH();
+  CASE(RemI) R[pc->A].Int = R[pc->B].Int % R[pc->C].Int; ++pc; DISPATCH();
+  CASE(NegI) R[pc->A].Int = 0u - uint32_t(R[pc->B].Int); ++pc; DISPATCH();
+  CASE(AddIK) R[pc->A].Int = uint32_t(R[pc->B].Int) + uint32_t(pc->C); ++pc; DISPATCH();
+
+  CASE(AddF) R[pc->A].Float = R[pc->B].Float + R[pc->C].Float; ++pc; DISPATCH();
+  CASE(SubF) R[pc->A].Float = R[pc->B].Float - R[pc->C].Float; ++pc; DISPATCH();
+  CASE(MulF) R[pc->A].Float = R[pc->B].Float * R[pc->C].Float; ++pc; DISPATCH();
+  CASE(DivF) R[pc->A].Float = R[pc->B].Float / R[pc->C].Float; ++pc; DISPATCH();
+  CASE(RemF) R[pc->A].Float = std::fmod(R[pc->B].Float, R[pc->C].Float); ++pc; DISPATCH();
+  CASE(NegF) R[pc->A].Float = -R[pc->B].Float; ++pc; DISPATCH();
+  CASE(AddFK) {
+    float constant;
+    memcpy(&constant, &pc->C, sizeof(constant));
+    R[pc->A].Float = R[pc->B].Float + constant;
+    ++pc;
+    DISPATCH();
+  }
+
+  CASE(EqI) R[pc->A].Bool = R[pc->B].Int == R[pc->C].Int; ++pc; DISPATCH();
+  CASE(NeI) R[pc->A].Bool = R[pc->B].Int != R[pc->C].Int; ++pc; DISPATCH();
+  CASE(LtI) R[pc->A].Bool = R[pc->B].Int < R[pc->C].Int; ++pc; DISPATCH();
+  CASE(LeI) R[pc->A].Bool = R[pc->B].Int <= R[pc->C].Int; ++pc; DISPATCH();
+  CASE(GtI) R[pc->A].Bool = R[pc->B].Int > R[pc->C].Int; ++pc; DISPATCH();
+  CASE(GeI) R[pc->A].Bool = R[pc->B].Int >= R[pc->C].Int; ++pc; DISPATCH();
+  CASE(EqF) R[pc->A].Bool = R[pc->B].Float == R[pc->C].Float; ++pc; DISPATCH();
+  CASE(NeF) R[pc->A].Bool = R[pc->B].Float != R[pc->C].Float; ++pc; DISPATCH();
+  CASE(LtF) R[pc->A].Bool = R[pc->B].Float < R[pc->C].Float; ++pc; DISPATCH();
+  CASE(LeF) R[pc->A].Bool = R[pc->B].Float <= R[pc->C].Float; ++pc; DISPATCH();
+  CASE(GtF) R[pc->A].Bool = R[pc->B].Float > R[pc->C].Float; ++pc; DISPATCH();
+  CASE(GeF) R[pc->A].Bool = R[pc->B].Float >= R[pc->C].Float; ++pc; DISPATCH();
+
+  CASE(Not) R[pc->A].Bool = !R[pc->B].Bool; ++pc; DISPATCH();
+  CASE(IntToFloat) R[pc->A].Float = R[pc->B].Int; ++pc; DISPATCH();
+  CASE(BoolToInt) R[pc->A].Int = R[pc->B].Bool; ++pc; DISPATCH();
+  CASE(BoolToFloat) R[pc->A].Float = R[pc->B].Bool; ++pc; DISPATCH();
+
+  CASE(Jump) pc = code + pc->C; DISPATCH();
+  CASE(JumpIfTrue) pc = R[pc->A].Bool ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpIfFalse) pc = R[pc->A].Bool ? pc + 1 : code + pc->C; DISPATCH();
+  CASE(JumpEqI) pc = R[pc->A].Int == R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpNeI) pc = R[pc->A].Int != R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpLtI) pc = R[pc->A].Int < R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpLeI) pc = R[pc->A].Int <= R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpGtI) pc = R[pc->A].Int > R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpGeI) pc = R[pc->A].Int >= R[pc->B].Int ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpEqIK) pc = R[pc->A].Int == pc->B ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpNeIK) pc = R[pc->A].Int != pc->B ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpLtIK) pc = R[pc->A].Int < pc->B ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpLeIK) pc = R[pc->A].Int <= pc->B ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpGtIK) pc = R[pc->A].Int > pc->B ? code + pc->C : pc + 1; DISPATCH();
+  CASE(JumpGeIK) pc = R[pc->A].Int >= pc->B ? code + pc->C : pc + 1; DISPATCH();
+
+  CASE(Call) {
+    const BytecodeFunction &callee = functions[pc->B];
+    RunValue *registers = R + pc->C;
+    if (registers + callee.NumRegisters > end)
+      return overflow(callee);
+    Frames.push_back({pc, R});
+    R = registers;
+    pc = code + callee.Entry;
+    DISPATCH();
+  }
+  CASE(CallExtern) {
+    const BytecodeExtern &callee = Program.Externs[pc->B];
+    R[pc->A] = callee.Stub(callee.Address, R + pc->C);
+    ++pc;
+    DISPATCH();
+  }
+  CASE(Return) {
+    RunValue value = R[pc->A];
+    if (Frames.empty()) {
+      result = value;
+      return true;
+    }
+    pc = Frames.back().Call;
+    R = Frames.back().Registers;
+    Frames.pop_back();
+    R[pc->A] = value;
+    ++pc;
+    DISPATCH();
+  }
+  CASE(ReturnVoid) {
+    if (Frames.empty())
+      return true;
+    pc = Frames.back().Call + 1;
+    R = Frames.back().Registers;
+    Frames.pop_back();
+    DISPATCH();
+  }
+#ifndef MCCOMP_COMPUTED_GOTO
+    }
+#endif
+#undef CASE
+#undef DISPATCH
+}
+
+// Run entry in the bytecode VM
+static bool runBytecode(CompilerSession &session, FunctionAST &entry, RunValue *args,
+                        RunValue &result, RunTimes &times) {
+  ModuleDeclarations decls;
+  session.Root->collectDeclarations(decls);
+  BytecodeProgram program;
+  BytecodeCompiler compiler(program, decls);
+  for (FunctionAST *function : decls.Functions)
+    compiler.compileFunction(*function);
+  times.Compiled = RunTimes::Clock::now();
+  if (!program.bindExterns(errs()))
+    return false;
+  VirtualMachine vm(program);
+  times.Loaded = RunTimes::Clock::now();
+
+  unsigned function = program.FunctionIndex.at(entry.getProto().getName());
+  for (unsigned i = 0; i < session.Options.Repeat; i++)
+    if (!vm.run(function, args, result))
+      return false;
+  times.Finished = RunTimes::Clock::now();
+  errs() << "Bytecode: " << program.Code.size() << " instructions\n";
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Run Driver
+//===----------------------------------------------------------------------===//
+
+static int runProgram(const CompileRequest &request) {
+  RunTimes times;
+
+  // Entry, then the options and input file, then the entry point's arguments
+  const std::vector<std::string> &args = request.Args;
+  CompileRequest compile;
+  compile.WorkingDir = request.WorkingDir;
+  size_t next = 1;
+  while (next < args.size() && StringRef(args[next]).starts_with("-") && args[next] != "-") {
+    if ((args[next] == "-o" || args[next] == "-cache-dir" || args[next] == "-cache-size" ||
+         args[next] == "-repeat") &&
+        next + 1 < args.size())
+      compile.Args.push_back(args[next++]);
+    compile.Args.push_back(args[next++]);
+  }
+  if (args.empty() || next == args.size()) {
+    usage(errs());
+    return 1;
+  }
+  compile.Args.push_back(args[next++]);
+  std::vector<std::string> runArgs(args.begin() + next, args.end());
+
+  CompilerOptions options;
+  std::vector<std::string> inputFiles, outputFiles;
+  if (!parseCommandLine(compile, options, inputFiles, outputFiles, errs(), errs()))
+    return 1;
+  if (options.Stream) {
+    errs() << "--run can't be used with -stream\n";
+    return 1;
+  }
+  // only hot code is compiled, so it may as well be optimised
+  if (options.Tiered && options.OptLevel == OptimizationLevel::O0)
+    options.OptLevel = OptimizationLevel::O2;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> source = MemoryBuffer::getFileOrSTDIN(inputFiles[0]);
+  if (!source) {
+    errs() << "Error opening file: " << source.getError().message() << "\n";
+    return 1;
+  }
+  CompilerSession session(std::move(*source), nulls(), errs(), options);
+  session.TheParser.PrintTree = false;
+  if (!session.parse() || !session.analyse())
+    return 1;
+
+  FunctionAST *entry = nullptr;
+  for (auto &node : session.Root->getNodes())
+    if (FunctionAST *function = node->getFunction())
+      if (function->getProto().getName() == args[0])
+        entry = function;
+  if (!entry) {
+    errs() << "There is no function named " << args[0] << " to run\n";
+    return 1;
+  }
+  std::vector<std::string> params = paramTypes(entry->getProto());
+  if (params.size() != runArgs.size()) {
+    errs() << args[0] << " takes " << params.size()
+           << (params.size() == 1 ? " argument, not " : " arguments, not ") << runArgs.size()
+           << "\n";
+    return 1;
+  }
+  std::vector<RunValue> values(runArgs.size());
+  for (unsigned i = 0; i < runArgs.size(); i++) {
+    if (!parseRunValue(runArgs[i], params[i], values[i])) {
+      errs() << "Argument " << i + 1 << " of " << args[0] << " is not a valid " << params[i]
+             << ": " << runArgs[i] << "\n";
+      return 1;
+    }
+  }
+
+  RunValue result;
+  result.Bits = 0;
+  if (!(options.VM ? runBytecode : options.Tiered ? runTiered : runJIT)(
+          session, *entry, values.data(), result, times))
+    return 1;
+
+  const std::string &resultType = entry->getProto().getType();
+  if (resultType == "bool")
+    outs() << "Result: " << (result.Bool ? "true" : "false") << "\n";
+  else if (resultType == "float")
+    outs() << "Result: " << format("%f", result.Float) << "\n";
+  else if (resultType == "int")
+    outs() << "Result: " << result.Int << "\n";
+  outs().flush();
+
+  using Milliseconds = std::chrono::duration<double, std::milli>;
+  errs() << format("Compiled in %.1f ms, loaded in %.1f ms, ran in %.1f ms\n",
+                   Milliseconds(times.Compiled - times.Start).count(),
+                   Milliseconds(times.Loaded - times.Compiled).count(),
+                   Milliseconds(times.Finished - times.Loaded).count());
+  return 0;
+}
+
+//===----------------------------------------------------------------------===//
+// Watch Mode
+//===----------------------------------------------------------------------===//
+
+// mccomp --watch [options] InputFile... builds its inputs, then waits for
+// them to change (using inotify) and builds them again, keeping what it can
+// from one build to the next:
+//  - the top level declarations of the last parse, and where each one
+//    starts in the source. After an edit only the declarations that overlap
+//    the changed text are parsed again, see parseChanges();
+//  - the global scope. If no declaration changed, only the function bodies
+//    that were parsed again are checked;
+//  - the generated shards and their object files, see ShardMemo.
+// Declarations that are kept keep their old line numbers, so a build that
+// finds an error parses and checks the whole file again before reporting it.
+// Included files are not watched; a change to one is seen when a file that
+// includes it is next parsed as a whole.
+
+/// WatchedFile - an input of --watch and what its last build left behind
+struct WatchedFile {
+  std::string Input, Output;
+  std::string Source;                          // the text last built
+  std::vector<std::unique_ptr<ASTnode>> Nodes; // from the last good parse
+  std::vector<size_t> Starts;                  // source offset of each node
+  std::set<ASTnode *> Reparsed;                // nodes new to this build
+  std::string Declarations;                    // see declarationsFingerprint()
+  GlobalScope Globals;
+  bool Checked = false; // the last build passed semantic analysis
+  ShardMemo Memo;
+
+  void reset() {
+    Memo.FunctionKeys.clear();
+    Nodes.clear();
+    Starts.clear();
+    Reparsed.clear();
+    Checked = false;
+  }
+};
+
+// Everything declare() looks at. If it is unchanged, so is the GlobalScope.
+static std::string declarationsFingerprint(ArrayRef<std::unique_ptr<ASTnode>> nodes) {
+  Fingerprint fp;
+  for (auto &node : nodes) {
+    if (PrototypeAST *proto = node->getPrototype()) {
+      fp.Text += node->getFunction() ? " define" : " extern";
+      proto->fingerprint(fp);
+    } else if (VariableASTnode *global = node->getVariable()) {
+      fp.Text += " (global " + global->getType() + " " + global->getName() + ")";
+    }
+  }
+  return fp.Text;
+}
+
+static bool isExtern(ASTnode &node) {
+  return node.getPrototype() && !node.getFunction();
+}
+
+// Whether the declaration starting at offset in source was brought in by an
+// #include or import
+static bool isImported(StringRef source, size_t offset) {
+  return source[offset] == '#' || source.substr(offset).starts_with("import");
+}
+
+// Parse the whole of file.Source. Syntax errors are reported to diags.
+static bool parseAll(WatchedFile &file, raw_ostream &diags) {
+  file.reset();
+  Lexer lexer(file.Source);
+  Parser parser(lexer, diags);
+  parser.PrintTree = false;
+  parser.DeclOffsets = &file.Starts;
+  parser.IncludeDir = std::string(path::parent_path(file.Input));
+  std::unique_ptr<rootASTnode> root = parser.parse(nulls());
+  if (!root) {
+    file.Starts.clear();
+    return false;
+  }
+  file.Nodes = std::move(root->getNodes());
+  for (auto &node : file.Nodes)
+    file.Reparsed.insert(node.get());
+  return true;
+}
+
+// Bring file.Nodes up to date with file.Source, which was old, by parsing
+// again only the declarations the edit overlaps. A declaration is taken to
+// run up to the start of the next (the last, to the end of the file). The
+// declarations kept after the edit begin after a newline in the unchanged
+// text, since a newline ends any token or comment, so lexing the edited
+// region by itself gives the same tokens as lexing the whole file. Returns
+// false if the region doesn't parse by itself, involves an #include or the
+// result breaks the rule that externs come first; the caller then parses the
+// whole file.
+static bool parseChanges(WatchedFile &file, StringRef old) {
+  StringRef now = file.Source;
+  size_t count = file.Nodes.size();
+  if (count == 0)
+    return false;
+  size_t limit = std::min(old.size(), now.size());
+  size_t prefix = 0;
+  while (prefix < limit && old[prefix] == now[prefix])
+    prefix++;
+  size_t suffix = 0;
+  while (suffix < limit - prefix && old.end()[-1 - suffix] == now.end()[-1 - suffix])
+    suffix++;
+
+  size_t first = 0;
+  while (first + 1 < count && file.Starts[first + 1] <= prefix)
+    first++;
+  size_t tail = old.size() - suffix;
+  size_t last = first + 1;
+  while (last < count && !(file.Starts[last] > tail && old[file.Starts[last] - 1] == '\n'))
+    last++;
+
+  for (size_t i = first; i < last; i++)
+    if (isImported(old, file.Starts[i]))
+      return false;
+
+  size_t begin = first ? file.Starts[first] : 0;
+  size_t end = last < count ? file.Starts[last] + now.size() - old.size() : now.size();
+  Lexer lexer(now.slice(begin, end));
+  std::string errors; // reported by the whole file parse that follows
+  raw_string_ostream errorStream(errors);
+  Parser parser(lexer, errorStream);
+  std::vector<size_t> offsets;
+  parser.PrintTree = false;
+  parser.DeclOffsets = &offsets;
+  std::unique_ptr<rootASTnode> root = parser.parse(nulls());
+  if (!root)
+    return false;
+  for (size_t offset : offsets)
+    if (isImported(now, begin + offset))
+      return false;
+
+  std::vector<std::unique_ptr<ASTnode>> nodes;
+  std::vector<size_t> starts;
+  for (size_t i = 0; i < first; i++) {
+    nodes.push_back(std::move(file.Nodes[i]));
+    starts.push_back(file.Starts[i]);
+  }
+  std::vector<std::unique_ptr<ASTnode>> &parsed = root->getNodes();
+  for (size_t i = 0; i < parsed.size(); i++) {
+    file.Reparsed.insert(parsed[i].get());
+    nodes.push_back(std::move(parsed[i]));
+    starts.push_back(begin + offsets[i]);
+  }
+  for (size_t i = last; i < count; i++) {
+    nodes.push_back(std::move(file.Nodes[i]));
+    starts.push_back(file.Starts[i] + now.size() - old.size());
+  }
+  // forget the replaced functions before their addresses can be reused
+  for (size_t i = first; i < last; i++)
+    file.Memo.FunctionKeys.erase(file.Nodes[i]->getFunction());
+  file.Nodes = std::move(nodes);
+  file.Starts = std::move(starts);
+
+  for (size_t i = 1; i < file.Nodes.size(); i++)
+    if (isExtern(*file.Nodes[i]) && !isExtern(*file.Nodes[i - 1]) &&
+        !isImported(now, file.Starts[i - 1]))
+      return false;
+  return true;
+}
+
+// Build file from source, reusing what the last build left where it can.
+// With whole set, nothing is reused but the memo of generated shards.
+static bool buildWatchedFile(WatchedFile &file, std::string source,
+                             const CompilerOptions &options, TargetMachinePool &machines,
+                             raw_ostream &diags, bool whole = false) {
+  auto start = std::chrono::steady_clock::now();
+  std::string old = std::move(file.Source);
+  file.Source = std::move(source);
+  file.Reparsed.clear();
+  bool incremental = !whole && parseChanges(file, old);
+  if (!incremental && !parseAll(file, diags))
+    return false;
+
+  // semantic analysis, of the reparsed functions only if it can be
+  std::string declarations = declarationsFingerprint(file.Nodes);
+  bool checkAll = !file.Checked || declarations != file.Declarations;
+  file.Declarations = std::move(declarations);
+  DiagnosticList errors;
+  if (checkAll) {
+    file.Memo.FunctionKeys.clear();
+    file.Globals = GlobalScope();
+    for (auto &node : file.Nodes)
+      node->declare(file.Globals, errors);
+  }
+  unsigned checked = 0;
+  for (auto &node : file.Nodes) {
+    FunctionAST *function = node->getFunction();
+    if (function && (checkAll || file.Reparsed.count(node.get()))) {
+      function->checkBody(file.Globals, errors);
+      checked++;
+    }
+  }
+  file.Checked = errors.empty();
+  if (!file.Checked && incremental) {
+    std::string again = file.Source;
+    return buildWatchedFile(file, std::move(again), options, machines, diags, true);
+  }
+
+  CompilerSession session(MemoryBuffer::getMemBuffer(file.Source, file.Input, false), nulls(),
+                          diags, options, &machines);
+  if (!file.Checked) {
+    sortDiagnostics(errors);
+    session.reportSemanticErrors(errors);
+    return false;
+  }
+  session.Root = std::make_unique<rootASTnode>(std::move(file.Nodes));
+  session.Memo = &file.Memo;
+  file.Memo.startBuild();
+  bool ok = session.codegen();
+  file.Nodes = std::move(session.Root->getNodes());
+  if (!ok)
+    return false;
+  file.Memo.prune();
+
+  switch (options.Emit) {
+  case CompilerOptions::EmitObject:
+    ok = session.emitFile(file.Output, CodeGenFileType::ObjectFile);
+    break;
+  case CompilerOptions::EmitAssembly:
+    ok = session.emitFile(file.Output, CodeGenFileType::AssemblyFile);
+    break;
+  case CompilerOptions::EmitBitcode:
+    ok = session.writeBitcode(file.Output);
+    break;
+  case CompilerOptions::EmitIR:
+  case CompilerOptions::EmitInterface:
+    ok = session.writeIR(file.Output);
+    break;
+  }
+  if (!ok)
+    return false;
+
+  std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+  diags << "Built " << file.Output << " in " << format("%.1f", time.count()) << " ms: parsed "
+        << file.Reparsed.size() << " of " << file.Nodes.size() << " declarations, checked "
+        << checked << " functions";
+  unsigned shards = file.Memo.Reused + file.Memo.Generated;
+  if (shards)
+    diags << ", generated " << file.Memo.Generated << " of " << shards << " shards";
+  diags << "\n";
+  return true;
+}
+
+static void rebuildWatchedFile(WatchedFile &file, const CompilerOptions &options,
+                               TargetMachinePool &machines) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> source = MemoryBuffer::getFile(file.Input);
+  if (!source) {
+    errs() << "Error opening file " << file.Input << ": " << source.getError().message() << "\n";
+    return;
+  }
+  if ((*source)->getBuffer() == file.Source && !file.Nodes.empty())
+    return;
+  buildWatchedFile(file, (*source)->getBuffer().str(), options, machines, errs());
+  errs().flush();
+}
+
+// Build every input, then rebuild each one whenever it is written. Editors
+// often save by writing a new file and renaming it over the old, so the
+// directories holding the inputs are watched rather than the files.
+static int runWatcher(const CompileRequest &request) {
+  CompilerOptions options;
+  std::vector<std::string> inputFiles, outputFiles;
+  if (!parseCommandLine(request, options, inputFiles, outputFiles, outs(), errs()))
+    return 1;
+  // -perf's line tables would give kept declarations their old line numbers
+  if (options.Stream || options.Pipeline || options.Perf ||
+      options.Emit == CompilerOptions::EmitInterface) {
+    errs() << "--watch can't be used with -stream, -pipeline, -perf or --emit-interface\n";
+    return 1;
+  }
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    errs() << "Could not start watching files: " << strerror(errno) << "\n";
+    return 1;
+  }
+  TargetMachinePool machines;
+  std::vector<std::unique_ptr<WatchedFile>> files;
+  std::map<std::pair<int, std::string>, WatchedFile *> byName; // by watch and file name
+  for (unsigned i = 0; i < inputFiles.size(); i++) {
+    if (inputFiles[i] == "-") {
+      errs() << "--watch can't read standard input\n";
+      return 1;
+    }
+    files.push_back(std::make_unique<WatchedFile>());
+    files.back()->Input = inputFiles[i];
+    files.back()->Output = outputFiles[i];
+    StringRef dir = sys::path::parent_path(inputFiles[i]);
+    std::string path = dir.empty() ? "." : dir.str();
+    int watch = inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (watch < 0) {
+      errs() << "Could not watch " << path << ": " << strerror(errno) << "\n";
+      return 1;
+    }
+    byName[{watch, sys::path::filename(inputFiles[i]).str()}] = files.back().get();
+  }
+
+  for (auto &file : files)
+    rebuildWatchedFile(*file, options, machines);
+  errs() << "Watching " << files.size() << (files.size() == 1 ? " file" : " files")
+         << " for changes\n";
+  errs().flush();
+
+  alignas(inotify_event) char buffer[4096];
+  for (;;) {
+    std::vector<WatchedFile *> changed;
+    // wait for an event, then take any others that are already queued
+    for (int timeout = -1;; timeout = 0) {
+      pollfd ready = {fd, POLLIN, 0};
+      if (::poll(&ready, 1, timeout) <= 0)
+        break;
+      ssize_t length = ::read(fd, buffer, sizeof(buffer));
+      if (length <= 0)
+        break;
+      for (char *next = buffer; next < buffer + length;) {
+        auto *event = reinterpret_cast<inotify_event *>(next);
+        next += sizeof(inotify_event) + event->len;
+        auto file = byName.find({event->wd, event->len ? event->name : ""});
+        if (file != byName.end() && !is_contained(changed, file->second))
+          changed.push_back(file->second);
+      }
+    }
+    for (WatchedFile *file : changed)
+      rebuildWatchedFile(*file, options, machines);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+} // namespace detail
+} // namespace mccomp
+
+#ifndef MCCOMP_LIBRARY
+int main(int argc, char **argv) {
+  using namespace mccomp::detail;
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  if (argc == 3 && StringRef(argv[1]) == "--server")
+    return runServer(argv[2]);
+
+  CompileRequest request;
+  if (argc > 1 && StringRef(argv[1]) == "--run") {
+    request.Args.assign(argv + 2, argv + argc);
+    return runProgram(request);
+  }
+  if (argc > 1 && StringRef(argv[1]) == "--watch") {
+    request.Args.assign(argv + 2, argv + argc);
+    return runWatcher(request);
+  }
+  request.Args.assign(argv + 1, argv + argc);
+  return runCompiler(request, nullptr, outs(), errs());
 }
+#endif // MCCOMP_LIBRARY
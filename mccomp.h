@@ -0,0 +1,108 @@
+// mccomp.h - the Mini-C compiler as a library, for programs that compile
+// Mini-C at run time. Sources are compiled from memory: a compile reads no
+// files other than those the source names with #include or import and the
+// cache directory, writes none outside the cache directory and starts no
+// processes.
+//
+// Build libmccomp.a with `make libmccomp.a` and link it with LLVM:
+//
+//   std::vector<mccomp::Diagnostic> diags;
+//   auto program = mccomp::compileToProgram("int twice(int x) { return x * 2; }", diags);
+//   if (program)
+//     int four = program->getFunction<int(int)>("twice")(2);
+
+#ifndef MCCOMP_H
+#define MCCOMP_H
+
+#include "llvm/ADT/StringRef.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class LLVMContext;
+class MemoryBuffer;
+class Module;
+} // namespace llvm
+
+namespace mccomp {
+
+/// Diagnostic - one error from a compile. Line and Column are 0 for an error
+/// with no place in the source.
+struct Diagnostic {
+  enum KindType { Syntax, Semantic, CodeGeneration, Other };
+  KindType Kind = Other;
+  unsigned Line = 0, Column = 0;
+  std::string Message;
+};
+
+/// Options - how a source is compiled, as the command line options of the
+/// same names do.
+struct Options {
+  unsigned OptLevel = 0;    // -O0 to -O3
+  bool FastCompile = false; // -fast
+  unsigned NumThreads = 1;  // -jN
+  // -cache-dir: where compiled functions and the objects of Programs are
+  // kept, so that compiling the same source again, in this process or a
+  // later one, skips most of the work. Empty means no cache.
+  std::string CacheDir;
+  unsigned CacheSize = 512; // -cache-size, in MB
+  // -perf: Programs write their functions to /tmp/perf-<pid>.map, and are
+  // compiled with line tables, so that perf can profile them
+  bool Perf = false;
+};
+
+/// CompiledModule - the IR for a source and the context it lives in
+struct CompiledModule {
+  std::unique_ptr<llvm::LLVMContext> Context;
+  std::unique_ptr<llvm::Module> Module;
+
+  CompiledModule();
+  CompiledModule(CompiledModule &&);
+  ~CompiledModule();
+};
+
+/// Program - a compiled source loaded into this process, ready to call. Its
+/// code lives as long as the Program does.
+class Program {
+public:
+  struct Impl;
+
+  explicit Program(std::unique_ptr<Impl> impl);
+  ~Program();
+
+  // The address of the named function, or nullptr if there is none
+  void *getAddress(llvm::StringRef name) const;
+
+  template <typename T> T *getFunction(llvm::StringRef name) const {
+    return reinterpret_cast<T *>(getAddress(name));
+  }
+
+private:
+  std::unique_ptr<Impl> TheImpl;
+};
+
+/// Addresses to bind the externs of a source to. Externs not listed are
+/// looked up among the symbols of the process.
+using SymbolMap = std::map<std::string, void *>;
+
+// Each of these compiles source, returning nullptr (or a CompiledModule
+// without a Module) and adding to diags if there are errors. They may be
+// called from several threads at once.
+
+CompiledModule compileToModule(llvm::StringRef source, std::vector<Diagnostic> &diags,
+                               const Options &options = {});
+
+// The object file for the host, in memory
+std::unique_ptr<llvm::MemoryBuffer> compileToObject(llvm::StringRef source,
+                                                    std::vector<Diagnostic> &diags,
+                                                    const Options &options = {});
+
+std::unique_ptr<Program> compileToProgram(llvm::StringRef source, std::vector<Diagnostic> &diags,
+                                          const Options &options = {},
+                                          const SymbolMap &symbols = {});
+
+} // namespace mccomp
+
+#endif
@@ -0,0 +1,77 @@
+// mcprotocol.h - the framing shared by `mccomp --server` and mcclient.
+//
+// Requests and replies are sequences of fields on the socket. A field is a
+// 32 bit little endian length followed by that many bytes.
+//   request: working directory, has-stdin ("0" or "1"), stdin text,
+//            argument count, arguments...
+//   reply:   exit status, standard output, standard error
+//
+// The server drops a connection whose request has a field longer than
+// MaxRequestField or more than MaxRequestArgs arguments, rather than
+// allocating whatever a peer asks for.
+
+#ifndef MCPROTOCOL_H
+#define MCPROTOCOL_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unistd.h>
+
+namespace mcprotocol {
+
+const uint32_t MaxRequestField = 64 << 20;
+const unsigned MaxRequestArgs = 4096;
+
+inline bool readExact(int fd, char *data, size_t size) {
+  while (size) {
+    ssize_t n = ::read(fd, data, size);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool writeExact(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = ::write(fd, data, size);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Reads a field of at most maxSize bytes; a longer one is an error
+inline bool readField(int fd, std::string &field, uint32_t maxSize = UINT32_MAX) {
+  unsigned char size[4];
+  if (!readExact(fd, reinterpret_cast<char *>(size), 4))
+    return false;
+  uint32_t length = size[0] | size[1] << 8 | size[2] << 16 | (uint32_t)size[3] << 24;
+  if (length > maxSize)
+    return false;
+  field.resize(length);
+  return readExact(fd, &field[0], field.size());
+}
+
+inline bool writeField(int fd, const std::string &field) {
+  uint32_t length = field.size();
+  unsigned char size[4] = {(unsigned char)length, (unsigned char)(length >> 8),
+                           (unsigned char)(length >> 16), (unsigned char)(length >> 24)};
+  return writeExact(fd, reinterpret_cast<char *>(size), 4) &&
+         writeExact(fd, field.data(), field.size());
+}
+
+} // namespace mcprotocol
+
+#endif
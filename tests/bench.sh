@@ -0,0 +1,46 @@
+#!/bin/bash
+# Times the test programs run by mccomp --run, compiled with -O2 and in the
+# bytecode VM with -vm, and prints the time per call of each and how many
+# times slower the VM is. Run from tests/ after building mccomp:
+#
+#   ./bench.sh [path to mccomp]
+#
+# import, include and library are left out, as their externs are defined
+# by their drivers and shapes.c, which --run doesn't load.
+set -e
+
+COMP=${1:-$(pwd)/../mccomp}
+
+# calls, directory, entry point, arguments
+PROGRAMS=(
+	"100000 addition addition 6 3"
+	"100000 cosine cosine 3.14159"
+	"100000 factorial factorial 10"
+	"10000 fibonacci fibonacci 10"
+	"100000 palindrome palindrome 45677654"
+	"10000 pi pi"
+	"10000 recurse recursion_driver 20"
+	"100000 rfact rfact 10"
+	"100000 shortcircuit shortcircuit 1"
+	"10000 unary unary 2 3.0"
+	"1000 void Void"
+	"100000 while While 1"
+	"20 tiered tiered 3000"
+)
+
+# the "ran in" time, in ms, of a --run
+function ran {
+	"$COMP" --run "$@" 2>&1 >/dev/null | sed -n 's/.*ran in \([0-9.]*\) ms.*/\1/p'
+}
+
+printf "%-14s %8s %12s %12s %8s\n" program calls "native us" "vm us" "vm/native"
+for program in "${PROGRAMS[@]}"; do
+	set -- $program
+	calls=$1 dir=$2 entry=$3
+	shift 3
+	native=$(ran "$entry" -O2 -repeat "$calls" "$dir/$dir.c" "$@")
+	vm=$(ran "$entry" -vm -repeat "$calls" "$dir/$dir.c" "$@")
+	awk -v p="$dir" -v n="$calls" -v native="$native" -v vm="$vm" 'BEGIN {
+		printf "%-14s %8d %12.3f %12.3f %8.1f\n", p, n, native * 1000 / n, vm * 1000 / n,
+		       (native > 0 ? vm / native : 0) }'
+done
@@ -0,0 +1,6 @@
+// MiniC program to test the -cache-dir function cache: a variable named i5
+// and the literal 5 must not be taken for the same code
+
+int cache(int i5) {
+  return i5;
+}
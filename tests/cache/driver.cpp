@@ -0,0 +1,15 @@
+#include <iostream>
+#include <cstdio>
+
+// mccomp -c -cache-dir cache-dir ./cache.c; clang++ driver.cpp output.o -o cache
+
+extern "C" {
+    int cache(int i5);
+}
+
+int main() {
+    if(cache(7) == 7)
+      std::cout << "PASSED Result: " << cache(7) << std::endl;
+    else
+      std::cout << "FALIED Result: " << cache(7) << std::endl;
+}
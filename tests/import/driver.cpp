@@ -0,0 +1,35 @@
+#include <iostream>
+#include <cstdio>
+
+// clang++ driver.cpp output.o shapes.o -o import
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" DLLEXPORT int print_int(int X) {
+  fprintf(stderr, "%d\n", X);
+  return 0;
+}
+
+extern "C" DLLEXPORT float print_float(float X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+extern "C" {
+    int Import(int n);
+}
+
+int main() {
+    int result = Import(4);
+    if (result == 24) {
+    	std::cout << "PASSED Result: " << result << std::endl;
+    }
+    else {
+    	std::cout << "FAILED Result: " << result << std::endl;
+    }
+    
+}
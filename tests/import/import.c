@@ -0,0 +1,22 @@
+// MiniC program to test import: the declarations of shapes.c come from the
+// interface written by mccomp --emit-interface shapes.c
+
+import shapes;
+
+extern int print_int(int X);
+
+int Import(int n){
+  int total;
+  int i;
+  total = 0;
+  i = 1;
+  while (i <= n) {
+    total = total + area(i, 2);
+    i = i + 1;
+  }
+  print_int(calls);
+  if (half(8.0) == 4.0) {
+    return total + calls;
+  }
+  return 0;
+}
@@ -0,0 +1,12 @@
+// MiniC module whose interface is imported by import.c
+
+int calls;
+
+int area(int w, int h){
+  calls = calls + 1;
+  return w * h;
+}
+
+float half(float x){
+  return x / 2.0;
+}
@@ -0,0 +1,38 @@
+#include <iostream>
+#include <cstdio>
+
+// clang++ driver.cpp include.ll -o include
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" DLLEXPORT int print_int(int X) {
+  fprintf(stderr, "%d\n", X);
+  return 0;
+}
+
+extern "C" DLLEXPORT float print_float(float X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+extern "C" DLLEXPORT int square(int x) {
+  return x * x;
+}
+
+extern "C" {
+    int Include(int n);
+}
+
+int main() {
+    if (Include(4) == 30) {
+    	std::cout << "PASSED Result: " << Include(4) << std::endl;
+    }
+    else {
+    	std::cout << "FAILED Result: " << Include(4) << std::endl;
+    }
+    
+}
\ No newline at end of file
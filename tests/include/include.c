@@ -0,0 +1,20 @@
+// MiniC program to test #include: io.h is named three times, directly and
+// through maths.h, but is included only once
+
+#include "io.h"
+#include "maths.h"
+#include "io.h"
+
+int sum;
+
+int Include(int n){
+  int i;
+  i = 1;
+  sum = 0;
+  while (i <= n) {
+    sum = sum + square(i);
+    i = i + 1;
+  }
+  print_int(sum);
+  return sum;
+}
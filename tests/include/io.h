@@ -0,0 +1,4 @@
+// MiniC header: output functions provided by the driver
+
+extern int print_int(int X);
+extern float print_float(float X);
@@ -0,0 +1,5 @@
+// MiniC header that includes another header
+
+#include "io.h"
+
+extern int square(int x);
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Times the first call of a generated program under mccomp --run -lazy,
+# with callees compiled only when called and with -jN compiling them
+# speculatively on N threads, at -O0 and -O2. Run from tests/ after
+# building mccomp:
+#
+#   ./lazy-bench.sh [path to mccomp] [runs]
+#
+# The program's entry, top, calls 40 functions that each call 5 of 200
+# leaves with a loop in them, so the first call compiles 241 functions.
+set -e
+
+COMP=${1:-$(pwd)/../mccomp}
+RUNS=${2:-5}
+PROGRAM=$(mktemp /tmp/lazy-bench-XXXXXX.c)
+trap "rm -f $PROGRAM" EXIT
+
+for i in $(seq 200); do
+	printf 'int g%d(int n) {\n    int i;\n    int acc;\n    i = 0;\n    acc = n;\n' $i
+	printf '    while (i < n) {\n        if (acc %% 2 == 0) { acc = acc / 2 + i; }\n'
+	printf '        else { acc = acc * 3 + %d; }\n        i = i + 1;\n    }\n' $i
+	printf '    return acc;\n}\n\n'
+done > $PROGRAM
+for i in $(seq 40); do
+	first=$(( (i - 1) * 5 ))
+	printf 'int mid%d(int n) {\n    return g%d(n) + g%d(n) + g%d(n) + g%d(n) + g%d(n);\n}\n\n' \
+		$i $((first + 1)) $((first + 2)) $((first + 3)) $((first + 4)) $((first + 5))
+done >> $PROGRAM
+{
+	printf 'int top(int n) {\n    return mid1(n)'
+	for i in $(seq 2 40); do printf ' + mid%d(n)' $i; done
+	printf ';\n}\n'
+} >> $PROGRAM
+
+# the compile, load and run time, in ms, of a --run, up to the first result
+function first_call {
+	"$COMP" --run top "$@" $PROGRAM 10 2>&1 >/dev/null |
+		sed -n 's/Compiled in \([0-9.]*\) ms, loaded in \([0-9.]*\) ms, ran in \([0-9.]*\) ms/\1 \2 \3/p' |
+		awk '{ print $1 + $2 + $3 }'
+}
+
+printf "%-6s %-12s %10s %10s\n" level mode "best ms" "median ms"
+for level in -O0 -O2; do
+	for mode in "-lazy" "-lazy -j2" "-lazy -j4"; do
+		times=$(for run in $(seq $RUNS); do first_call $level $mode; done | sort -n)
+		echo "$times" | awk -v level=$level -v mode="$mode" '{ t[NR] = $1 } END {
+			printf "%-6s %-12s %10.1f %10.1f\n", level, mode, t[1], t[int((NR + 1) / 2)] }'
+	done
+done
@@ -0,0 +1,48 @@
+#include "../../mccomp.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// clang++ driver.cpp ../../libmccomp.a `llvm-config --cxxflags --ldflags --system-libs --libs all` -o library
+
+static int printed = 0;
+
+extern "C" int print_int(int X) {
+  fprintf(stderr, "%d\n", X);
+  printed = X;
+  return 0;
+}
+
+int main() {
+  std::ifstream file("library.c");
+  std::stringstream source;
+  source << file.rdbuf();
+
+  // a program with an error gives a diagnostic and no code
+  std::vector<mccomp::Diagnostic> diags;
+  auto broken = mccomp::compileToProgram("int f(int x) {\n  return y;\n}\n", diags);
+  bool diagnosed = !broken && diags.size() == 1 &&
+                   diags[0].Kind == mccomp::Diagnostic::Semantic && diags[0].Line == 2;
+
+  diags.clear();
+  auto object = mccomp::compileToObject(source.str(), diags);
+  bool haveObject = object && object->getBufferSize() > 0 && diags.empty();
+
+  auto program = mccomp::compileToProgram(source.str(), diags, {2}, {{"print_int", (void *)print_int}});
+  int result = 0;
+  if (program && program->getAddress("scale")) {
+    *program->getFunction<int>("scale") = 3;
+    result = program->getFunction<int(int)>("Library")(4);
+  }
+
+  if (diagnosed && haveObject && result == 30 && printed == 30) {
+    std::cout << "PASSED Result: " << result << std::endl;
+  }
+  else {
+    for (auto &diag : diags)
+      std::cout << diag.Line << ":" << diag.Column << ": " << diag.Message << std::endl;
+    std::cout << "FAILED Result: " << result << std::endl;
+  }
+}
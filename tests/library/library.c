@@ -0,0 +1,17 @@
+// MiniC program to test the compiler library: driver.cpp compiles this
+// source from memory and calls Library through the returned pointer
+
+extern int print_int(int X);
+
+int scale;
+
+int Library(int n){
+  int result;
+  result = 0;
+  while (n > 0) {
+    result = result + n * scale;
+    n = n - 1;
+  }
+  print_int(result);
+  return result;
+}
@@ -0,0 +1,35 @@
+#include <iostream>
+#include <cstdio>
+#include <math.h> 
+
+// clang++ driver.cpp shards.ll -o shards
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" DLLEXPORT int print_int(int X) {
+  fprintf(stderr, "%d\n", X);
+  return 0;
+}
+
+extern "C" DLLEXPORT float print_float(float X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+extern "C" {
+    int shards(int x);
+}
+
+int main() {
+
+  int result = shards(10);
+  if( result == 2425)    
+    std::cout << "PASSED Result: " << result << std::endl;
+  else 
+    std::cout << "FALIED Result: " << result << std::endl;    
+  
+}
\ No newline at end of file
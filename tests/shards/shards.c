@@ -0,0 +1,287 @@
+// MiniC program with more functions than fit in one shard, so -jN
+// generates code for them on several threads. The IR must not depend on
+// how many.
+
+int step0(int x) {
+    return x;
+}
+
+int step1(int x) {
+    return step0(x) + 1;
+}
+
+int step2(int x) {
+    return step1(x) + 2;
+}
+
+int step3(int x) {
+    return step2(x) + 3;
+}
+
+int step4(int x) {
+    return step3(x) + 4;
+}
+
+int step5(int x) {
+    return step4(x) + 5;
+}
+
+int step6(int x) {
+    return step5(x) + 6;
+}
+
+int step7(int x) {
+    return step6(x) + 7;
+}
+
+int step8(int x) {
+    return step7(x) + 8;
+}
+
+int step9(int x) {
+    return step8(x) + 9;
+}
+
+int step10(int x) {
+    return step9(x) + 10;
+}
+
+int step11(int x) {
+    return step10(x) + 11;
+}
+
+int step12(int x) {
+    return step11(x) + 12;
+}
+
+int step13(int x) {
+    return step12(x) + 13;
+}
+
+int step14(int x) {
+    return step13(x) + 14;
+}
+
+int step15(int x) {
+    return step14(x) + 15;
+}
+
+int step16(int x) {
+    return step15(x) + 16;
+}
+
+int step17(int x) {
+    return step16(x) + 17;
+}
+
+int step18(int x) {
+    return step17(x) + 18;
+}
+
+int step19(int x) {
+    return step18(x) + 19;
+}
+
+int step20(int x) {
+    return step19(x) + 20;
+}
+
+int step21(int x) {
+    return step20(x) + 21;
+}
+
+int step22(int x) {
+    return step21(x) + 22;
+}
+
+int step23(int x) {
+    return step22(x) + 23;
+}
+
+int step24(int x) {
+    return step23(x) + 24;
+}
+
+int step25(int x) {
+    return step24(x) + 25;
+}
+
+int step26(int x) {
+    return step25(x) + 26;
+}
+
+int step27(int x) {
+    return step26(x) + 27;
+}
+
+int step28(int x) {
+    return step27(x) + 28;
+}
+
+int step29(int x) {
+    return step28(x) + 29;
+}
+
+int step30(int x) {
+    return step29(x) + 30;
+}
+
+int step31(int x) {
+    return step30(x) + 31;
+}
+
+int step32(int x) {
+    return step31(x) + 32;
+}
+
+int step33(int x) {
+    return step32(x) + 33;
+}
+
+int step34(int x) {
+    return step33(x) + 34;
+}
+
+int step35(int x) {
+    return step34(x) + 35;
+}
+
+int step36(int x) {
+    return step35(x) + 36;
+}
+
+int step37(int x) {
+    return step36(x) + 37;
+}
+
+int step38(int x) {
+    return step37(x) + 38;
+}
+
+int step39(int x) {
+    return step38(x) + 39;
+}
+
+int step40(int x) {
+    return step39(x) + 40;
+}
+
+int step41(int x) {
+    return step40(x) + 41;
+}
+
+int step42(int x) {
+    return step41(x) + 42;
+}
+
+int step43(int x) {
+    return step42(x) + 43;
+}
+
+int step44(int x) {
+    return step43(x) + 44;
+}
+
+int step45(int x) {
+    return step44(x) + 45;
+}
+
+int step46(int x) {
+    return step45(x) + 46;
+}
+
+int step47(int x) {
+    return step46(x) + 47;
+}
+
+int step48(int x) {
+    return step47(x) + 48;
+}
+
+int step49(int x) {
+    return step48(x) + 49;
+}
+
+int step50(int x) {
+    return step49(x) + 50;
+}
+
+int step51(int x) {
+    return step50(x) + 51;
+}
+
+int step52(int x) {
+    return step51(x) + 52;
+}
+
+int step53(int x) {
+    return step52(x) + 53;
+}
+
+int step54(int x) {
+    return step53(x) + 54;
+}
+
+int step55(int x) {
+    return step54(x) + 55;
+}
+
+int step56(int x) {
+    return step55(x) + 56;
+}
+
+int step57(int x) {
+    return step56(x) + 57;
+}
+
+int step58(int x) {
+    return step57(x) + 58;
+}
+
+int step59(int x) {
+    return step58(x) + 59;
+}
+
+int step60(int x) {
+    return step59(x) + 60;
+}
+
+int step61(int x) {
+    return step60(x) + 61;
+}
+
+int step62(int x) {
+    return step61(x) + 62;
+}
+
+int step63(int x) {
+    return step62(x) + 63;
+}
+
+int step64(int x) {
+    return step63(x) + 64;
+}
+
+int step65(int x) {
+    return step64(x) + 65;
+}
+
+int step66(int x) {
+    return step65(x) + 66;
+}
+
+int step67(int x) {
+    return step66(x) + 67;
+}
+
+int step68(int x) {
+    return step67(x) + 68;
+}
+
+int step69(int x) {
+    return step68(x) + 69;
+}
+
+int shards(int x) {
+    return step69(x);
+}
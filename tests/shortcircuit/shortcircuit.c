@@ -0,0 +1,30 @@
+// MiniC program to test that && and || only evaluate their right operand when needed
+extern int print_int(int X);
+
+int calls;
+
+bool touch(bool b) {
+  calls = calls + 1;
+  return b;
+}
+
+int shortcircuit(int n) {
+  int hits;
+  hits = 0;
+  calls = 0;
+
+  if (false && touch(true)) {
+    hits = hits + 1;
+  }
+  if (true || touch(false)) {
+    hits = hits + 10;
+  }
+  if (n > 0 && touch(true)) {
+    hits = hits + 100;
+  }
+  if (n < 0 || touch(false)) {
+    hits = hits + 1000;
+  }
+  print_int(calls);
+  return hits + calls * 10000;
+}
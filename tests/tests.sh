@@ -24,7 +24,7 @@ rm -rf ./mccomp
 echo "Compile *****"
 
 make clean
-make -j mccomp
+make -j mccomp mcclient libmccomp.a
 
 COMP=$DIR/mccomp
 echo $COMP
@@ -51,6 +51,22 @@ unary=1
 palindrome=1
 recurse=1
 rfact=1
+shortcircuit=1
+levels=1
+bitcode=1
+fast=1
+include=1
+import=1
+library=1
+cache=1
+multi=1
+shards=1
+pipeline=1
+stream=1
+watch=1
+server=1
+tiered=1
+run=1
 
 cd tests/addition/
 
@@ -58,10 +74,19 @@ if [ $addition == 1 ]
 then	
 	cd ../addition/
 	pwd
-	rm -rf output.ll add
+	rm -rf output.ll output.o output.s add
+	# the textual IR through clang, and the object and assembly mccomp
+	# writes itself
 	"$COMP" ./addition.c
 	$CLANG driver.cpp output.ll  -o add
 	validate "./add"
+	"$COMP" -c ./addition.c
+	$CLANG driver.cpp output.o  -o add
+	validate "./add"
+	"$COMP" -S ./addition.c
+	$CLANG driver.cpp output.s  -o add
+	validate "./add"
+	rm -rf output.s
 fi
 
 
@@ -69,9 +94,9 @@ if [ $factorial == 1 ];
 then	
 	cd ../factorial
 	pwd
-	rm -rf output.ll fact
-	"$COMP" ./factorial.c
-	$CLANG driver.cpp output.ll -o fact
+	rm -rf output.o fact
+	"$COMP" -c ./factorial.c
+	$CLANG driver.cpp output.o -o fact
 	validate "./fact"
 fi
 
@@ -79,9 +104,9 @@ if [ $fibonacci == 1 ];
 then	
 	cd ../fibonacci
 	pwd
-	rm -rf output.ll fib
-	"$COMP" ./fibonacci.c
-	$CLANG driver.cpp output.ll -o fib
+	rm -rf output.o fib
+	"$COMP" -c ./fibonacci.c
+	$CLANG driver.cpp output.o -o fib
 	validate "./fib"
 fi
 
@@ -89,9 +114,9 @@ if [ $pi == 1 ];
 then	
 	cd ../pi
 	pwd
-	rm -rf output.ll pi
-	"$COMP" ./pi.c
-	$CLANG driver.cpp output.ll -o pi
+	rm -rf output.o pi
+	"$COMP" -c ./pi.c
+	$CLANG driver.cpp output.o -o pi
 	validate "./pi"
 fi
 
@@ -99,9 +124,9 @@ if [ $while == 1 ];
 then	
 	cd ../while
 	pwd
-	rm -rf output.ll while
-	"$COMP" ./while.c
-	$CLANG driver.cpp output.ll -o while
+	rm -rf output.o while
+	"$COMP" -c ./while.c
+	$CLANG driver.cpp output.o -o while
 	validate "./while"
 fi
 
@@ -109,9 +134,9 @@ if [ $void == 1 ];
 then	
 	cd ../void
 	pwd
-	rm -rf output.ll void
-	"$COMP" ./void.c 
-	$CLANG driver.cpp output.ll -o void
+	rm -rf output.o void
+	"$COMP" -c ./void.c 
+	$CLANG driver.cpp output.o -o void
 	validate "./void"
 fi
 
@@ -119,9 +144,9 @@ if [ $cosine == 1 ];
 then	
 	cd ../cosine
 	pwd
-	rm -rf output.ll cosine
-	"$COMP" ./cosine.c
-	$CLANG driver.cpp output.ll -o cosine
+	rm -rf output.o cosine
+	"$COMP" -c ./cosine.c
+	$CLANG driver.cpp output.o -o cosine
 	validate "./cosine"
 fi
 
@@ -129,9 +154,9 @@ if [ $unary == 1 ];
 then	
 	cd ../unary
 	pwd
-	rm -rf output.ll unary
-	"$COMP" ./unary.c
-	$CLANG driver.cpp output.ll -o unary
+	rm -rf output.o unary
+	"$COMP" -c ./unary.c
+	$CLANG driver.cpp output.o -o unary
 	validate "./unary"
 fi
 
@@ -139,9 +164,9 @@ if [ $recurse == 1 ];
 then	
 	cd ../recurse
 	pwd
-	rm -rf output.ll recurse
-	"$COMP" ./recurse.c
-	$CLANG driver.cpp output.ll -o recurse
+	rm -rf output.o recurse
+	"$COMP" -c ./recurse.c
+	$CLANG driver.cpp output.o -o recurse
 	validate "./recurse"
 fi
 
@@ -149,9 +174,9 @@ if [ $rfact == 1 ];
 then	
 	cd ../rfact
 	pwd
-	rm -rf output.ll rfact
-	"$COMP" ./rfact.c
-	$CLANG driver.cpp output.ll -o rfact
+	rm -rf output.o rfact
+	"$COMP" -c ./rfact.c
+	$CLANG driver.cpp output.o -o rfact
 	validate "./rfact"
 fi
 
@@ -159,10 +184,342 @@ if [ $palindrome == 1 ];
 then	
 	cd ../palindrome
 	pwd
-	rm -rf output.ll palindrome
-	"$COMP" ./palindrome.c
-	$CLANG driver.cpp output.ll -o palindrome
+	rm -rf output.o palindrome
+	"$COMP" -c ./palindrome.c
+	$CLANG driver.cpp output.o -o palindrome
 	validate "./palindrome"
 fi
 
+if [ $shortcircuit == 1 ];
+then	
+	cd ../shortcircuit
+	pwd
+	rm -rf output.o shortcircuit
+	"$COMP" -c ./shortcircuit.c
+	$CLANG driver.cpp output.o -o shortcircuit
+	validate "./shortcircuit"
+fi
+
+if [ $levels == 1 ];
+then	
+	# every optimisation level, on float code and on calls and loops
+	for program in pi tiered; do
+		cd ../$program
+		pwd
+		for level in -O0 -O1 -O2 -O3 -Os; do
+			rm -rf output.o $program
+			"$COMP" -c $level ./$program.c
+			$CLANG driver.cpp output.o -o $program
+			validate "./$program"
+		done
+	done
+fi
+
+if [ $bitcode == 1 ];
+then	
+	cd ../pi
+	pwd
+	rm -rf output.bc output.o pi
+	# the bitcode -emit-bc writes, read back by the LLVM tools
+	"$COMP" -emit-bc ./pi.c
+	llvm-dis output.bc -o - | grep "define float @pi"
+	llc -filetype=obj -relocation-model=pic output.bc -o output.o
+	$CLANG driver.cpp output.o -o pi
+	validate "./pi"
+	rm -rf output.bc
+fi
+
+if [ $fast == 1 ];
+then	
+	# FastISel and unnamed values, on float code and on calls and loops
+	for program in cosine tiered; do
+		cd ../$program
+		pwd
+		rm -rf output.o $program
+		"$COMP" -c -fast ./$program.c
+		$CLANG driver.cpp output.o -o $program
+		validate "./$program"
+	done
+fi
+
+if [ $include == 1 ];
+then	
+	cd ../include
+	pwd
+	rm -rf output.o include
+	"$COMP" -c ./include.c
+	$CLANG driver.cpp output.o -o include
+	validate "./include"
+fi
+
+if [ $import == 1 ];
+then	
+	cd ../import
+	pwd
+	rm -rf output.o shapes.o shapes.mci import
+	"$COMP" --emit-interface ./shapes.c
+	"$COMP" -c ./shapes.c -o shapes.o
+	"$COMP" -c ./import.c
+	$CLANG driver.cpp output.o shapes.o -o import
+	validate "./import"
+fi
+
+if [ $library == 1 ];
+then	
+	cd ../library
+	pwd
+	rm -rf library
+	$CLANG driver.cpp ../../libmccomp.a `llvm-config --cxxflags --ldflags --system-libs --libs all` -o library
+	validate "./library"
+fi
+
+if [ $cache == 1 ];
+then	
+	cd ../cache
+	pwd
+	rm -rf cache-dir literal.c output.o cache
+	# the same function returning a literal goes into the cache first
+	sed 's/return i5;/return 5;/' cache.c > literal.c
+	"$COMP" -c -cache-dir cache-dir ./literal.c
+	"$COMP" -c -cache-dir cache-dir ./cache.c
+	$CLANG driver.cpp output.o -o cache
+	validate "./cache"
+	rm -rf cache-dir literal.c
+	# two files of 400 functions, each about 650 KB of entries, so a 1 MB
+	# cache holds one: the newer file's entries evict the older's
+	for name in older newer; do
+		for i in $(seq 400); do
+			printf 'int %s%d(int n) {\n    int i;\n    int acc;\n    i = 0;\n    acc = n;\n' $name $i
+			printf '    while (i < n) {\n        acc = acc * 3 + %d;\n        i = i + 1;\n    }\n' $i
+			printf '    return acc;\n}\n\n'
+		done > $name.c
+	done
+	"$COMP" -c -cache-dir cache-dir ./older.c -o older.o > /dev/null 2>&1
+	sleep 1
+	"$COMP" -c -cache-dir cache-dir -cache-size 1 ./newer.c -o newer.o > /dev/null 2>&1
+	"$COMP" -c -cache-dir cache-dir -cache-size 1 ./newer.c -o newer.o 2>&1 | grep "Cache: 400 hits, 0 misses"
+	"$COMP" -c -cache-dir cache-dir -cache-size 1 ./older.c -o older.o 2>&1 | grep "Cache: [0-9]* hits, [1-9][0-9]* misses"
+	rm -rf cache-dir older.c newer.c older.o newer.o
+fi
+
+if [ $multi == 1 ];
+then	
+	cd ../addition
+	pwd
+	rm -rf multi add fact broken.c
+	# several files in one process, each to an object of its own in multi/
+	"$COMP" -c ./addition.c ../factorial/factorial.c -o multi
+	$CLANG driver.cpp multi/addition.o -o add
+	validate "./add"
+	$CLANG ../factorial/driver.cpp multi/factorial.o -o fact
+	validate "./fact"
+	# a file with a semantic error fails the whole compile
+	printf 'int broken(int x) {\n    return y;\n}\n' > broken.c
+	rc=0; "$COMP" -c ./addition.c ./broken.c -o multi > /dev/null 2>&1 || rc=$?
+	if [[ $rc != 1 ]]; then echo "TEST FAILED *****"; exit 1; fi
+	rm -rf multi add fact broken.c
+fi
+
+if [ $shards == 1 ];
+then	
+	cd ../shards
+	pwd
+	rm -rf shards-j1.ll shards-j4.ll output.o shards
+	# shards generated on one thread or on four give the same IR
+	"$COMP" -j1 ./shards.c -o shards-j1.ll
+	"$COMP" -j4 ./shards.c -o shards-j4.ll
+	cmp shards-j1.ll shards-j4.ll
+	"$COMP" -c -j4 ./shards.c
+	$CLANG driver.cpp output.o -o shards
+	validate "./shards"
+	rm -rf shards-j1.ll shards-j4.ll
+fi
+
+if [ $pipeline == 1 ];
+then	
+	cd ../shards
+	pwd
+	rm -rf plain.ll pipelined.ll
+	# lexing, parsing and generating code concurrently gives the same IR
+	for program in ./shards.c ../tiered/tiered.c; do
+		for level in -O0 -O2; do
+			"$COMP" $level $program -o plain.ll
+			"$COMP" $level -pipeline $program -o pipelined.ll
+			cmp plain.ll pipelined.ll
+		done
+	done
+	rm -rf plain.ll pipelined.ll
+fi
+
+if [ $stream == 1 ];
+then	
+	cd ../shards
+	pwd
+	rm -rf output.o shards
+	# each shard is generated and emitted as soon as it has been parsed
+	"$COMP" -c -stream ./shards.c
+	$CLANG driver.cpp output.o -o shards
+	validate "./shards"
+fi
+
+# --watch rebuilds after each edit, parsing again only the declarations the
+# edit touches; what it writes must match a fresh compile of the edited file
+function rebuilt {
+	for i in $(seq 300); do
+		if [ $(grep -c "^Built" watch-ll.out) -ge $1 ] && [ $(grep -c "^Built" watch-o.out) -ge $1 ]; then break; fi
+		sleep 0.1
+	done
+	"$COMP" ./watched.c -o fresh.ll
+	cmp watched.ll fresh.ll
+	$CLANG driver.cpp watched.o -o shards
+	validate "./shards"
+}
+
+if [ $watch == 1 ];
+then	
+	cd ../shards
+	pwd
+	rm -rf watched.c watched.ll watched.o fresh.ll watch-ll.out watch-o.out shards
+	cp shards.c watched.c
+	"$COMP" --watch ./watched.c -o watched.ll 2> watch-ll.out &
+	watchers=$!
+	"$COMP" --watch -c ./watched.c -o watched.o 2> watch-o.out &
+	watchers="$watchers $!"
+	trap "kill $watchers" EXIT
+	rebuilt 1
+	# edits before the first declaration
+	sed -i '1i // edited' watched.c
+	rebuilt 2
+	sed -i '/^int step0(/i int zero(int x) {\n    return 0;\n}\n' watched.c
+	rebuilt 3
+	# an edit across the boundary between the first two shards
+	sed -i 's/step62(x) + 63/step62(x) + 60 + 3/; s/step63(x) + 64/step63(x) + 60 + 4/' watched.c
+	rebuilt 4
+	# a function inserted in the middle
+	sed -i '/^int step31(/i int extra(int x) {\n    return x;\n}\n' watched.c
+	rebuilt 5
+	# with -c an edited function is given a shard of its own, so the second
+	# edit of it generates only that shard
+	sed -i 's/+ 60 + 4/+ 61 + 3/' watched.c
+	rebuilt 6
+	sed -i 's/+ 61 + 3/+ 62 + 2/' watched.c
+	rebuilt 7
+	tail -1 watch-o.out | grep "generated 1 of"
+	kill $watchers
+	trap - EXIT
+	rm -rf watched.c watched.ll watched.o fresh.ll watch-ll.out watch-o.out
+fi
+
+if [ $server == 1 ];
+then	
+	cd ../factorial
+	pwd
+	rm -rf output.o fact mccomp.sock server.out
+	"$COMP" --server ./mccomp.sock 2> server.out &
+	serverpid=$!
+	trap "kill $serverpid" EXIT
+	for i in $(seq 100); do if [ -S mccomp.sock ]; then break; fi; sleep 0.1; done
+	# a compile through the server, of a file read from the client's stdin
+	"$DIR/mcclient" ./mccomp.sock -c - < ./factorial.c
+	$CLANG driver.cpp output.o -o fact
+	validate "./fact"
+	# the exit status of a failed compile comes back to the client
+	rc=0; "$DIR/mcclient" ./mccomp.sock -c ./missing.c 2> /dev/null || rc=$?
+	if [[ $rc != 1 ]]; then echo "TEST FAILED *****"; exit 1; fi
+	# requests that are too big or malformed are dropped without an answer,
+	# and at once, without waiting for the rest of the request
+	python3 - <<-'EOF'
+	import socket, struct
+	def field(data):
+	    return struct.pack("<I", len(data)) + data
+	def dropped(request, finished=False):
+	    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+	    s.settimeout(10)
+	    s.connect("mccomp.sock")
+	    s.sendall(request)
+	    if finished:
+	        s.shutdown(socket.SHUT_WR)
+	    assert s.recv(1) == b"", "the server answered %r" % request[:16]
+	start = field(b"/") + field(b"0") + field(b"")
+	dropped(struct.pack("<I", 0xffffffff))    # longer than MaxRequestField
+	dropped(start + field(b"100000"))         # more than MaxRequestArgs
+	dropped(start + field(b"two"))            # not a count
+	dropped(b"\x01\x00", finished=True)       # cut short
+	EOF
+	# and the server is still there
+	rm -f output.o
+	"$DIR/mcclient" ./mccomp.sock -c ./factorial.c
+	$CLANG driver.cpp output.o -o fact
+	validate "./fact"
+	kill $serverpid
+	trap - EXIT
+	rm -rf mccomp.sock server.out
+fi
+
+if [ $tiered == 1 ];
+then	
+	cd ../tiered
+	pwd
+	rm -rf output.o tiered
+	"$COMP" -c ./tiered.c
+	$CLANG driver.cpp output.o -o tiered
+	validate "./tiered"
+fi
+
+# the same programs run in process by mccomp --run, without a driver
+if [ $run == 1 ];
+then	
+	cd ../while
+	pwd
+	"$COMP" --run While ./while.c 1 | grep "Result: 10"
+	cd ../factorial
+	pwd
+	"$COMP" --run factorial ./factorial.c 10 | grep "Result: 3628800"
+	# a second run loads the object the first one compiled
+	rm -rf jit-cache
+	"$COMP" --run factorial -cache-dir jit-cache ./factorial.c 10 > /dev/null 2>&1
+	"$COMP" --run factorial -cache-dir jit-cache ./factorial.c 10 2>&1 | grep "Objects: 1 loaded"
+	rm -rf jit-cache
+	cd ../palindrome
+	pwd
+	"$COMP" --run palindrome ./palindrome.c 12321 | grep "Result: true"
+	"$COMP" --run palindrome -lazy ./palindrome.c 12321 | grep "Result: true"
+	cd ../recurse
+	pwd
+	"$COMP" --run recursion_driver -lazy ./recurse.c 20 | grep "Result: 210"
+	# callees are compiled on a pool of threads ahead of their first call
+	"$COMP" --run recursion_driver -lazy -j4 ./recurse.c 20 | grep "Result: 210"
+	"$COMP" --run rfact -lazy -j4 ../rfact/rfact.c 10 | grep "Result: 3628800"
+	cd ../tiered
+	pwd
+	# the loops and callees get hot and are compiled part way through
+	"$COMP" --run tiered -tiered ./tiered.c 3000 > tiered.out 2>&1
+	grep "Result: 215063" tiered.out
+	grep "Promoted: .*collatz" tiered.out
+	# a loop that gets hot in its only call finishes it in compiled code
+	"$COMP" --run pi -tiered ./tiered.c 200000 > tiered.out 2>&1
+	grep "Result: 3.141377" tiered.out
+	grep "Promoted: .*pi.loop0" tiered.out
+	rm tiered.out
+	"$COMP" --run palindrome -tiered ../palindrome/palindrome.c 12321 | grep "Result: true"
+	# line tables for perf, generated into every kind of JIT compiled code,
+	# and the perf map naming the functions each run compiled
+	for mode in -O2 -lazy -tiered; do
+		"$COMP" --run tiered -perf $mode ./tiered.c 3000 > perf.out &
+		pid=$!
+		wait $pid
+		grep "Result: 215063" perf.out
+		grep " tiered" /tmp/perf-$pid.map
+		grep " pi" /tmp/perf-$pid.map
+		grep " collatz" /tmp/perf-$pid.map
+		rm -f perf.out /tmp/perf-$pid.map
+	done
+	# the same again in the bytecode VM, which never starts the JIT
+	"$COMP" --run tiered -vm ./tiered.c 3000 | grep "Result: 215063"
+	"$COMP" --run palindrome -vm ../palindrome/palindrome.c 12321 | grep "Result: true"
+	"$COMP" --run recursion_driver -vm ../recurse/recurse.c 20 | grep "Result: 210"
+	"$COMP" --run shortcircuit -vm ../shortcircuit/shortcircuit.c 1 | grep "Result: 20110"
+	"$COMP" --run unary -vm ../unary/unary.c 2 3.0 | grep "Result: 4.000000"
+fi
+
 echo "***** ALL TESTS PASSED *****"
@@ -0,0 +1,30 @@
+#include <iostream>
+#include <cstdio>
+
+// clang++ driver.cpp tiered.ll -o tiered
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+static int printed = 0;
+
+extern "C" DLLEXPORT int print_int(int X) {
+  fprintf(stderr, "%d\n", X);
+  printed = X;
+  return 0;
+}
+
+extern "C" {
+  int tiered(int n);
+}
+
+int main() {
+  int steps = tiered(3000);
+  if (steps == 215063 && printed == 297000)
+    std::cout << "PASSED Result: " << steps << std::endl;
+  else
+    std::cout << "FAILED Result: " << steps << ", " << printed << " calls" << std::endl;
+}
@@ -0,0 +1,59 @@
+// MiniC program with functions that get hot enough for mccomp --run -tiered
+// to compile them while the rest of it is interpreted
+
+extern int print_int(int X);
+
+int calls;
+float total;
+
+float term(int i) {
+  calls = calls + 1;
+  return 4.0 / (i * (i + 1) * (i + 2));
+}
+
+// the series from tests/pi, to n terms
+float pi(int n) {
+  bool flag;
+  float PI;
+  int i;
+
+  flag = true;
+  PI = 3.0;
+  i = 2;
+  while (i < n) {
+    if (flag) {
+      PI = PI + term(i);
+    }
+    else {
+      PI = PI - term(i);
+    }
+    flag = !flag;
+    i = i + 2;
+  }
+  return PI;
+}
+
+int collatz(int n) {
+  if (n == 1) {
+    return 0;
+  }
+  if (n % 2 == 0) {
+    return 1 + collatz(n / 2);
+  }
+  return 1 + collatz(3 * n + 1);
+}
+
+int tiered(int n) {
+  int i;
+  int steps;
+
+  i = 1;
+  steps = 0;
+  while (i <= n) {
+    steps = steps + collatz(i);
+    total = total + pi(200);
+    i = i + 1;
+  }
+  print_int(calls);
+  return steps;
+}